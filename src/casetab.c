@@ -0,0 +1,248 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "cellmark.h"
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dispatch tables for case.
+ *
+ * The first time a (case key clause ...) form is run, a hash table from
+ * each datum of its clauses to the clause is made, and kept for the form;
+ * then each dispatch is a lookup. The forms are told apart by the cell of
+ * their arguments (the site). The tables don't keep anything alive: when
+ * the site is collected by gc its table is freed (see gc_case_tables()).
+ *
+ * Datums are compared with eqv?; numbers hash by value, anything else by
+ * its SEXPR.
+ */
+
+struct case_entry {
+	SEXPR datum;
+	SEXPR clause;
+};
+
+struct case_table {
+	SEXPR site;
+	/* the clauses the table was made from */
+	SEXPR clauses;
+	SEXPR else_clause;
+	/* a power of 2, with at least half the entries free */
+	unsigned int size;
+	struct case_entry *entries;
+};
+
+/* The tables, indexed by site with open addressing. */
+static struct case_table **s_tables;
+static unsigned int s_tables_size;
+static unsigned int s_ntables;
+
+static void *case_alloc(size_t n)
+{
+	void *p;
+
+	p = calloc(1, n);
+	if (p == NULL) {
+		throw_err("out of heap space for case tables");
+	}
+
+	return p;
+}
+
+static unsigned int hash_datum(SEXPR e)
+{
+	unsigned long long u;
+	double d;
+
+	if (p_numberp(e)) {
+		d = number_real_value(sexpr_number(e));
+		if (d == 0) {
+			/* -0.0 is = to 0.0 */
+			d = 0;
+		}
+		memcpy(&u, &d, sizeof(u) < sizeof(d) ? sizeof(u) : sizeof(d));
+		return (unsigned int) (u ^ (u >> 29) ^ (u >> 47));
+	}
+
+	return (unsigned int) e * 2654435761u;
+}
+
+static struct case_entry *find_entry(struct case_table *pt, SEXPR datum)
+{
+	struct case_entry *pe;
+	unsigned int i;
+
+	i = hash_datum(datum) & (pt->size - 1);
+	for (;;) {
+		pe = &pt->entries[i];
+		if (p_nullp(pe->clause) || p_eqvp(pe->datum, datum)) {
+			return pe;
+		}
+		i = (i + 1) & (pt->size - 1);
+	}
+}
+
+static int is_else(SEXPR e)
+{
+	return p_symbolp(e) && strcmp(sexpr_name(e), "else") == 0;
+}
+
+/* Makes the table for the clauses of a case on site. */
+static struct case_table *make_case_table(SEXPR site, SEXPR clauses)
+{
+	struct case_table *pt;
+	struct case_entry *pe;
+	SEXPR c, d;
+	unsigned int ndatums;
+
+	if (s_in_region) {
+		region_escaped();
+	}
+
+	ndatums = 0;
+	for (c = clauses; p_pairp(c); c = p_cdr(c)) {
+		if (!p_pairp(p_car(c))) {
+			throw_err("case: bad clause");
+		}
+		for (d = p_car(p_car(c)); p_pairp(d); d = p_cdr(d)) {
+			ndatums++;
+		}
+	}
+
+	pt = case_alloc(sizeof(*pt));
+	pt->site = site;
+	pt->clauses = clauses;
+	pt->else_clause = SEXPR_NIL;
+	for (pt->size = 4; pt->size < ndatums * 2; pt->size *= 2)
+		;
+	pt->entries = case_alloc(pt->size * sizeof(*pt->entries));
+
+	for (c = clauses; p_pairp(c); c = p_cdr(c)) {
+		d = p_car(p_car(c));
+		if (is_else(d)) {
+			if (!p_nullp(p_cdr(c))) {
+				throw_err("case: else must be the last clause");
+			}
+			pt->else_clause = p_car(c);
+			break;
+		}
+		for (; p_pairp(d); d = p_cdr(d)) {
+			pe = find_entry(pt, p_car(d));
+			/* the first clause with a datum wins */
+			if (p_nullp(pe->clause)) {
+				pe->datum = p_car(d);
+				pe->clause = p_car(c);
+			}
+		}
+	}
+
+	return pt;
+}
+
+static void free_case_table(struct case_table *pt)
+{
+	free(pt->entries);
+	free(pt);
+}
+
+static struct case_table **find_table(SEXPR site)
+{
+	struct case_table **ppt;
+	unsigned int i;
+
+	i = (unsigned int) sexpr_index(site) & (s_tables_size - 1);
+	for (;;) {
+		ppt = &s_tables[i];
+		if (*ppt == NULL || p_eqp((*ppt)->site, site)) {
+			return ppt;
+		}
+		i = (i + 1) & (s_tables_size - 1);
+	}
+}
+
+/* Makes room for the tables and puts back in their place the ones in old. */
+static void rehash_tables(struct case_table **old, unsigned int oldsize)
+{
+	unsigned int i;
+
+	s_tables = case_alloc(s_tables_size * sizeof(*s_tables));
+	s_ntables = 0;
+	for (i = 0; i < oldsize; i++) {
+		if (old[i] != NULL) {
+			*find_table(old[i]->site) = old[i];
+			s_ntables++;
+		}
+	}
+	free(old);
+}
+
+/*
+ * Returns the clause of the case on site, whose clauses are clauses, for
+ * key: the one with a datum eqv? to key, else the else clause or ().
+ */
+SEXPR case_clause(SEXPR site, SEXPR clauses, SEXPR key)
+{
+	struct case_table **ppt;
+	struct case_entry *pe;
+	unsigned int n;
+
+	if (s_ntables * 2 >= s_tables_size) {
+		ppt = s_tables;
+		n = s_tables_size;
+		s_tables_size = (n == 0) ? 64 : n * 2;
+		rehash_tables(ppt, n);
+	}
+
+	ppt = find_table(site);
+	if (*ppt != NULL && !p_eqp((*ppt)->clauses, clauses)) {
+		/* the form was changed */
+		free_case_table(*ppt);
+		*ppt = NULL;
+		s_ntables--;
+	}
+	if (*ppt == NULL) {
+		*ppt = make_case_table(site, clauses);
+		s_ntables++;
+	}
+
+	pe = find_entry(*ppt, key);
+	return p_nullp(pe->clause) ? (*ppt)->else_clause : pe->clause;
+}
+
+/* Called by gc after marking: frees the tables of the sites not marked. */
+void gc_case_tables(void)
+{
+	unsigned int i;
+	int any;
+
+	any = 0;
+	for (i = 0; i < s_tables_size; i++) {
+		if (s_tables[i] != NULL &&
+		    !cell_marked(sexpr_index(s_tables[i]->site)))
+		{
+			free_case_table(s_tables[i]);
+			s_tables[i] = NULL;
+			any = 1;
+		}
+	}
+
+	if (any) {
+		rehash_tables(s_tables, s_tables_size);
+	}
+}
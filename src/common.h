@@ -9,6 +9,7 @@
 /* pred.c */
 
 int s_tailrec;
+extern SEXPR s_newframe;
 
 int p_nullp(SEXPR e);
 int p_pairp(SEXPR e);
@@ -18,6 +19,11 @@ int p_complexp(SEXPR e);
 int p_realp(SEXPR e);
 int p_integerp(SEXPR e);
 int p_exactp(SEXPR e);
+int p_promisep(SEXPR e);
+int p_vectorp(SEXPR e);
+int p_hashtablep(SEXPR e);
+int p_weak_pairp(SEXPR e);
+SEXPR p_force(SEXPR e);
 SEXPR p_car(SEXPR e);
 SEXPR p_cdr(SEXPR e);
 int p_eqp(SEXPR x, SEXPR y);
@@ -27,9 +33,10 @@ SEXPR p_setcar(SEXPR e, SEXPR val);
 SEXPR p_setcdr(SEXPR e, SEXPR val);
 void p_evlis(void);
 void p_eval(void);
-void p_evargs(void);
+int p_evargs(void);
 void p_evseq(int eval_last);
-void p_apply(void);
+void p_apply(int argc);
+SEXPR p_call(int argc);
 
 void p_print(SEXPR sexpr);
 void p_println(SEXPR sexpr);
@@ -40,6 +47,10 @@ void p_println_env(SEXPR env);
 extern SEXPR s_topenv;
 extern SEXPR s_env;
 extern SEXPR s_quote_atom;
+extern SEXPR s_define_atom;
+extern SEXPR s_fold_atom;
+extern SEXPR s_inline_atom;
+extern SEXPR s_site_atom;
 extern SEXPR s_expr;
 extern SEXPR s_val;
 extern SEXPR s_proc;
@@ -47,6 +58,9 @@ extern SEXPR s_args;
 extern SEXPR s_unev;
 
 int pop_free_cell(void);
+void free_cell(int celli);
+int seal_static(void);
+void free_environment(SEXPR env);
 SEXPR p_cons(SEXPR first, SEXPR rest);
 
 void clear_stack(void);
@@ -55,6 +69,7 @@ void push2(SEXPR e1, SEXPR e2);
 void push3(SEXPR e1, SEXPR e2, SEXPR e3);
 SEXPR pop(void);
 void popn(int n);
+SEXPR *stack_top(int n);
 int stack_empty(void);
 
 void gcbase_init(void);
@@ -78,18 +93,278 @@ SEXPR get_sexpr(struct parser *p, int *errorc);
 
 /* env.c */
 
+extern int s_captures;
+
 SEXPR make_environment(SEXPR parent);
+SEXPR lookup_local_variable(SEXPR var, SEXPR env);
 SEXPR lookup_variable(SEXPR var, SEXPR env);
 void define_variable(void);
+void hoist_defines(SEXPR body);
+SEXPR closure_environment(SEXPR params, SEXPR body);
 SEXPR set_variable(SEXPR var, SEXPR val, SEXPR env);
-void extend_environment(void);
+void extend_environment(int argc, SEXPR *argv);
+int rebind_environment(int argc, SEXPR *argv);
+
+/* casetab.c */
+
+SEXPR case_clause(SEXPR site, SEXPR clauses, SEXPR key);
+void gc_case_tables(void);
+
+/* fold.c */
+
+void fold_procedure(SEXPR params, SEXPR body);
+void fold_special(void);
+void inline_special(void);
+
+/* sites.c */
+
+enum {
+	SITE_ADD, SITE_SUB, SITE_MUL, SITE_DIV,
+	SITE_EQ, SITE_LT, SITE_GT, SITE_LE, SITE_GE,
+	SITE_CAR, SITE_CDR,
+};
+
+enum {
+	KIND_FLONUM = 1,
+	KIND_PAIR = 2,
+	KIND_OTHER = 4,
+};
+
+int site_kind(SEXPR e);
+int declared_kind(SEXPR type);
+SEXPR make_site(SEXPR bind, SEXPR call, int kind);
+int site_flonum(SEXPR e);
+void site_special(void);
+void gc_sites(void);
+
+/* vectors.c */
+
+enum {
+	VECTOR_GENERAL,
+	VECTOR_F64,
+	VECTOR_S64,
+	/* the persistent maps and vectors of persist.c, and their nodes */
+	VECTOR_PMAP,
+	VECTOR_PMAP_NODE,
+	VECTOR_PMAP_COLLISION,
+	VECTOR_PVEC,
+	VECTOR_PVEC_NODE,
+	/* records and record types of records.c */
+	VECTOR_RECORD,
+	VECTOR_RECORD_TYPE,
+};
+
+void vectors_gc_check(void);
+SEXPR alloc_vector_of_kind(int kind, int n, int elem_size);
+SEXPR make_vector_of_kind(int kind, int n, int elem_size);
+SEXPR make_vector(int n, SEXPR fill);
+SEXPR make_vector_from_list(SEXPR p);
+int vector_size(SEXPR v);
+int vector_kind(SEXPR v);
+void *vector_data(SEXPR v);
+int vector_sexprs_start(SEXPR v);
+SEXPR *vector_elems(SEXPR v);
+int if_vector_mark(int i);
+int vector_marked(int i);
+int vector_index_arg(SEXPR e, int n, int end);
+void gc_vectors(void);
+
+void vectorp(int argc, SEXPR *argv);
+void make_vector_fn(int argc, SEXPR *argv);
+void vector_fn(int argc, SEXPR *argv);
+void vector_length(int argc, SEXPR *argv);
+void vector_ref(int argc, SEXPR *argv);
+void vector_set(int argc, SEXPR *argv);
+void vector_to_list(int argc, SEXPR *argv);
+void list_to_vector(int argc, SEXPR *argv);
+void vector_fill(int argc, SEXPR *argv);
+
+/* numvec.c */
+
+SEXPR make_number_vector_from_list(int kind, SEXPR p);
+void print_number_vector(SEXPR v);
+int number_vectors_equalp(SEXPR x, SEXPR y);
+
+void make_f64vector(int argc, SEXPR *argv);
+void f64vector(int argc, SEXPR *argv);
+void f64vectorp(int argc, SEXPR *argv);
+void f64vector_length(int argc, SEXPR *argv);
+void f64vector_ref(int argc, SEXPR *argv);
+void f64vector_set(int argc, SEXPR *argv);
+void f64vector_to_list(int argc, SEXPR *argv);
+void list_to_f64vector(int argc, SEXPR *argv);
+void f64vector_add(int argc, SEXPR *argv);
+void f64vector_scale(int argc, SEXPR *argv);
+void f64vector_dot(int argc, SEXPR *argv);
+void f64vector_sum(int argc, SEXPR *argv);
+void f64vector_min(int argc, SEXPR *argv);
+void f64vector_max(int argc, SEXPR *argv);
+void f64vector_map(int argc, SEXPR *argv);
+
+void make_s64vector(int argc, SEXPR *argv);
+void s64vector(int argc, SEXPR *argv);
+void s64vectorp(int argc, SEXPR *argv);
+void s64vector_length(int argc, SEXPR *argv);
+void s64vector_ref(int argc, SEXPR *argv);
+void s64vector_set(int argc, SEXPR *argv);
+void s64vector_to_list(int argc, SEXPR *argv);
+void list_to_s64vector(int argc, SEXPR *argv);
+void s64vector_add(int argc, SEXPR *argv);
+void s64vector_scale(int argc, SEXPR *argv);
+void s64vector_dot(int argc, SEXPR *argv);
+void s64vector_sum(int argc, SEXPR *argv);
+void s64vector_min(int argc, SEXPR *argv);
+void s64vector_max(int argc, SEXPR *argv);
+void s64vector_map(int argc, SEXPR *argv);
+
+/* hashtab.c */
+
+enum {
+	HASH_EQ,
+	HASH_EQV,
+	HASH_EQUAL,
+};
+
+unsigned int hash_equiv(int equiv, SEXPR key);
+int same_equiv(int equiv, SEXPR x, SEXPR y);
+SEXPR make_hashtable(int equiv);
+SEXPR hashtable_ref(SEXPR t, SEXPR key, SEXPR dflt);
+void hashtable_set(SEXPR t, SEXPR key, SEXPR val);
+int hashtable_delete(SEXPR t, SEXPR key);
+int hashtable_count(SEXPR t);
+int hashtable_slot(SEXPR t, int i, SEXPR *pkey, SEXPR *pval);
+void hashtable_delete_slot(SEXPR t, int i);
+int hashtable_weak(SEXPR t);
+int hashtable_marked(int i);
+int if_hashtable_mark(int i);
+void gc_hashtables(void);
+
+void hashtablep(int argc, SEXPR *argv);
+void make_hashtable_fn(int argc, SEXPR *argv);
+void make_weak_hashtable_fn(int argc, SEXPR *argv);
+void hashtable_ref_fn(int argc, SEXPR *argv);
+void hashtable_ref_default(int argc, SEXPR *argv);
+void hashtable_set_fn(int argc, SEXPR *argv);
+void hashtable_delete_fn(int argc, SEXPR *argv);
+void hashtable_contains(int argc, SEXPR *argv);
+void hashtable_update(int argc, SEXPR *argv);
+void hashtable_update_default(int argc, SEXPR *argv);
+void hashtable_count_fn(int argc, SEXPR *argv);
+void hashtable_walk(int argc, SEXPR *argv);
+void hashtable_keys(int argc, SEXPR *argv);
+void hashtable_values(int argc, SEXPR *argv);
+void hashtable_to_alist(int argc, SEXPR *argv);
+
+/* persist.c */
+
+int persistent_raw_slots(int kind);
+void print_persistent(SEXPR v);
+int persistent_equalp(SEXPR x, SEXPR y);
+
+void make_pmap(int argc, SEXPR *argv);
+void pmapp(int argc, SEXPR *argv);
+void pmap_count(int argc, SEXPR *argv);
+void pmap_ref(int argc, SEXPR *argv);
+void pmap_contains(int argc, SEXPR *argv);
+void pmap_set(int argc, SEXPR *argv);
+void pmap_delete(int argc, SEXPR *argv);
+void pmap_set_in_place(int argc, SEXPR *argv);
+void pmap_delete_in_place(int argc, SEXPR *argv);
+void pmap_transient(int argc, SEXPR *argv);
+void pmap_persistent(int argc, SEXPR *argv);
+void pmap_to_alist(int argc, SEXPR *argv);
+
+void pvector(int argc, SEXPR *argv);
+void list_to_pvector(int argc, SEXPR *argv);
+void pvectorp(int argc, SEXPR *argv);
+void pvector_length(int argc, SEXPR *argv);
+void pvector_ref(int argc, SEXPR *argv);
+void pvector_set(int argc, SEXPR *argv);
+void pvector_push(int argc, SEXPR *argv);
+void pvector_pop(int argc, SEXPR *argv);
+void pvector_set_in_place(int argc, SEXPR *argv);
+void pvector_push_in_place(int argc, SEXPR *argv);
+void pvector_pop_in_place(int argc, SEXPR *argv);
+void pvector_transient(int argc, SEXPR *argv);
+void pvector_persistent(int argc, SEXPR *argv);
+void pvector_to_list(int argc, SEXPR *argv);
+
+/* hcons.c */
+
+int pair_frozen(SEXPR e);
+void gc_hcons(void);
+
+void hcons(int argc, SEXPR *argv);
+void freeze_fn(int argc, SEXPR *argv);
+void frozenp(int argc, SEXPR *argv);
+
+/* records.c */
+
+void define_record_type(void);
+void print_record(SEXPR r);
+
+/* region.c */
+
+void region_free_cell(int celli);
+void region_escaped(void);
+void region_store(SEXPR obj, SEXPR val);
+void gc_region(void);
+void region_abandon(void);
+void with_region(void);
+
+/* ext.c */
+
+typedef void (*datum_fun)(int datum, int argc, SEXPR *argv);
+
+SEXPR make_datum_function(const char *name, int minargs, int maxargs,
+			  datum_fun fun, int datum);
+void apply_ext_function(int i, int argc, SEXPR *argv);
+const char *ext_function_name(int i);
+void load_extension(SEXPR path);
+SEXPR foreign_procedure(SEXPR lib, SEXPR name, SEXPR argtypes, SEXPR rettype);
+
+/* lists.c */
+
+void length(int argc, SEXPR *argv);
+void reverse(int argc, SEXPR *argv);
+void append(int argc, SEXPR *argv);
+void list_tail(int argc, SEXPR *argv);
+void list_ref(int argc, SEXPR *argv);
+void list_copy(int argc, SEXPR *argv);
+void listp(int argc, SEXPR *argv);
+void memq(int argc, SEXPR *argv);
+void memv(int argc, SEXPR *argv);
+void member(int argc, SEXPR *argv);
+void assq(int argc, SEXPR *argv);
+void assv(int argc, SEXPR *argv);
+void assoc(int argc, SEXPR *argv);
+void maximum(int argc, SEXPR *argv);
+void minimum(int argc, SEXPR *argv);
+void map(int argc, SEXPR *argv);
+void for_each(int argc, SEXPR *argv);
+void filter(int argc, SEXPR *argv);
+void fold_left(int argc, SEXPR *argv);
+void fold_right(int argc, SEXPR *argv);
+void sort(int argc, SEXPR *argv);
+void sort_in_place(int argc, SEXPR *argv);
+void list_sort(int argc, SEXPR *argv);
+void merge(int argc, SEXPR *argv);
+
+/* syntax.c */
+
+SEXPR syntax_expand(SEXPR rules, SEXPR args);
 
 /* lispe.c */
 
-void apply_builtin_function(int i);
+SEXPR make_ext_function(int i);
+void apply_builtin_function(int i, int argc, SEXPR *argv);
 void apply_builtin_special(int i);
 const char *builtin_function_name(int i);
 const char *builtin_special_name(int i);
+int builtin_compare_op(int i);
+int builtin_equivalence(int i);
+int builtin_function_pure(int i);
+int builtin_site_op(int i);
 int builtin_special_tailrec(int i);
 int builtin_function_tailrec(int i);
 
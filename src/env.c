@@ -9,6 +9,14 @@
 #include "err.h"
 #include <assert.h>
 
+/*
+ * Incremented each time an environment other than the top one can be kept
+ * by a procedure, special or promise. If it does not change while a
+ * procedure runs, nothing can refer to its environment when it returns,
+ * and the environment is freed (see p_eval()).
+ */
+int s_captures;
+
 SEXPR make_environment(SEXPR parent)
 {
 	return p_cons(parent, SEXPR_NIL);
@@ -17,7 +25,7 @@ SEXPR make_environment(SEXPR parent)
 /* Looks up a variable only in the environment env (not parents).
  * Returns the cons(variable, value).
  */
-static SEXPR lookup_local_variable(SEXPR var, SEXPR env)
+SEXPR lookup_local_variable(SEXPR var, SEXPR env)
 {
 	SEXPR link, bind;
 
@@ -89,6 +97,118 @@ SEXPR define_variable(SEXPR var, SEXPR val, SEXPR env)
 }
 #endif
 
+/*
+ * Defines on s_env the variables defined by (define var ...) or
+ * (define (var ...) ...) at the start level of body, with () as value, so
+ * they are there for the procedures made before their definition (see
+ * closure_environment()).
+ */
+void hoist_defines(SEXPR body)
+{
+	SEXPR form, var;
+
+	push(body);
+	for (; p_pairp(body); body = p_cdr(body)) {
+		form = p_car(body);
+		if (!p_pairp(form) || !p_eqp(p_car(form), s_define_atom) ||
+		    !p_pairp(p_cdr(form)))
+		{
+			continue;
+		}
+		var = p_car(p_cdr(form));
+		if (p_pairp(var)) {
+			var = p_car(var);
+		}
+		if (p_symbolp(var) &&
+		    p_nullp(lookup_local_variable(var, s_env)))
+		{
+			s_expr = var;
+			s_val = SEXPR_NIL;
+			define_variable();
+		}
+	}
+	pop();
+}
+
+static int is_param(SEXPR var, SEXPR params)
+{
+	while (p_pairp(params)) {
+		if (p_eqp(var, p_car(params))) {
+			return 1;
+		}
+		params = p_cdr(params);
+	}
+
+	return p_eqp(var, params);
+}
+
+/*
+ * Adds to the environment *pframe the bindings on s_env, up to the top
+ * environment, of the symbols on e that are not in params.
+ * Returns 0 if one of them is bound to a special, local or global, whose
+ * expansion may refer to any variable.
+ */
+static int capture_variables(SEXPR e, SEXPR params, SEXPR *pframe)
+{
+	SEXPR env, bind;
+
+	while (p_pairp(e)) {
+		if (!capture_variables(p_car(e), params, pframe)) {
+			return 0;
+		}
+		e = p_cdr(e);
+	}
+
+	if (!p_symbolp(e) || is_param(e, params) ||
+	    !p_nullp(lookup_local_variable(e, *pframe)))
+	{
+		return 1;
+	}
+
+	for (env = s_env; !p_nullp(env) && !p_eqp(env, s_topenv);
+	     env = p_car(env))
+	{
+		bind = lookup_local_variable(e, env);
+		if (!p_nullp(bind)) {
+			if (sexpr_type(p_cdr(bind)) == SEXPR_SPECIAL) {
+				return 0;
+			}
+			p_setcdr(*pframe, p_cons(bind, p_cdr(*pframe)));
+			return 1;
+		}
+	}
+
+	bind = lookup_variable(e, s_topenv);
+	return p_nullp(bind) || sexpr_type(p_cdr(bind)) != SEXPR_SPECIAL;
+}
+
+/*
+ * Returns the environment to save on a procedure made on s_env.
+ * A procedure does not keep the whole s_env but a new environment, child of
+ * the top one, with the bindings of the local variables it refers to.
+ * The bindings are shared with s_env, so set! is seen by both, and the
+ * procedure does not keep alive the rest of the bindings.
+ */
+SEXPR closure_environment(SEXPR params, SEXPR body)
+{
+	SEXPR *pframe, env;
+
+	if (p_eqp(s_env, s_topenv)) {
+		return s_topenv;
+	}
+
+	s_captures++;
+	push(make_environment(s_topenv));
+	pframe = stack_top(1);
+	if (!capture_variables(body, params, pframe)) {
+		pop();
+		return s_env;
+	}
+	env = pop();
+
+	return p_nullp(p_cdr(env)) ? s_topenv : env;
+}
+
 /* Sets a varable (must exist) in the environment env or parent environments.
  */
 SEXPR set_variable(SEXPR var, SEXPR val, SEXPR env)
@@ -141,41 +261,91 @@ void extend_environment(SEXPR env, SEXPR params, SEXPR args)
 }
 #endif
 
-// s_env, s_unev (params), s_args
-void extend_environment(void)
+/* Makes the list of the argc expressions in argv. */
+static SEXPR list_from_args(int argc, SEXPR *argv)
 {
-	if (p_nullp(s_unev))
-		return;
+	SEXPR p;
 
-	if (p_symbolp(s_unev)) {
-		/* (lambda x x)
-		 * The procedure takes n arguments, combined on a list in x.
-		 */
-		s_expr = s_unev;
-		s_val = s_args;
-		define_variable();
-		return;
+	p = SEXPR_NIL;
+	while (argc > 0) {
+		argc--;
+		p = p_cons(argv[argc], p);
 	}
 
-	s_expr = p_car(s_unev);
-	s_val = p_car(s_args);
-	define_variable();
-	s_unev = p_cdr(s_unev);
-	s_args = p_cdr(s_args);
+	return p;
+}
+
+/* Pairs the parameters in s_unev with the argc arguments in argv, which must
+ * be protected from gc (they are on the stack).
+ * s_env, s_unev (params)
+ */
+void extend_environment(int argc, SEXPR *argv)
+{
+	int i;
+
+	i = 0;
 	while (!p_nullp(s_unev)) {
 		if (p_pairp(s_unev)) {
 			/* lambda () or lambda (a b ...) */
+			if (i == argc) {
+				throw_err("too few arguments for procedure");
+			}
 			s_expr = p_car(s_unev);
-			s_val = p_car(s_args);
+			s_val = argv[i++];
 			define_variable();
 			s_unev = p_cdr(s_unev);
-			s_args = p_cdr(s_args);
 		} else {
-			/* lambda (a b . rest) */
+			/* lambda x or lambda (a b . rest)
+			 * The procedure takes n arguments, combined on a list.
+			 */
+			s_val = list_from_args(argc - i, argv + i);
 			s_expr = s_unev;
-			s_val = s_args;
 			define_variable();
-			break;
+			return;
 		}
 	}
+
+	if (i < argc) {
+		throw_err("too many arguments for procedure");
+	}
+}
+
+/*
+ * Pairs again the parameters in s_unev with the argc arguments in argv, on
+ * the environment s_env made by extend_environment() for the same
+ * parameters. Returns 0, changing nothing, if s_env has more bindings than
+ * the parameters.
+ */
+int rebind_environment(int argc, SEXPR *argv)
+{
+	SEXPR params, link;
+	int nparams, nbinds, i;
+
+	nparams = 0;
+	for (params = s_unev; p_pairp(params); params = p_cdr(params)) {
+		nparams++;
+	}
+	nbinds = 0;
+	for (link = p_cdr(s_env); !p_nullp(link); link = p_cdr(link)) {
+		nbinds++;
+	}
+	if (nbinds != nparams + !p_nullp(params)) {
+		return 0;
+	}
+
+	if (argc < nparams) {
+		throw_err("too few arguments for procedure");
+	} else if (argc > nparams && p_nullp(params)) {
+		throw_err("too many arguments for procedure");
+	}
+
+	for (i = 0; p_pairp(s_unev); s_unev = p_cdr(s_unev)) {
+		p_setcdr(lookup_local_variable(p_car(s_unev), s_env), argv[i++]);
+	}
+	if (!p_nullp(s_unev)) {
+		p_setcdr(lookup_local_variable(s_unev, s_env),
+			 list_from_args(argc - i, argv + i));
+	}
+
+	return 1;
 }
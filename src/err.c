@@ -9,12 +9,15 @@
 #endif
 
 jmp_buf s_err_buf; 
+int s_err_quiet;
 
 void throw_err(const char *s)
 {
-	printf("lispe: ** error **\n");
-	if (s) {
-		printf("lispe: %s\n", s);
+	if (!s_err_quiet) {
+		printf("lispe: ** error **\n");
+		if (s) {
+			printf("lispe: %s\n", s);
+		}
 	}
 	longjmp(s_err_buf, 1);
 }
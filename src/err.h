@@ -13,6 +13,9 @@
 
 extern jmp_buf s_err_buf; 
 
+/* If not 0, errors are not printed. */
+extern int s_err_quiet;
+
 void throw_err(const char *s);
 
 #endif
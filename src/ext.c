@@ -0,0 +1,393 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "symbols.h"
+#include "common.h"
+#include "err.h"
+#include "lispe_ext.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+
+/*
+ * Procedures added at run time: the ones registered by extensions loaded
+ * with (load-extension "file.so"), the C functions reached with
+ * (foreign-procedure "lib.so" "name" (double ...) double), and the ones
+ * made by the interpreter itself with make_datum_function(), like the
+ * procedures of record types.
+ * They are builtin functions whose index is after the compiled in ones (see
+ * make_ext_function()).
+ */
+
+enum {
+	/* Max number of arguments for a foreign procedure. */
+	MAX_FOREIGN_ARGS = 4,
+	/* Max length of library and function names. */
+	MAX_EXT_NAME = 256
+};
+
+enum {
+	CTYPE_DOUBLE,
+	CTYPE_INT,
+};
+
+struct ext_function {
+	char *name;
+	int minargs;
+	int maxargs;
+	/* for extensions */
+	lispe_fun fun;
+	/* for foreign procedures */
+	void *cfun;
+	int crettype;
+	/* for make_datum_function() */
+	datum_fun dfun;
+	int datum;
+};
+
+static struct ext_function *s_ext_functions;
+static int s_ext_nfunctions;
+static int s_ext_capacity;
+
+static char *copy_name(const char *s)
+{
+	char *p;
+
+	p = malloc(strlen(s) + 1);
+	if (p == NULL) {
+		fprintf(stderr, "lispe: out of heap space for extensions\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(p, s);
+	return p;
+}
+
+/* Adds a new function to the table and returns its index. */
+static int add_ext_function(const char *name, int minargs, int maxargs)
+{
+	struct ext_function *pext;
+	int n;
+
+	if (s_ext_nfunctions == s_ext_capacity) {
+		n = (s_ext_capacity == 0) ? 16 : s_ext_capacity * 2;
+		pext = realloc(s_ext_functions, n * sizeof(*pext));
+		if (pext == NULL) {
+			throw_err("out of heap space for extensions");
+		}
+		s_ext_functions = pext;
+		s_ext_capacity = n;
+	}
+
+	pext = &s_ext_functions[s_ext_nfunctions];
+	pext->name = copy_name(name);
+	pext->minargs = minargs;
+	pext->maxargs = maxargs;
+	pext->fun = NULL;
+	pext->cfun = NULL;
+	pext->crettype = CTYPE_DOUBLE;
+	pext->dfun = NULL;
+	pext->datum = 0;
+	return s_ext_nfunctions++;
+}
+
+const char *ext_function_name(int i)
+{
+	assert(i >= 0 && i < s_ext_nfunctions);
+	return s_ext_functions[i].name;
+}
+
+static real_t real_arg(SEXPR e)
+{
+	if (!p_realp(e)) {
+		throw_err("bad argument for foreign procedure: not a real");
+	}
+
+	return number_real_value(sexpr_number(e));
+}
+
+static void apply_foreign(struct ext_function *pext, int argc, SEXPR *argv)
+{
+	struct number n;
+	double a[MAX_FOREIGN_ARGS];
+	double r;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		a[i] = real_arg(argv[i]);
+	}
+
+	if (pext->crettype == CTYPE_INT) {
+		switch (argc) {
+		case 0: r = ((int (*)(void)) pext->cfun)(); break;
+		case 1: r = ((int (*)(double)) pext->cfun)(a[0]); break;
+		case 2: r = ((int (*)(double, double)) pext->cfun)(a[0], a[1]);
+			break;
+		case 3: r = ((int (*)(double, double, double))
+				pext->cfun)(a[0], a[1], a[2]);
+			break;
+		default: r = ((int (*)(double, double, double, double))
+				pext->cfun)(a[0], a[1], a[2], a[3]);
+		}
+	} else {
+		switch (argc) {
+		case 0: r = ((double (*)(void)) pext->cfun)(); break;
+		case 1: r = ((double (*)(double)) pext->cfun)(a[0]); break;
+		case 2: r = ((double (*)(double, double))
+				pext->cfun)(a[0], a[1]);
+			break;
+		case 3: r = ((double (*)(double, double, double))
+				pext->cfun)(a[0], a[1], a[2]);
+			break;
+		default: r = ((double (*)(double, double, double, double))
+				pext->cfun)(a[0], a[1], a[2], a[3]);
+		}
+	}
+
+	build_real_number(&n, r);
+	s_val = make_number(&n);
+}
+
+void apply_ext_function(int i, int argc, SEXPR *argv)
+{
+	struct ext_function *pext;
+
+	chkrange(i, s_ext_nfunctions);
+	pext = &s_ext_functions[i];
+	if (argc < pext->minargs) {
+		throw_err("too few arguments for builtin procedure");
+	}
+	if (pext->maxargs != LISPE_ANYARGS && argc > pext->maxargs) {
+		throw_err("too many arguments for builtin procedure");
+	}
+
+	if (pext->dfun != NULL) {
+		pext->dfun(pext->datum, argc, argv);
+	} else if (pext->cfun != NULL) {
+		apply_foreign(pext, argc, argv);
+	} else {
+		s_val = pext->fun(argc, argv);
+	}
+}
+
+/*
+ * Returns a new builtin function named name, that calls fun with datum
+ * and its arguments.
+ */
+SEXPR make_datum_function(const char *name, int minargs, int maxargs,
+			  datum_fun fun, int datum)
+{
+	int i;
+
+	i = add_ext_function(name, minargs, maxargs);
+	s_ext_functions[i].dfun = fun;
+	s_ext_functions[i].datum = datum;
+	return make_ext_function(i);
+}
+
+/*********************************************************
+ * The API given to extensions.
+ *********************************************************/
+
+static void api_define_builtin(const char *name, lispe_fun fun,
+			       int minargs, int maxargs)
+{
+	int i;
+
+	i = add_ext_function(name, minargs, maxargs);
+	s_ext_functions[i].fun = fun;
+
+	s_val = make_ext_function(i);
+	s_expr = make_symbol(name, strlen(name));
+	s_env = s_topenv;
+	define_variable();
+}
+
+static SEXPR api_make_real(double d)
+{
+	struct number n;
+
+	build_real_number(&n, d);
+	return make_number(&n);
+}
+
+static double api_real_value(SEXPR e)
+{
+	return real_arg(e);
+}
+
+static const struct lispe_api s_api = {
+	LISPE_API_VERSION,
+	SEXPR_NIL,
+	SEXPR_TRUE,
+	SEXPR_FALSE,
+	api_define_builtin,
+	p_nullp,
+	p_pairp,
+	p_symbolp,
+	p_numberp,
+	p_realp,
+	p_cons,
+	p_car,
+	p_cdr,
+	p_setcar,
+	p_setcdr,
+	api_make_real,
+	api_real_value,
+	push,
+	pop,
+	throw_err,
+};
+
+/*********************************************************
+ * Loading.
+ *********************************************************/
+
+/*
+ * We have no strings: names are written as "name", which is read as a
+ * symbol, or as a symbol. Returns the name in buf without the quotes.
+ */
+static const char *name_arg(SEXPR e, char *buf, size_t bufsize)
+{
+	const char *s;
+	size_t len;
+
+	if (!p_symbolp(e)) {
+		throw_err("name expected for extension or foreign procedure");
+	}
+
+	s = sexpr_name(e);
+	len = strlen(s);
+	if (len >= 2 && s[0] == '"' && s[len - 1] == '"') {
+		s++;
+		len -= 2;
+	}
+	if (len >= bufsize) {
+		throw_err("name too long");
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+static int ctype_arg(SEXPR e)
+{
+	if (p_symbolp(e)) {
+		if (strcmp(sexpr_name(e), "double") == 0) {
+			return CTYPE_DOUBLE;
+		} else if (strcmp(sexpr_name(e), "int") == 0) {
+			return CTYPE_INT;
+		}
+	}
+
+	throw_err("foreign procedure types can be double or int");
+	return CTYPE_DOUBLE;
+}
+
+#ifdef HAVE_DLFCN_H
+
+static void *open_library(const char *path)
+{
+	void *lib;
+
+	lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (lib == NULL) {
+		printf("lispe: %s\n", dlerror());
+		throw_err("cannot load library");
+	}
+
+	return lib;
+}
+
+static void *library_symbol(void *lib, const char *name)
+{
+	void *sym;
+
+	sym = dlsym(lib, name);
+	if (sym == NULL) {
+		printf("lispe: %s\n", dlerror());
+		throw_err("symbol not found on library");
+	}
+
+	return sym;
+}
+
+#else
+
+static void *open_library(const char *path)
+{
+	throw_err("loading libraries is not supported on this system");
+	return NULL;
+}
+
+static void *library_symbol(void *lib, const char *name)
+{
+	return NULL;
+}
+
+#endif
+
+/*
+ * Loads the extension whose file is named by path and lets it register its
+ * procedures. The library is never unloaded.
+ */
+void load_extension(SEXPR path)
+{
+	char buf[MAX_EXT_NAME];
+	void *lib;
+	int (*init)(const struct lispe_api *);
+
+	lib = open_library(name_arg(path, buf, sizeof(buf)));
+	*(void **) (&init) = library_symbol(lib, "lispe_extension_init");
+	push(path);
+	if (init(&s_api) != 0) {
+		throw_err("extension failed to initialize");
+	}
+	pop();
+}
+
+/*
+ * Returns a procedure that calls the function name on the library lib.
+ * argtypes is the list of the types of its arguments, which must be double,
+ * and rettype is double or int.
+ */
+SEXPR foreign_procedure(SEXPR lib, SEXPR name, SEXPR argtypes, SEXPR rettype)
+{
+	char buf[MAX_EXT_NAME];
+	void *plib, *cfun;
+	int i, argc, crettype;
+	SEXPR p;
+
+	argc = 0;
+	for (p = argtypes; p_pairp(p); p = p_cdr(p)) {
+		if (ctype_arg(p_car(p)) != CTYPE_DOUBLE) {
+			throw_err("foreign procedure arguments must be double");
+		}
+		argc++;
+	}
+	if (!p_nullp(p) || argc > MAX_FOREIGN_ARGS) {
+		throw_err("bad argument types for foreign procedure");
+	}
+	crettype = ctype_arg(rettype);
+
+	plib = open_library(name_arg(lib, buf, sizeof(buf)));
+	cfun = library_symbol(plib, name_arg(name, buf, sizeof(buf)));
+
+	i = add_ext_function(buf, argc, argc);
+	s_ext_functions[i].cfun = cfun;
+	s_ext_functions[i].crettype = crettype;
+	return make_ext_function(i);
+}
@@ -0,0 +1,1077 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "cells.h"
+#include "symbols.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Constant folding.
+ *
+ * When a procedure is made at the top level (by lambda or define), its body
+ * is walked once and the calls to pure builtins with constant arguments are
+ * computed. Each of those calls is replaced, where it is, by
+ *
+ *     (%fold value guards call)
+ *
+ * where guards is a list of (binding . builtin), one for each builtin the
+ * value depends on, with the global binding of its name. While all those
+ * names are bound to the same builtins %fold gives value; if any of them is
+ * redefined, call is evaluated as it was written.
+ *
+ * The constants are numbers, #t, #f, quoted data, folded calls, and the
+ * variables of let and let* bound to constants if they are never changed
+ * with set! or define. A call whose builtin signals an error is left as it
+ * is, so the error is signaled when it runs.
+ *
+ * Calls to small procedures defined at the top level are inlined the same
+ * way: the call is replaced by
+ *
+ *     (%inline guards expansion call)
+ *
+ * where expansion is the body of the procedure with the arguments in place
+ * of its parameters, or bound to them by a let. The guard is the global
+ * binding of the procedure, so a define or set! of its name makes %inline
+ * evaluate call instead. Only bodies of a single expression, with no
+ * binding forms nor references to the procedure itself, are inlined, so
+ * the expansion does not see other variables than the call did.
+ *
+ * Nothing is folded on a body that uses a special made by the program (a
+ * macro), as we cannot know what its expansion binds, nor on one that
+ * uses define-record-type.
+ *
+ * A procedure body can start with (declare (flonum var ...) (pair var ...)):
+ * the calls to arithmetic on declared reals, and to car and cdr on declared
+ * pairs, skip their checks (see sites.c).
+ *
+ * The locals of the walk are a list of (var . constant), where constant is
+ * the constant form bound to var, the type of var if it is a declared
+ * parameter, or () if it is not known. The variables defined on a body are
+ * locals too, so a body that defines car does not fold its calls to car.
+ */
+
+enum {
+	/* Max number of pairs on the body of an inlined procedure. */
+	MAX_INLINE_SIZE = 16,
+	/* Max depth of inlines on inlined bodies. */
+	MAX_INLINE_DEPTH = 4
+};
+
+static int s_inline_depth;
+
+/* Variables changed by set! or define somewhere on the body. */
+static SEXPR *s_ptainted;
+
+static int symbol_named(SEXPR e, const char *name)
+{
+	return p_symbolp(e) && strcmp(sexpr_name(e), name) == 0;
+}
+
+static SEXPR lookup_local(SEXPR var, SEXPR locals)
+{
+	while (p_pairp(locals)) {
+		if (p_eqp(var, p_car(p_car(locals)))) {
+			return p_car(locals);
+		}
+		locals = p_cdr(locals);
+	}
+
+	return SEXPR_NIL;
+}
+
+static int is_member(SEXPR var, SEXPR p)
+{
+	while (p_pairp(p)) {
+		if (p_eqp(var, p_car(p))) {
+			return 1;
+		}
+		p = p_cdr(p);
+	}
+
+	return 0;
+}
+
+/* Returns the global value of the operator sym, or () if it is local. */
+static SEXPR global_operator(SEXPR sym, SEXPR locals)
+{
+	SEXPR bind;
+
+	if (!p_symbolp(sym) || !p_nullp(lookup_local(sym, locals))) {
+		return SEXPR_NIL;
+	}
+	bind = lookup_variable(sym, s_topenv);
+	return p_nullp(bind) ? SEXPR_NIL : p_cdr(bind);
+}
+
+static const char *global_special_name(SEXPR sym, SEXPR locals)
+{
+	SEXPR val;
+
+	val = global_operator(sym, locals);
+	if (sexpr_type(val) != SEXPR_BUILTIN_SPECIAL) {
+		return NULL;
+	}
+
+	return builtin_special_name(sexpr_index(val));
+}
+
+/*
+ * Adds to *s_ptainted the variables changed by set! or define on e.
+ * Returns 0 if e uses a special made by the program.
+ */
+static int scan_body(SEXPR e)
+{
+	SEXPR head, var;
+	const char *name;
+
+	if (!p_pairp(e)) {
+		return 1;
+	}
+
+	head = p_car(e);
+	if (p_eqp(head, s_fold_atom) || p_eqp(head, s_inline_atom) ||
+	    p_eqp(head, s_site_atom))
+	{
+		return 1;
+	} else if (p_symbolp(head)) {
+		if (sexpr_type(global_operator(head, SEXPR_NIL)) ==
+		    SEXPR_SPECIAL)
+		{
+			return 0;
+		}
+		name = global_special_name(head, SEXPR_NIL);
+		if (name != NULL) {
+			if (strcmp(name, "quote") == 0) {
+				return 1;
+			} else if (strcmp(name, "special") == 0 ||
+				   strcmp(name, "syntax-rules") == 0 ||
+				   strcmp(name, "define-record-type") == 0)
+			{
+				return 0;
+			}
+		}
+		if ((p_eqp(head, s_define_atom) || symbol_named(head, "set!"))
+		    && p_pairp(p_cdr(e)))
+		{
+			var = p_car(p_cdr(e));
+			if (p_pairp(var)) {
+				var = p_car(var);
+			}
+			*s_ptainted = p_cons(var, *s_ptainted);
+		}
+	}
+
+	for (; p_pairp(e); e = p_cdr(e)) {
+		if (!scan_body(p_car(e))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int is_folded(SEXPR e)
+{
+	return p_pairp(e) && p_eqp(p_car(e), s_fold_atom);
+}
+
+static int is_inlined(SEXPR e)
+{
+	return p_pairp(e) && p_eqp(p_car(e), s_inline_atom);
+}
+
+static int is_site(SEXPR e)
+{
+	return p_pairp(e) && p_eqp(p_car(e), s_site_atom);
+}
+
+/* The call of (%site index call). */
+static SEXPR site_call(SEXPR e)
+{
+	return p_car(p_cdr(p_cdr(e)));
+}
+
+/* Returns the constant form e stands for, or () if it is not a constant. */
+static SEXPR constant_form(SEXPR e, SEXPR locals)
+{
+	SEXPR bind;
+	const char *name;
+
+	if (p_numberp(e) || p_eqp(e, SEXPR_TRUE) || p_eqp(e, SEXPR_FALSE)) {
+		return e;
+	} else if (p_symbolp(e)) {
+		/* a declared variable has its type instead */
+		bind = lookup_local(e, locals);
+		return (p_nullp(bind) || p_symbolp(p_cdr(bind))) ?
+			SEXPR_NIL : p_cdr(bind);
+	} else if (is_folded(e)) {
+		return e;
+	} else if (p_pairp(e) && p_pairp(p_cdr(e)) &&
+		   p_nullp(p_cdr(p_cdr(e))))
+	{
+		name = global_special_name(p_car(e), locals);
+		if (name != NULL && strcmp(name, "quote") == 0) {
+			return e;
+		}
+	}
+
+	return SEXPR_NIL;
+}
+
+static SEXPR constant_value(SEXPR c)
+{
+	if (p_pairp(c)) {
+		/* (quote datum) or (%fold value guards call) */
+		return p_car(p_cdr(c));
+	}
+
+	return c;
+}
+
+static SEXPR constant_guards(SEXPR c)
+{
+	return is_folded(c) ? p_car(p_cdr(p_cdr(c))) : SEXPR_NIL;
+}
+
+/* Adds (var . constant) to *plocals, or (var) if var is tainted. */
+static void add_local(SEXPR *plocals, SEXPR var, SEXPR constant)
+{
+	if (is_member(var, *s_ptainted)) {
+		constant = SEXPR_NIL;
+	}
+	push(p_cons(var, constant));
+	*plocals = p_cons(*stack_top(1), *plocals);
+	pop();
+}
+
+/* Adds to *plocals the parameters params, which are not known. */
+static void add_params(SEXPR *plocals, SEXPR params)
+{
+	while (p_pairp(params)) {
+		add_local(plocals, p_car(params), SEXPR_NIL);
+		params = p_cdr(params);
+	}
+	if (p_symbolp(params)) {
+		add_local(plocals, params, SEXPR_NIL);
+	}
+}
+
+/*
+ * Adds to *plocals, not known, the variables defined on e, as a define
+ * binds them on the environment of the body it is in from its start (see
+ * hoist_defines()). Those of the bodies of let, letrec, do and lambda on e
+ * are added too: this is more than needed, but a variable that could be
+ * local is only not folded.
+ */
+static void add_defines(SEXPR *plocals, SEXPR e)
+{
+	SEXPR var;
+	const char *name;
+
+	if (!p_pairp(e) || is_folded(e)) {
+		return;
+	}
+
+	name = global_special_name(p_car(e), *plocals);
+	if (name != NULL && strcmp(name, "quote") == 0) {
+		return;
+	} else if (name != NULL && p_pairp(p_cdr(e)) &&
+		   (strcmp(name, "define") == 0 ||
+		    strcmp(name, "define-syntax") == 0))
+	{
+		var = p_car(p_cdr(e));
+		if (p_pairp(var)) {
+			var = p_car(var);
+		}
+		if (p_symbolp(var)) {
+			add_local(plocals, var, SEXPR_NIL);
+		}
+	}
+
+	for (; p_pairp(e); e = p_cdr(e)) {
+		add_defines(plocals, p_car(e));
+	}
+}
+
+/* Adds guard to the list *pguards if it has not its binding. */
+static void add_guard(SEXPR *pguards, SEXPR guard)
+{
+	SEXPR p;
+
+	for (p = *pguards; p_pairp(p); p = p_cdr(p)) {
+		if (p_eqp(p_car(p_car(p)), p_car(guard))) {
+			return;
+		}
+	}
+	*pguards = p_cons(guard, *pguards);
+}
+
+/*
+ * Applies the builtin function i to the argc arguments on argv.
+ * Returns 0, leaving the stack as it was, if it signals an error.
+ */
+static int try_builtin(int i, int argc, SEXPR *argv)
+{
+	jmp_buf saved;
+	SEXPR *top;
+	int ok;
+
+	top = stack_top(0);
+	memcpy(saved, s_err_buf, sizeof(saved));
+	s_err_quiet++;
+	if (!setjmp(s_err_buf)) {
+		apply_builtin_function(i, argc, argv);
+		ok = 1;
+	} else {
+		while (stack_top(0) > top) {
+			pop();
+		}
+		ok = 0;
+	}
+	s_err_quiet--;
+	memcpy(s_err_buf, saved, sizeof(saved));
+
+	return ok;
+}
+
+/*
+ * Replaces the car of loc by (%fold value guards call). value and guards
+ * must be protected from gc.
+ */
+static void set_folded(SEXPR loc, SEXPR value, SEXPR guards, SEXPR call)
+{
+	push(p_cons(call, SEXPR_NIL));
+	*stack_top(1) = p_cons(guards, *stack_top(1));
+	*stack_top(1) = p_cons(value, *stack_top(1));
+	p_setcar(loc, p_cons(s_fold_atom, *stack_top(1)));
+	pop();
+}
+
+/*
+ * The car of loc is a call to the builtin bound on bind: replaces it by
+ * its %fold if the builtin is pure and the arguments are constants.
+ */
+static void fold_call(SEXPR loc, SEXPR bind, SEXPR locals)
+{
+	SEXPR call, p, g, *pguards;
+	int i, argc;
+
+	call = p_car(loc);
+	i = sexpr_index(p_cdr(bind));
+	if (!builtin_function_pure(i)) {
+		return;
+	}
+
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		if (p_nullp(constant_form(p_car(p), locals))) {
+			return;
+		}
+	}
+	if (!p_nullp(p)) {
+		return;
+	}
+
+	argc = 0;
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		push(constant_value(constant_form(p_car(p), locals)));
+		argc++;
+	}
+	if (!try_builtin(i, argc, stack_top(argc))) {
+		popn(argc);
+		return;
+	}
+	popn(argc);
+
+	push(s_val);
+	push(SEXPR_NIL);
+	pguards = stack_top(1);
+	g = push(p_cons(bind, p_cdr(bind)));
+	add_guard(pguards, g);
+	pop();
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		g = constant_guards(constant_form(p_car(p), locals));
+		for (; p_pairp(g); g = p_cdr(g)) {
+			add_guard(pguards, p_car(g));
+		}
+	}
+
+	set_folded(loc, *stack_top(2), *pguards, call);
+	popn(2);
+}
+
+static void fold_at(SEXPR loc, SEXPR locals);
+
+/* Folds each expression on the list body. */
+static void fold_body(SEXPR body, SEXPR locals)
+{
+	for (; p_pairp(body); body = p_cdr(body)) {
+		fold_at(body, locals);
+	}
+}
+
+static int is_param(SEXPR var, SEXPR params)
+{
+	while (p_pairp(params)) {
+		if (p_eqp(var, p_car(params))) {
+			return 1;
+		}
+		params = p_cdr(params);
+	}
+
+	return p_eqp(var, params);
+}
+
+/*
+ * Sets on locals the types of the parameters params given by the declare
+ * forms at the start of body. The variables changed on the body are left
+ * unknown.
+ */
+static void add_declarations(SEXPR locals, SEXPR params, SEXPR body)
+{
+	SEXPR form, d, v;
+	const char *name;
+
+	for (; p_pairp(body); body = p_cdr(body)) {
+		form = p_car(body);
+		name = p_pairp(form) ? global_special_name(p_car(form), locals) :
+				       NULL;
+		if (name == NULL || strcmp(name, "declare") != 0) {
+			break;
+		}
+		for (d = p_cdr(form); p_pairp(d); d = p_cdr(d)) {
+			if (!p_pairp(p_car(d)) ||
+			    declared_kind(p_car(p_car(d))) == 0)
+			{
+				continue;
+			}
+			for (v = p_cdr(p_car(d)); p_pairp(v); v = p_cdr(v)) {
+				if (is_param(p_car(v), params) &&
+				    !is_member(p_car(v), *s_ptainted))
+				{
+					p_setcdr(lookup_local(p_car(v), locals),
+						 p_car(p_car(d)));
+				}
+			}
+		}
+	}
+}
+
+/* (lambda params body ...) */
+static void fold_lambda(SEXPR params, SEXPR body, SEXPR locals)
+{
+	SEXPR *plocals;
+
+	push(locals);
+	plocals = stack_top(1);
+	add_params(plocals, params);
+	add_defines(plocals, body);
+	add_declarations(*plocals, params, body);
+	fold_body(body, *plocals);
+	pop();
+}
+
+/* Returns the KIND_ that e is known to have, or 0. */
+static int known_kind(SEXPR e, SEXPR locals)
+{
+	SEXPR bind;
+
+	if (p_numberp(e)) {
+		return (site_kind(e) == KIND_FLONUM) ? KIND_FLONUM : 0;
+	} else if (p_symbolp(e)) {
+		bind = lookup_local(e, locals);
+		return p_nullp(bind) ? 0 : declared_kind(p_cdr(bind));
+	} else if (site_flonum(e)) {
+		return KIND_FLONUM;
+	}
+
+	return 0;
+}
+
+/* Returns the KIND_ that all the arguments of call are known to have. */
+static int known_args_kind(SEXPR call, SEXPR locals)
+{
+	SEXPR p;
+	int kind, k;
+
+	kind = 0;
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		k = known_kind(p_car(p), locals);
+		if (k == 0 || (kind != 0 && k != kind)) {
+			return 0;
+		}
+		kind = k;
+	}
+
+	return kind;
+}
+
+/* (let ((var init) ...) body ...) and let*, one after the other if seq. */
+static void fold_let(SEXPR e, SEXPR locals, int seq)
+{
+	SEXPR b, *plocals;
+
+	push(locals);
+	plocals = stack_top(1);
+	for (b = p_car(e); p_pairp(b); b = p_cdr(b)) {
+		if (!p_pairp(p_car(b)) || !p_pairp(p_cdr(p_car(b)))) {
+			continue;
+		}
+		fold_at(p_cdr(p_car(b)), seq ? *plocals : locals);
+		add_local(plocals, p_car(p_car(b)),
+			  constant_form(p_car(p_cdr(p_car(b))),
+					seq ? *plocals : locals));
+	}
+	fold_body(p_cdr(e), *plocals);
+	pop();
+}
+
+/* (let name ((var init) ...) body ...) */
+static void fold_named_let(SEXPR e, SEXPR locals)
+{
+	SEXPR b, *plocals;
+
+	push(locals);
+	plocals = stack_top(1);
+	add_local(plocals, p_car(e), SEXPR_NIL);
+	for (b = p_car(p_cdr(e)); p_pairp(b); b = p_cdr(b)) {
+		if (p_pairp(p_car(b))) {
+			fold_body(p_cdr(p_car(b)), locals);
+			add_local(plocals, p_car(p_car(b)), SEXPR_NIL);
+		}
+	}
+	fold_body(p_cdr(p_cdr(e)), *plocals);
+	pop();
+}
+
+/*
+ * (letrec ((var init) ...) body ...), or (do ((var init step) ...)
+ * (test expr ...) body ...) if is_do.
+ */
+static void fold_letrec(SEXPR e, SEXPR locals, int is_do)
+{
+	SEXPR b, *plocals;
+
+	push(locals);
+	plocals = stack_top(1);
+	for (b = p_car(e); p_pairp(b); b = p_cdr(b)) {
+		if (p_pairp(p_car(b))) {
+			add_local(plocals, p_car(p_car(b)), SEXPR_NIL);
+		}
+	}
+	for (b = p_car(e); p_pairp(b); b = p_cdr(b)) {
+		if (!p_pairp(p_car(b))) {
+			continue;
+		}
+		if (is_do && p_pairp(p_cdr(p_car(b)))) {
+			fold_at(p_cdr(p_car(b)), locals);
+			fold_body(p_cdr(p_cdr(p_car(b))), *plocals);
+		} else {
+			fold_body(p_cdr(p_car(b)), *plocals);
+		}
+	}
+	if (is_do && p_pairp(p_cdr(e))) {
+		fold_body(p_car(p_cdr(e)), *plocals);
+		e = p_cdr(e);
+	}
+	fold_body(p_cdr(e), *plocals);
+	pop();
+}
+
+static void fold_special_form(SEXPR e, const char *name, SEXPR locals)
+{
+	SEXPR args, c;
+
+	args = p_cdr(e);
+	if (strcmp(name, "quote") == 0 || !p_pairp(args))
+	{
+		return;
+	} else if (strcmp(name, "lambda") == 0) {
+		fold_lambda(p_car(args), p_cdr(args), locals);
+	} else if (strcmp(name, "define") == 0) {
+		if (p_pairp(p_car(args))) {
+			fold_lambda(p_cdr(p_car(args)), p_cdr(args), locals);
+		} else {
+			fold_body(p_cdr(args), locals);
+		}
+	} else if (strcmp(name, "set!") == 0) {
+		fold_body(p_cdr(args), locals);
+	} else if (strcmp(name, "let") == 0) {
+		if (p_symbolp(p_car(args))) {
+			fold_named_let(args, locals);
+		} else {
+			fold_let(args, locals, 0);
+		}
+	} else if (strcmp(name, "let*") == 0) {
+		fold_let(args, locals, 1);
+	} else if (strcmp(name, "letrec") == 0 ||
+		   strcmp(name, "letrec*") == 0)
+	{
+		fold_letrec(args, locals, 0);
+	} else if (strcmp(name, "do") == 0) {
+		fold_letrec(args, locals, 1);
+	} else if (strcmp(name, "cond") == 0) {
+		for (c = args; p_pairp(c); c = p_cdr(c)) {
+			fold_body(p_car(c), locals);
+		}
+	} else if (strcmp(name, "case") == 0) {
+		fold_at(args, locals);
+		for (c = p_cdr(args); p_pairp(c); c = p_cdr(c)) {
+			if (p_pairp(p_car(c))) {
+				fold_body(p_cdr(p_car(c)), locals);
+			}
+		}
+	} else if (strcmp(name, "if") == 0 || strcmp(name, "and") == 0 ||
+		   strcmp(name, "or") == 0 || strcmp(name, "begin") == 0 ||
+		   strcmp(name, "delay") == 0 ||
+		   strcmp(name, "cons-stream") == 0)
+	{
+		fold_body(args, locals);
+	}
+}
+
+static int is_quote(SEXPR e)
+{
+	const char *name;
+
+	if (!p_pairp(e)) {
+		return 0;
+	}
+	name = global_special_name(p_car(e), SEXPR_NIL);
+	return name != NULL && strcmp(name, "quote") == 0;
+}
+
+/*
+ * Returns the number of pairs on e, the body of the procedure self with
+ * parameters params, or -1 if it cannot be inlined where the variables
+ * locals are bound: if e refers to one of them, the internal defines of
+ * the caller included, the expansion would see it instead of the global.
+ */
+static int inline_size(SEXPR e, SEXPR params, SEXPR self, SEXPR locals)
+{
+	SEXPR head;
+	const char *name;
+	int n, k;
+
+	if (p_symbolp(e)) {
+		if (is_member(e, params)) {
+			return 0;
+		}
+		return (p_eqp(e, self) || !p_nullp(lookup_local(e, locals))) ?
+			-1 : 0;
+	} else if (!p_pairp(e) || is_folded(e)) {
+		return 0;
+	} else if (is_site(e)) {
+		e = site_call(e);
+	}
+
+	head = p_car(e);
+	if (is_inlined(e)) {
+		/* (expansion call) */
+		e = p_cdr(p_cdr(e));
+	} else if (p_symbolp(head) && !is_member(head, params)) {
+		if (inline_size(head, params, self, locals) < 0 ||
+		    sexpr_type(global_operator(head, SEXPR_NIL)) ==
+		    SEXPR_SPECIAL)
+		{
+			return -1;
+		}
+		name = global_special_name(head, SEXPR_NIL);
+		if (name != NULL) {
+			if (strcmp(name, "quote") == 0) {
+				return 1;
+			} else if (strcmp(name, "if") != 0 &&
+				   strcmp(name, "and") != 0 &&
+				   strcmp(name, "or") != 0 &&
+				   strcmp(name, "cond") != 0)
+			{
+				return -1;
+			}
+		}
+	}
+
+	for (n = 1; p_pairp(e); e = p_cdr(e)) {
+		k = inline_size(p_car(e), params, self, locals);
+		if (k < 0 || (n += k) > MAX_INLINE_SIZE) {
+			return -1;
+		}
+	}
+
+	return p_nullp(e) ? n : -1;
+}
+
+/*
+ * Returns the number of references to var on e if strict is 0, or only of
+ * those that are always evaluated when e is if strict is 1.
+ */
+static int count_uses(SEXPR e, SEXPR var, int strict)
+{
+	const char *name;
+	int n;
+
+	if (!p_pairp(e)) {
+		return p_eqp(e, var);
+	} else if (is_folded(e) || is_quote(e)) {
+		return 0;
+	} else if (is_inlined(e)) {
+		return count_uses(p_car(p_cdr(p_cdr(e))), var, strict);
+	} else if (is_site(e)) {
+		return count_uses(site_call(e), var, strict);
+	}
+
+	name = global_special_name(p_car(e), SEXPR_NIL);
+	if (strict && name != NULL && p_pairp(p_cdr(e))) {
+		/* the test of if and cond, the first of and and or */
+		e = p_car(p_cdr(e));
+		if (strcmp(name, "cond") == 0) {
+			e = p_pairp(e) ? p_car(e) : SEXPR_NIL;
+		}
+		return count_uses(e, var, strict);
+	}
+
+	for (n = 0; p_pairp(e); e = p_cdr(e)) {
+		n += count_uses(p_car(e), var, strict);
+	}
+
+	return n;
+}
+
+/*
+ * Returns 1 if var, on e, is evaluated before anything on e that could
+ * have an effect: only variables and constants are evaluated before it.
+ */
+static int evaluated_first(SEXPR e, SEXPR var)
+{
+	SEXPR a;
+	const char *name;
+
+	if (!p_pairp(e)) {
+		return p_eqp(e, var);
+	} else if (is_folded(e) || is_quote(e) || is_inlined(e)) {
+		return 0;
+	} else if (is_site(e)) {
+		e = site_call(e);
+	}
+
+	name = global_special_name(p_car(e), SEXPR_NIL);
+	if (name != NULL) {
+		/* the test of if and cond, the first of and and or */
+		if (!p_pairp(p_cdr(e))) {
+			return 0;
+		}
+		e = p_car(p_cdr(e));
+		if (strcmp(name, "cond") == 0) {
+			return p_pairp(e) && evaluated_first(p_car(e), var);
+		}
+		return evaluated_first(e, var);
+	} else if (!p_symbolp(p_car(e))) {
+		return 0;
+	}
+
+	/* the arguments are evaluated in order */
+	for (e = p_cdr(e); p_pairp(e); e = p_cdr(e)) {
+		a = p_car(e);
+		if (count_uses(a, var, 0) > 0) {
+			return evaluated_first(a, var);
+		} else if (p_pairp(a) && !is_folded(a) && !is_quote(a)) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static SEXPR subst(SEXPR e, SEXPR alist);
+
+/* Copies the list p, with the substitutions of alist on its elements. */
+static SEXPR subst_list(SEXPR p, SEXPR alist)
+{
+	SEXPR e;
+
+	if (!p_pairp(p)) {
+		return p;
+	}
+
+	push(subst(p_car(p), alist));
+	e = subst_list(p_cdr(p), alist);
+	e = p_cons(*stack_top(1), e);
+	pop();
+
+	return e;
+}
+
+/*
+ * Copies e putting the values on alist, a list of (var . value), where its
+ * variables are.
+ */
+static SEXPR subst(SEXPR e, SEXPR alist)
+{
+	SEXPR bind;
+
+	if (p_symbolp(e)) {
+		bind = lookup_local(e, alist);
+		return p_nullp(bind) ? e : p_cdr(bind);
+	} else if (!p_pairp(e) || is_folded(e) || is_quote(e)) {
+		return e;
+	} else if (is_inlined(e)) {
+		/* the guards are kept as they are */
+		e = p_cons(p_car(p_cdr(e)), subst_list(p_cdr(p_cdr(e)), alist));
+		return p_cons(s_inline_atom, e);
+	} else if (is_site(e)) {
+		/* the copy gets a site of its own when it is folded */
+		return subst_list(site_call(e), alist);
+	}
+
+	return subst_list(e, alist);
+}
+
+/*
+ * Returns the expansion of a call with arguments args to a procedure with
+ * parameters params and body body. The arguments are put in place of the
+ * parameters if that does not change when or how many times they are
+ * evaluated, else they are bound by a let, or () is returned if let is not
+ * visible from locals.
+ */
+static SEXPR inline_expansion(SEXPR params, SEXPR body, SEXPR args,
+			      SEXPR locals)
+{
+	SEXPR p, a, let, *palist;
+	int direct, nhard;
+
+	direct = 1;
+	nhard = 0;
+	for (p = params, a = args; p_pairp(p); p = p_cdr(p), a = p_cdr(a)) {
+		if (p_symbolp(p_car(a)) ||
+		    !p_nullp(constant_form(p_car(a), locals)))
+		{
+			continue;
+		}
+		nhard++;
+		if (count_uses(body, p_car(p), 0) != 1 ||
+		    count_uses(body, p_car(p), 1) != 1 ||
+		    !evaluated_first(body, p_car(p)))
+		{
+			direct = 0;
+		}
+	}
+
+	push(SEXPR_NIL);
+	palist = stack_top(1);
+	if (direct && nhard <= 1) {
+		for (p = params, a = args; p_pairp(p);
+		     p = p_cdr(p), a = p_cdr(a))
+		{
+			push(p_cons(p_car(p), p_car(a)));
+			*palist = p_cons(*stack_top(1), *palist);
+			pop();
+		}
+		p = subst(body, *palist);
+		pop();
+		return p;
+	}
+
+	let = make_symbol("let", 3);
+	if (!p_nullp(lookup_local(let, locals))) {
+		pop();
+		return SEXPR_NIL;
+	}
+
+	/* (let ((param arg) ...) body) */
+	for (p = params, a = args; p_pairp(p); p = p_cdr(p), a = p_cdr(a)) {
+		push(p_cons(p_car(a), SEXPR_NIL));
+		*stack_top(1) = p_cons(p_car(p), *stack_top(1));
+		*palist = p_cons(*stack_top(1), *palist);
+		pop();
+	}
+	push(subst(body, SEXPR_NIL));
+	*stack_top(1) = p_cons(*stack_top(1), SEXPR_NIL);
+	*stack_top(1) = p_cons(*palist, *stack_top(1));
+	p = p_cons(let, *stack_top(1));
+	popn(2);
+
+	return p;
+}
+
+/*
+ * The car of loc is a call to the procedure bound on bind: replaces it by
+ * its %inline if the procedure is small enough.
+ */
+static void inline_call(SEXPR loc, SEXPR bind, SEXPR locals)
+{
+	SEXPR call, fn, params, body, p, a, *pform;
+	int celli;
+
+	call = p_car(loc);
+	fn = p_cdr(bind);
+	celli = sexpr_index(fn);
+	if (s_inline_depth >= MAX_INLINE_DEPTH ||
+	    !p_eqp(cell_cdr(celli), s_topenv))
+	{
+		return;
+	}
+
+	params = p_car(cell_car(celli));
+	body = p_cdr(cell_car(celli));
+	if (!p_pairp(body) || !p_nullp(p_cdr(body))) {
+		return;
+	}
+	body = p_car(body);
+
+	for (p = params, a = p_cdr(call); p_pairp(p) && p_pairp(a);
+	     p = p_cdr(p), a = p_cdr(a))
+		;
+	if (!p_nullp(p) || !p_nullp(a) ||
+	    inline_size(body, params, p_car(call), locals) < 0)
+	{
+		return;
+	}
+
+	push(inline_expansion(params, body, p_cdr(call), locals));
+	if (p_nullp(*stack_top(1))) {
+		pop();
+		return;
+	}
+
+	/* (%inline guards expansion call) */
+	push(p_cons(call, SEXPR_NIL));
+	*stack_top(2) = p_cons(*stack_top(2), *stack_top(1));
+	*stack_top(1) = p_cons(bind, fn);
+	*stack_top(1) = p_cons(*stack_top(1), SEXPR_NIL);
+	*stack_top(2) = p_cons(*stack_top(1), *stack_top(2));
+	*stack_top(2) = p_cons(s_inline_atom, *stack_top(2));
+	p_setcar(loc, *stack_top(2));
+	popn(2);
+
+	s_inline_depth++;
+	fold_at(p_cdr(p_cdr(p_car(loc))), locals);
+	s_inline_depth--;
+
+	/* a constant expansion is folded with the guard of the procedure */
+	if (is_folded(p_car(p_cdr(p_cdr(p_car(loc)))))) {
+		push(p_car(p_cdr(p_cdr(p_car(loc)))));
+		push(SEXPR_NIL);
+		pform = stack_top(1);
+		for (p = constant_guards(*stack_top(2)); p_pairp(p);
+		     p = p_cdr(p))
+		{
+			add_guard(pform, p_car(p));
+		}
+		add_guard(pform, p_car(p_car(p_cdr(p_car(loc)))));
+		set_folded(loc, constant_value(*stack_top(2)), *pform, call);
+		popn(2);
+	}
+}
+
+/* Folds the expression on the car of loc. */
+static void fold_at(SEXPR loc, SEXPR locals)
+{
+	SEXPR e, head, bind;
+
+	/* frozen code (see hcons.c) cannot be changed */
+	if (pair_frozen(loc)) {
+		return;
+	}
+	e = p_car(loc);
+	if (!p_pairp(e) || is_folded(e) || is_inlined(e) || is_site(e)) {
+		return;
+	}
+
+	/* a head defined on the body is on locals (see add_defines()) */
+	head = p_car(e);
+	if (!p_symbolp(head) || !p_nullp(lookup_local(head, locals))) {
+		fold_body(e, locals);
+		return;
+	}
+
+	bind = lookup_variable(head, s_topenv);
+	if (p_nullp(bind)) {
+		fold_body(p_cdr(e), locals);
+		return;
+	}
+
+	switch (sexpr_type(p_cdr(bind))) {
+	case SEXPR_BUILTIN_SPECIAL:
+		fold_special_form(e,
+			builtin_special_name(sexpr_index(p_cdr(bind))),
+			locals);
+		break;
+	case SEXPR_BUILTIN_FUNCTION:
+		fold_body(p_cdr(e), locals);
+		fold_call(loc, bind, locals);
+		if (p_eqp(p_car(loc), e)) {
+			e = make_site(bind, e, known_args_kind(e, locals));
+			if (!p_nullp(e)) {
+				p_setcar(loc, e);
+			}
+		}
+		break;
+	case SEXPR_FUNCTION:
+		fold_body(p_cdr(e), locals);
+		inline_call(loc, bind, locals);
+		break;
+	default:
+		fold_body(p_cdr(e), locals);
+	}
+}
+
+/* Folds the body of the procedure (lambda params body ...). */
+void fold_procedure(SEXPR params, SEXPR body)
+{
+	push(params);
+	push(body);
+	push(SEXPR_NIL);
+	s_ptainted = stack_top(1);
+	if (scan_body(body)) {
+		fold_lambda(params, body, SEXPR_NIL);
+	}
+	popn(3);
+}
+
+/* Returns 1 if each (binding . value) on guards still has its value. */
+static int guards_hold(SEXPR guards)
+{
+	for (; p_pairp(guards); guards = p_cdr(guards)) {
+		if (!p_eqp(p_cdr(p_car(p_car(guards))), p_cdr(p_car(guards)))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * (%fold value guards call): gives value if the bindings on guards still
+ * have their builtins, else evaluates call.
+ */
+void fold_special(void)
+{
+	if (guards_hold(p_car(p_cdr(s_args)))) {
+		s_val = p_car(s_args);
+	} else {
+		s_val = p_car(p_cdr(p_cdr(s_args)));
+		s_tailrec = 1;
+	}
+}
+
+/*
+ * (%inline guards expansion call): evaluates expansion if the bindings on
+ * guards still have their procedures, else call.
+ */
+void inline_special(void)
+{
+	if (guards_hold(p_car(s_args))) {
+		s_val = p_car(p_cdr(s_args));
+	} else {
+		s_val = p_car(p_cdr(p_cdr(s_args)));
+	}
+	s_tailrec = 1;
+}
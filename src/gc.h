@@ -7,5 +7,13 @@
 #define GC_H
 
 void p_gc(void);
+void static_store(int celli);
+
+/* region.c */
+
+extern int s_in_region;
+
+void region_alloc_cell(int celli);
+void region_alloc_number(int i);
 
 #endif
@@ -11,10 +11,13 @@
 #include "common.h"
 #include "cells.h"
 #include "cellmark.h"
+#include "err.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+enum { NSTACK = 4 * NCELL };
+
 /* List of free cells.  */
 static SEXPR s_free_cells;
 
@@ -30,18 +33,29 @@ SEXPR s_unev;
 /* hidden environment, used to not gc quote, etc. */
 static SEXPR s_hidenv;
 
-/* current computation stack */
-static SEXPR s_stack;
+/*
+ * Current computation stack. It is an array, so pushing does not allocate
+ * cells, and the arguments of procedures are evaluated onto it (see
+ * p_evargs()).
+ */
+static SEXPR s_stack[NSTACK];
+static int s_sp;
 
 /* To protect from gc */
 static SEXPR s_cons_car;
 static SEXPR s_cons_cdr;
-static SEXPR s_protect_a;
-static SEXPR s_protect_b;
-static SEXPR s_protect_c;
+
+/* the cells of the static segment, see seal_static() */
+enum { STATIC_CLEAN = 1, STATIC_DIRTY };
+
+static unsigned char s_static_cells[NCELL];
 
 /* Other precreated atoms */
 SEXPR s_quote_atom;
+SEXPR s_define_atom;
+SEXPR s_fold_atom;
+SEXPR s_inline_atom;
+SEXPR s_site_atom;
 
 /* Makes an sexpr form two sexprs. */
 SEXPR p_cons(SEXPR first, SEXPR rest)
@@ -77,26 +91,57 @@ int pop_free_cell(void)
 
 	celli = sexpr_index(s_free_cells);
 	s_free_cells = p_cdr(s_free_cells);
+	if (s_in_region) {
+		region_alloc_cell(celli);
+	}
 	return celli;
 }
 
+void free_cell(int celli)
+{
+	if (s_static_cells[celli]) {
+		return;
+	}
+	region_free_cell(celli);
+	set_cell_car(celli, SEXPR_NIL);
+	set_cell_cdr(celli, s_free_cells);
+	s_free_cells = make_cons(celli);
+}
+
+/*
+ * Returns to the free list the cells of the environment env: the header,
+ * and the link and binding of each variable, but not the values.
+ * Nothing must refer to env or its bindings.
+ */
+void free_environment(SEXPR env)
+{
+	SEXPR link, next;
+
+	link = p_cdr(env);
+	free_cell(sexpr_index(env));
+	while (!p_nullp(link)) {
+		next = p_cdr(link);
+		free_cell(sexpr_index(p_car(link)));
+		free_cell(sexpr_index(link));
+		link = next;
+	}
+}
+
 /*********************************************************
  * push and pop to stack to protect from gc.
  *********************************************************/
 
 int stack_empty(void)
 {
-	return p_eqp(s_stack, SEXPR_NIL);
+	return s_sp == 0;
 }
 
 void clear_stack(void)
 {
-	s_stack = SEXPR_NIL;
+	s_sp = 0;
+	region_abandon();
 	s_cons_car = SEXPR_NIL;
 	s_cons_cdr = SEXPR_NIL;
-	s_protect_a = SEXPR_NIL;
-	s_protect_b = SEXPR_NIL;
-	s_protect_c = SEXPR_NIL;
 	s_env = SEXPR_NIL;
 	s_expr = SEXPR_NIL;
 	s_val = SEXPR_NIL;
@@ -108,56 +153,183 @@ void clear_stack(void)
 /* Protect expression form gc by pushin it to s_stack. Return e. */
 SEXPR push(SEXPR e)
 {
-	s_stack = p_cons(e, s_stack);
+	if (s_sp == NSTACK) {
+		throw_err("stack overflow");
+	}
+
+	s_stack[s_sp++] = e;
 	return e;
 }
 
 void push2(SEXPR e1, SEXPR e2)
 {
-	s_protect_a = e1;
-	s_protect_b = e2;
 	push(e1);
 	push(e2);
-	s_protect_a = SEXPR_NIL;
-	s_protect_b = SEXPR_NIL;
 }
 
 void push3(SEXPR e1, SEXPR e2, SEXPR e3)
 {
-	s_protect_a = e1;
-	s_protect_b = e2;
-	s_protect_c = e3;
 	push(e1);
 	push(e2);
 	push(e3);
-	s_protect_a = SEXPR_NIL;
-	s_protect_b = SEXPR_NIL;
-	s_protect_c = SEXPR_NIL;
 }
 
 /* Pop last expression from stack. */
 SEXPR pop(void)
 {
-	SEXPR e;
-
 	assert(!stack_empty());
-	e = p_car(s_stack);
-	s_stack = p_cdr(s_stack);
-	return e;
+	return s_stack[--s_sp];
 }
 
 void popn(int n)
 {
-	assert(n >= 0);
-	while (n--) {
-		pop();
+	assert(n >= 0 && n <= s_sp);
+	s_sp -= n;
+}
+
+/*
+ * Returns a pointer to the last n pushed expressions, the first pushed at
+ * index 0. This is how procedures receive their arguments.
+ * The pointer is valid until these expressions are popped.
+ */
+SEXPR *stack_top(int n)
+{
+	assert(n >= 0 && n <= s_sp);
+	return &s_stack[s_sp - n];
+}
+
+struct index_list {
+	int *elems;
+	int n;
+	int capacity;
+};
+
+/*
+ * The weak pairs and weak hash tables found while marking, for gc_weak().
+ */
+static struct index_list s_weak_pairs;
+static struct index_list s_weak_tables;
+
+static void add_index(struct index_list *pl, int i)
+{
+	int *p;
+	int n;
+
+	if (pl->n == pl->capacity) {
+		n = (pl->capacity == 0) ? 64 : pl->capacity * 2;
+		p = realloc(pl->elems, n * sizeof(*p));
+		if (p == NULL) {
+			fprintf(stderr, "lispe: out of heap space for gc\n");
+			exit(EXIT_FAILURE);
+		}
+		pl->elems = p;
+		pl->capacity = n;
 	}
+	pl->elems[pl->n++] = i;
+}
+
+static void gc_mark(SEXPR e);
+
+/*
+ * Returns 1 if e is an object that weak references do not keep alive: one
+ * with an identity of its own. Numbers, symbols and the rest are always
+ * kept.
+ */
+static int weakly_held(SEXPR e)
+{
+	switch (sexpr_type(e)) {
+	case SEXPR_CONS:
+	case SEXPR_FUNCTION:
+	case SEXPR_SPECIAL:
+	case SEXPR_DYN_FUNCTION:
+	case SEXPR_PROMISE:
+	case SEXPR_WEAK_PAIR:
+	case SEXPR_VECTOR:
+	case SEXPR_HASHTABLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Returns 1 if e has been marked, or is not weakly held. */
+static int gc_marked(SEXPR e)
+{
+	switch (sexpr_type(e)) {
+	case SEXPR_VECTOR:
+		return vector_marked(sexpr_index(e));
+	case SEXPR_HASHTABLE:
+		return hashtable_marked(sexpr_index(e));
+	default:
+		return !weakly_held(e) || cell_marked(sexpr_index(e));
+	}
+}
+
+/* Marks what a weak reference to e keeps alive. */
+static void gc_mark_weak(SEXPR e)
+{
+	if (!weakly_held(e)) {
+		gc_mark(e);
+	}
+}
+
+/*
+ * Called after marking from the roots.
+ *
+ * The entries of weak tables are ephemerons: the value of each entry whose
+ * key is marked is marked, which can mark more keys, until no more are.
+ * Then the entries whose key is not marked are dropped, and the weak pairs
+ * whose car is not marked get #f as car.
+ */
+static void gc_weak(void)
+{
+	SEXPR t, key, val;
+	int i, k, r, nlive, nlive_before;
+
+	nlive = -1;
+	do {
+		nlive_before = nlive;
+		nlive = 0;
+		/* marking can find more weak tables: s_weak_tables.n grows */
+		for (i = 0; i < s_weak_tables.n; i++) {
+			t = make_hashtable_sexpr(s_weak_tables.elems[i]);
+			for (k = 0; (r = hashtable_slot(t, k, &key, &val)) >= 0;
+			     k++)
+			{
+				if (r > 0 && gc_marked(key)) {
+					nlive++;
+					gc_mark(key);
+					gc_mark(val);
+				}
+			}
+		}
+	} while (nlive != nlive_before);
+
+	for (i = 0; i < s_weak_tables.n; i++) {
+		t = make_hashtable_sexpr(s_weak_tables.elems[i]);
+		for (k = 0; (r = hashtable_slot(t, k, &key, &val)) >= 0; k++) {
+			if (r > 0 && !gc_marked(key)) {
+				hashtable_delete_slot(t, k);
+			}
+		}
+	}
+
+	for (i = 0; i < s_weak_pairs.n; i++) {
+		k = s_weak_pairs.elems[i];
+		if (!gc_marked(cell_car(k))) {
+			set_cell_car(k, SEXPR_FALSE);
+		}
+	}
+
+	s_weak_tables.n = 0;
+	s_weak_pairs.n = 0;
 }
 
 /* Marks an expression and subexpressions. */
 static void gc_mark(SEXPR e)
 {
-	int celli;
+	SEXPR key, val;
+	int celli, i, n, r;
 
 	switch (sexpr_type(e)) {
 	case SEXPR_NUMBER:
@@ -169,6 +341,7 @@ static void gc_mark(SEXPR e)
 	case SEXPR_FUNCTION:
 	case SEXPR_SPECIAL:
 	case SEXPR_DYN_FUNCTION:
+	case SEXPR_PROMISE:
 	case SEXPR_CONS:
 		celli = sexpr_index(e);
 		if (if_cell_mark(celli)) {
@@ -176,6 +349,169 @@ static void gc_mark(SEXPR e)
 			gc_mark(cell_cdr(celli));
 		}
 		break;
+	case SEXPR_VECTOR:
+		if (if_vector_mark(sexpr_index(e))) {
+			n = vector_size(e);
+			for (i = vector_sexprs_start(e); i < n; i++) {
+				gc_mark(((SEXPR *) vector_data(e))[i]);
+			}
+		}
+		break;
+	case SEXPR_WEAK_PAIR:
+		celli = sexpr_index(e);
+		if (if_cell_mark(celli)) {
+			add_index(&s_weak_pairs, celli);
+			gc_mark_weak(cell_car(celli));
+			gc_mark(cell_cdr(celli));
+		}
+		break;
+	case SEXPR_HASHTABLE:
+		if (!if_hashtable_mark(sexpr_index(e))) {
+			break;
+		} else if (hashtable_weak(e)) {
+			add_index(&s_weak_tables, sexpr_index(e));
+		} else {
+			for (i = 0; (r = hashtable_slot(e, i, &key, &val)) >= 0;
+			     i++)
+			{
+				if (r > 0) {
+					gc_mark(key);
+					gc_mark(val);
+				}
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * The static segment.
+ *
+ * seal_static() makes static the cells and numbers that the environments
+ * lead to: after loading init.scm, and on (seal!). Their marks stay set,
+ * so gc does not go through them again, nor sweep them.
+ *
+ * gc must still mark what they refer to that is not static: the symbols,
+ * vectors, hash tables and weak pairs they refer to when sealed, kept on
+ * s_static_roots, and what is stored in them after, for which a write
+ * barrier keeps the cells changed on s_static_dirty (see static_store()).
+ *
+ * Nothing static is ever freed: a weak reference to it is never cleared.
+ */
+static int s_nstatic;
+static struct index_list s_static_roots;
+static struct index_list s_static_dirty;
+
+/* The write barrier: the car or cdr of cell celli is being changed. */
+void static_store(int celli)
+{
+	if (s_static_cells[celli] == STATIC_CLEAN) {
+		s_static_cells[celli] = STATIC_DIRTY;
+		add_index(&s_static_dirty, celli);
+	}
+}
+
+/* Makes e, and the cells and numbers it leads to, static. */
+static void seal(SEXPR e)
+{
+	int celli;
+
+	for (;;) {
+		switch (sexpr_type(e)) {
+		case SEXPR_NUMBER:
+			make_number_static(sexpr_index(e));
+			return;
+		case SEXPR_FUNCTION:
+		case SEXPR_SPECIAL:
+		case SEXPR_DYN_FUNCTION:
+		case SEXPR_PROMISE:
+		case SEXPR_CONS:
+			celli = sexpr_index(e);
+			if (s_static_cells[celli]) {
+				return;
+			}
+			s_static_cells[celli] = STATIC_CLEAN;
+			s_nstatic++;
+			mark_cell(celli);
+			seal(cell_car(celli));
+			e = cell_cdr(celli);
+			break;
+		case SEXPR_SYMBOL:
+		case SEXPR_VECTOR:
+		case SEXPR_HASHTABLE:
+		case SEXPR_WEAK_PAIR:
+			add_index(&s_static_roots, e);
+			return;
+		default:
+			return;
+		}
+	}
+}
+
+static int compare_roots(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* Makes static what the environments lead to. Returns the static cells. */
+int seal_static(void)
+{
+	int i, k, n;
+
+	if (s_in_region) {
+		region_escaped();
+	}
+
+	seal(s_topenv);
+	seal(s_hidenv);
+
+	/* what was stored in static cells is static now too */
+	for (i = 0; i < s_static_dirty.n; i++) {
+		k = s_static_dirty.elems[i];
+		s_static_cells[k] = STATIC_CLEAN;
+		seal(cell_car(k));
+		seal(cell_cdr(k));
+	}
+	s_static_dirty.n = 0;
+
+	/* the same symbol is found many times */
+	qsort(s_static_roots.elems, s_static_roots.n, sizeof(int),
+	      &compare_roots);
+	n = 0;
+	for (i = 0; i < s_static_roots.n; i++) {
+		if (n == 0 || s_static_roots.elems[i] !=
+			      s_static_roots.elems[n - 1])
+		{
+			s_static_roots.elems[n++] = s_static_roots.elems[i];
+		}
+	}
+	s_static_roots.n = n;
+
+	printf("[static: %d cells, %d roots]\n", s_nstatic, n);
+	return s_nstatic;
+}
+
+/* Marks what the static segment refers to. */
+static void gc_mark_static(void)
+{
+	int i, k;
+
+	for (i = 0; i < s_static_roots.n; i++) {
+		gc_mark(s_static_roots.elems[i]);
+	}
+	for (i = 0; i < s_static_dirty.n; i++) {
+		k = s_static_dirty.elems[i];
+		gc_mark(cell_car(k));
+		gc_mark(cell_cdr(k));
+	}
+}
+
+static void gc_mark_stack(void)
+{
+	int i;
+
+	for (i = 0; i < s_sp; i++) {
+		gc_mark(s_stack[i]);
 	}
 }
 
@@ -192,21 +528,29 @@ void p_gc(void)
 	gc_mark(s_proc);
 	gc_mark(s_args);
 	gc_mark(s_unev);
-	gc_mark(s_stack);
+	gc_mark_stack();
 	gc_mark(s_hidenv);
 	gc_mark(s_cons_car);
 	gc_mark(s_cons_cdr);
-	gc_mark(s_protect_a);
-	gc_mark(s_protect_b);
-	gc_mark(s_protect_c);
+	gc_mark_static();
+	gc_weak();
+	gc_region();
 
 	gc_symbols();
 	gc_numbers();
+	gc_vectors();
+	gc_hashtables();
+	gc_case_tables();
+	gc_sites();
+	gc_hcons();
 
 	used = 0;
 	s_free_cells = SEXPR_NIL;
 	for (i = 0; i < NCELL; i++) {
-		if (if_cell_unmark(i)) {
+		if (s_static_cells[i]) {
+			/* stays marked */
+			used++;
+		} else if (if_cell_unmark(i)) {
 			used++;
 		} else {
 			set_cell_cdr(i, s_free_cells);
@@ -234,6 +578,22 @@ static void install_symbols(void)
 	s_expr = s_val = s_quote_atom;
 	s_env = s_hidenv;
 	define_variable();
+
+	s_define_atom = make_symbol("define", 6);
+	s_expr = s_val = s_define_atom;
+	define_variable();
+
+	s_fold_atom = make_symbol("%fold", 5);
+	s_expr = s_val = s_fold_atom;
+	define_variable();
+
+	s_inline_atom = make_symbol("%inline", 7);
+	s_expr = s_val = s_inline_atom;
+	define_variable();
+
+	s_site_atom = make_symbol("%site", 5);
+	s_expr = s_val = s_site_atom;
+	define_variable();
 }
 
 /* Init this module, in particular the SEXPR_NIL atom and the free list of cells.
@@ -261,12 +621,11 @@ void gcbase_init(void)
 	s_proc = SEXPR_NIL;
 	s_args = SEXPR_NIL;
 	s_unev = SEXPR_NIL;
-	s_stack = SEXPR_NIL;
+	s_sp = 0;
 	s_cons_car = SEXPR_NIL;
 	s_cons_cdr = SEXPR_NIL;
-	s_protect_a = SEXPR_NIL;
-	s_protect_b = SEXPR_NIL;
-	s_protect_c = SEXPR_NIL;
+
+	printf("[stack: %d, %zu bytes]\n", NSTACK, sizeof(s_stack));
 
 	install_symbols();
 }
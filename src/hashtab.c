@@ -0,0 +1,770 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Hash tables, as in SRFI-69, comparing keys with eq?, eqv? or equal?.
+ *
+ * A hash table is an entry of s_tables with an array of slots, searched
+ * with open addressing. eq? tables hash the SEXPR of the key (cells never
+ * move), eqv? tables hash numbers by value, and equal? tables walk pairs
+ * and vectors for a structural hash.
+ *
+ * When the slots get 3/4 used the table is resized incrementally: a new
+ * array is made and the old one is kept; each access after that moves
+ * MIGRATE_STEP slots of the old array to the new one, and lookups search
+ * both until the old one is empty. So no single access pays for the whole
+ * copy.
+ *
+ * gc marks the keys and values of the tables that are reachable; the rest
+ * of the tables are freed (see gc_hashtables()). The keys of weak tables,
+ * made by make-weak-hash-table, are not kept alive: their entries are
+ * ephemerons, whose value is marked only if the key is reachable from
+ * elsewhere, and which are dropped when the key is collected (see
+ * gc_weak()).
+ */
+
+enum {
+	MIGRATE_STEP = 8,
+	HASHTABLE_GC_BYTES = 1 << 18,
+	/* the number of elements an equal? hash looks at */
+	EQUAL_HASH_LIMIT = 32,
+};
+
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_DELETED };
+
+struct slot {
+	SEXPR key;
+	SEXPR val;
+	unsigned int hash;
+	int state;
+};
+
+struct hashtable {
+	/* HASH_EQ, HASH_EQV, HASH_EQUAL, or -1 if the entry is free */
+	int equiv;
+	int weak;
+	int marked;
+	/* the next free entry, if this one is free */
+	int next;
+	int count;
+	/* full or deleted slots of slots */
+	unsigned int used;
+	/* a power of 2 */
+	unsigned int size;
+	struct slot *slots;
+	/* the array being migrated to slots, or NULL */
+	struct slot *old;
+	unsigned int oldsize;
+	/* the slots of old before this one have been moved */
+	unsigned int migrated;
+};
+
+static struct hashtable *s_tables;
+static int s_ntables;
+static int s_free_tables = -1;
+static size_t s_table_bytes_allocated;
+
+static struct slot *alloc_slots(unsigned int n)
+{
+	struct slot *ps;
+
+	ps = calloc(n, sizeof(*ps));
+	if (ps == NULL) {
+		throw_err("out of heap space for hash tables");
+	}
+	s_table_bytes_allocated += n * sizeof(*ps);
+
+	return ps;
+}
+
+static int pop_free_table(void)
+{
+	struct hashtable *pt;
+	int i, n;
+
+	if (s_free_tables >= 0) {
+		i = s_free_tables;
+		s_free_tables = s_tables[i].next;
+		return i;
+	}
+
+	n = (s_ntables == 0) ? 64 : s_ntables * 2;
+	if (n > INDEX_MASK_SEXPR) {
+		throw_err("out of hash tables");
+	}
+	pt = realloc(s_tables, n * sizeof(*pt));
+	if (pt == NULL) {
+		throw_err("out of heap space for hash tables");
+	}
+	s_tables = pt;
+	for (i = n - 1; i >= s_ntables; i--) {
+		s_tables[i].equiv = -1;
+		s_tables[i].marked = 0;
+		s_tables[i].slots = NULL;
+		s_tables[i].old = NULL;
+		s_tables[i].next = s_free_tables;
+		s_free_tables = i;
+	}
+	s_ntables = n;
+
+	return pop_free_table();
+}
+
+static struct hashtable *get_table(SEXPR t)
+{
+	assert(p_hashtablep(t));
+	chkrange(sexpr_index(t), s_ntables);
+	return &s_tables[sexpr_index(t)];
+}
+
+/* Returns a new empty table comparing keys with equiv. Can run gc. */
+SEXPR make_hashtable(int equiv)
+{
+	struct hashtable *pt;
+	int i;
+
+	if (s_table_bytes_allocated > HASHTABLE_GC_BYTES) {
+		printf("[gc: need hash tables]\n");
+		p_gc();
+	}
+
+	if (s_in_region) {
+		region_escaped();
+	}
+	i = pop_free_table();
+	pt = &s_tables[i];
+	pt->equiv = equiv;
+	pt->marked = 0;
+	pt->count = 0;
+	pt->used = 0;
+	pt->size = 8;
+	pt->slots = alloc_slots(pt->size);
+	pt->old = NULL;
+	pt->oldsize = 0;
+	pt->migrated = 0;
+	pt->weak = 0;
+
+	return make_hashtable_sexpr(i);
+}
+
+/************************************************************/
+/* hashing                                                  */
+/************************************************************/
+
+static unsigned int mix(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static unsigned int hash_number(SEXPR e)
+{
+	unsigned long long u;
+	double d;
+
+	d = number_real_value(sexpr_number(e));
+	if (d == 0) {
+		/* -0.0 is = to 0.0 */
+		d = 0;
+	}
+	memcpy(&u, &d, sizeof(u) < sizeof(d) ? sizeof(u) : sizeof(d));
+	return (unsigned int) (u ^ (u >> 32));
+}
+
+/* Hashes e for equal?, looking at *budget elements at most. */
+static unsigned int hash_equal(SEXPR e, int *budget)
+{
+	unsigned int h;
+	int i, n;
+
+	if (--*budget < 0) {
+		return 0;
+	}
+
+	if (p_numberp(e)) {
+		return hash_number(e);
+	} else if (p_pairp(e)) {
+		h = 17;
+		while (p_pairp(e) && *budget > 0) {
+			h = h * 31 + hash_equal(p_car(e), budget);
+			e = p_cdr(e);
+		}
+		return p_pairp(e) ? h : h * 31 + hash_equal(e, budget);
+	} else if (sexpr_type(e) == SEXPR_VECTOR &&
+		   vector_kind(e) == VECTOR_GENERAL)
+	{
+		h = 19 + vector_size(e);
+		n = vector_size(e);
+		for (i = 0; i < n && *budget > 0; i++) {
+			h = h * 31 + hash_equal(vector_elems(e)[i], budget);
+		}
+		return h;
+	} else if (sexpr_type(e) == SEXPR_VECTOR) {
+		/* numeric vectors: only the kind and length */
+		return 23 + vector_kind(e) * 31 + vector_size(e);
+	}
+
+	return (unsigned int) e;
+}
+
+/* Returns the hash of key for the HASH_ equivalence equiv. */
+unsigned int hash_equiv(int equiv, SEXPR key)
+{
+	int budget;
+
+	if (equiv == HASH_EQUAL) {
+		budget = EQUAL_HASH_LIMIT;
+		return mix(hash_equal(key, &budget));
+	} else if (equiv == HASH_EQV && p_numberp(key)) {
+		return mix(hash_number(key));
+	}
+
+	return mix((unsigned int) key * 2654435761u);
+}
+
+/* Returns 1 if x and y are the same key for equiv. */
+int same_equiv(int equiv, SEXPR x, SEXPR y)
+{
+	switch (equiv) {
+	case HASH_EQ:
+		return p_eqp(x, y);
+	case HASH_EQV:
+		return p_eqvp(x, y);
+	default:
+		return p_equalp(x, y);
+	}
+}
+
+/************************************************************/
+/* slots                                                    */
+/************************************************************/
+
+/*
+ * Returns the full slot of slots, of size n, for key, or the slot where it
+ * would be put: the first deleted or empty one found.
+ */
+static struct slot *find_slot(int equiv, struct slot *slots, unsigned int n,
+			      SEXPR key, unsigned int hash)
+{
+	struct slot *ps, *free_slot;
+	unsigned int i, probes;
+
+	free_slot = NULL;
+	i = hash & (n - 1);
+	for (probes = 0; probes < n; probes++) {
+		ps = &slots[i];
+		if (ps->state == SLOT_EMPTY) {
+			return (free_slot != NULL) ? free_slot : ps;
+		} else if (ps->state == SLOT_DELETED) {
+			if (free_slot == NULL) {
+				free_slot = ps;
+			}
+		} else if (ps->hash == hash &&
+			   same_equiv(equiv, ps->key, key))
+		{
+			return ps;
+		}
+		i = (i + 1) & (n - 1);
+	}
+
+	return free_slot;
+}
+
+/* Puts in the new slots of pt a key that is not there. */
+static void put_new(struct hashtable *pt, SEXPR key, SEXPR val,
+		    unsigned int hash)
+{
+	struct slot *ps;
+	unsigned int i;
+
+	i = hash & (pt->size - 1);
+	while (pt->slots[i].state == SLOT_FULL) {
+		i = (i + 1) & (pt->size - 1);
+	}
+	ps = &pt->slots[i];
+	if (ps->state == SLOT_EMPTY) {
+		pt->used++;
+	}
+	ps->key = key;
+	ps->val = val;
+	ps->hash = hash;
+	ps->state = SLOT_FULL;
+}
+
+/* Moves up to n slots of the old array of pt to the new one. */
+static void migrate(struct hashtable *pt, unsigned int n)
+{
+	struct slot *ps;
+
+	while (pt->old != NULL && n-- > 0) {
+		ps = &pt->old[pt->migrated++];
+		if (ps->state == SLOT_FULL) {
+			put_new(pt, ps->key, ps->val, ps->hash);
+		}
+		if (pt->migrated == pt->oldsize) {
+			free(pt->old);
+			pt->old = NULL;
+			pt->oldsize = 0;
+			pt->migrated = 0;
+		}
+	}
+}
+
+/*
+ * Starts moving the slots of pt to a new array, if they are 3/4 used:
+ * twice as big, or as big if most of them are deleted ones.
+ */
+static void grow(struct hashtable *pt)
+{
+	unsigned int n;
+
+	if (pt->used * 4 < pt->size * 3) {
+		return;
+	}
+
+	/* the previous migration must end first */
+	migrate(pt, pt->oldsize);
+
+	n = (pt->count * 2 >= pt->size) ? pt->size * 2 : pt->size;
+	pt->old = pt->slots;
+	pt->oldsize = pt->size;
+	pt->migrated = 0;
+	pt->slots = alloc_slots(n);
+	pt->size = n;
+	pt->used = 0;
+}
+
+/* Returns the full slot for key in pt, or NULL. */
+static struct slot *lookup(struct hashtable *pt, SEXPR key, unsigned int hash)
+{
+	struct slot *ps;
+
+	migrate(pt, MIGRATE_STEP);
+	ps = find_slot(pt->equiv, pt->slots, pt->size, key, hash);
+	if (ps != NULL && ps->state == SLOT_FULL) {
+		return ps;
+	}
+
+	if (pt->old != NULL) {
+		ps = find_slot(pt->equiv, pt->old, pt->oldsize, key, hash);
+		if (ps != NULL && ps->state == SLOT_FULL &&
+		    ps >= &pt->old[pt->migrated])
+		{
+			return ps;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns the value for key in table t, or dflt if there is none. */
+SEXPR hashtable_ref(SEXPR t, SEXPR key, SEXPR dflt)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+
+	pt = get_table(t);
+	ps = lookup(pt, key, hash_equiv(pt->equiv, key));
+	return (ps != NULL) ? ps->val : dflt;
+}
+
+void hashtable_set(SEXPR t, SEXPR key, SEXPR val)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+	unsigned int hash;
+
+	pt = get_table(t);
+	region_store(t, key);
+	region_store(t, val);
+	hash = hash_equiv(pt->equiv, key);
+	ps = lookup(pt, key, hash);
+	if (ps != NULL && ps >= pt->slots && ps < pt->slots + pt->size) {
+		ps->val = val;
+		return;
+	}
+
+	if (ps != NULL) {
+		/* in the old array: move it now */
+		ps->state = SLOT_DELETED;
+	} else {
+		pt->count++;
+	}
+	grow(pt);
+	ps = find_slot(pt->equiv, pt->slots, pt->size, key, hash);
+	assert(ps != NULL);
+	if (ps->state == SLOT_EMPTY) {
+		pt->used++;
+	}
+	ps->key = key;
+	ps->val = val;
+	ps->hash = hash;
+	ps->state = SLOT_FULL;
+}
+
+/* Removes key from t. Returns 0 if it was not there. */
+int hashtable_delete(SEXPR t, SEXPR key)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+
+	pt = get_table(t);
+	ps = lookup(pt, key, hash_equiv(pt->equiv, key));
+	if (ps == NULL) {
+		return 0;
+	}
+
+	ps->state = SLOT_DELETED;
+	ps->key = SEXPR_NIL;
+	ps->val = SEXPR_NIL;
+	pt->count--;
+	return 1;
+}
+
+int hashtable_count(SEXPR t)
+{
+	return get_table(t)->count;
+}
+
+/*
+ * Sets *pkey and *pval to the slot i of t, counting the slots of the old
+ * array after the new ones. Returns 1 if the slot is full, 0 if not, -1
+ * if there is no slot i.
+ */
+int hashtable_slot(SEXPR t, int i, SEXPR *pkey, SEXPR *pval)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+	unsigned int k;
+
+	pt = get_table(t);
+	k = (unsigned int) i;
+	if (k < pt->size) {
+		ps = &pt->slots[k];
+	} else if (pt->old != NULL && k - pt->size < pt->oldsize) {
+		ps = &pt->old[k - pt->size];
+		if (ps < &pt->old[pt->migrated]) {
+			return 0;
+		}
+	} else {
+		return -1;
+	}
+
+	if (ps->state != SLOT_FULL) {
+		return 0;
+	}
+	*pkey = ps->key;
+	*pval = ps->val;
+	return 1;
+}
+
+/* Returns the slot i of t, as hashtable_slot(), or NULL. */
+static struct slot *table_slot(struct hashtable *pt, int i)
+{
+	unsigned int k;
+
+	k = (unsigned int) i;
+	if (k < pt->size) {
+		return &pt->slots[k];
+	} else if (pt->old != NULL && k - pt->size < pt->oldsize &&
+		   k - pt->size >= pt->migrated)
+	{
+		return &pt->old[k - pt->size];
+	}
+
+	return NULL;
+}
+
+/* Empties the full slot i of t, as counted by hashtable_slot(). */
+void hashtable_delete_slot(SEXPR t, int i)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+
+	pt = get_table(t);
+	ps = table_slot(pt, i);
+	assert(ps != NULL && ps->state == SLOT_FULL);
+	ps->state = SLOT_DELETED;
+	ps->key = SEXPR_NIL;
+	ps->val = SEXPR_NIL;
+	pt->count--;
+}
+
+int hashtable_weak(SEXPR t)
+{
+	return get_table(t)->weak;
+}
+
+int hashtable_marked(int i)
+{
+	chkrange(i, s_ntables);
+	return s_tables[i].marked;
+}
+
+/* Marks table i. Returns 1 if it was not marked. */
+int if_hashtable_mark(int i)
+{
+	chkrange(i, s_ntables);
+	if (s_tables[i].marked) {
+		return 0;
+	}
+	s_tables[i].marked = 1;
+	return 1;
+}
+
+/* Called by gc after marking: frees the tables not marked. */
+void gc_hashtables(void)
+{
+	struct hashtable *pt;
+	int i, nmarked;
+
+	nmarked = 0;
+	for (i = 0; i < s_ntables; i++) {
+		pt = &s_tables[i];
+		if (pt->marked) {
+			pt->marked = 0;
+			nmarked++;
+		} else if (pt->equiv >= 0) {
+			free(pt->slots);
+			free(pt->old);
+			pt->slots = NULL;
+			pt->old = NULL;
+			pt->equiv = -1;
+			pt->next = s_free_tables;
+			s_free_tables = i;
+		}
+	}
+	s_table_bytes_allocated = 0;
+
+	if (s_ntables > 0) {
+		printf("[gc: %d/%d hash tables]\n", nmarked, s_ntables);
+	}
+}
+
+/************************************************************/
+/* builtin functions                                        */
+/************************************************************/
+
+static SEXPR table_arg(SEXPR e)
+{
+	if (!p_hashtablep(e)) {
+		throw_err("hash table procedure used on something not a table");
+	}
+
+	return e;
+}
+
+/* Calls the procedure thunk with no arguments. */
+static void call_thunk(SEXPR thunk)
+{
+	s_proc = thunk;
+	p_call(0);
+}
+
+void hashtablep(int argc, SEXPR *argv)
+{
+	s_val = p_hashtablep(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+static int equivalence_arg(int argc, SEXPR *argv)
+{
+	int equiv;
+
+	equiv = HASH_EQUAL;
+	if (argc > 0) {
+		equiv = (sexpr_type(argv[0]) == SEXPR_BUILTIN_FUNCTION) ?
+			builtin_equivalence(sexpr_index(argv[0])) : -1;
+		if (equiv < 0) {
+			throw_err("make-hash-table: the equivalence must be "
+				  "eq?, eqv? or equal?");
+		}
+	}
+
+	return equiv;
+}
+
+/* (make-hash-table [equiv]), equiv being eq?, eqv? or equal? */
+void make_hashtable_fn(int argc, SEXPR *argv)
+{
+	s_val = make_hashtable(equivalence_arg(argc, argv));
+}
+
+/* (make-weak-hash-table [equiv]): a table that does not keep its keys */
+void make_weak_hashtable_fn(int argc, SEXPR *argv)
+{
+	s_val = make_hashtable(equivalence_arg(argc, argv));
+	get_table(s_val)->weak = 1;
+}
+
+/* (hash-table-ref table key [thunk]) */
+void hashtable_ref_fn(int argc, SEXPR *argv)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+
+	pt = get_table(table_arg(argv[0]));
+	ps = lookup(pt, argv[1], hash_equiv(pt->equiv, argv[1]));
+	if (ps != NULL) {
+		s_val = ps->val;
+	} else if (argc > 2) {
+		call_thunk(argv[2]);
+	} else {
+		throw_err("hash-table-ref: key not found");
+	}
+}
+
+/* (hash-table-ref/default table key default) */
+void hashtable_ref_default(int argc, SEXPR *argv)
+{
+	s_val = hashtable_ref(table_arg(argv[0]), argv[1], argv[2]);
+}
+
+void hashtable_set_fn(int argc, SEXPR *argv)
+{
+	hashtable_set(table_arg(argv[0]), argv[1], argv[2]);
+	s_val = argv[2];
+}
+
+void hashtable_delete_fn(int argc, SEXPR *argv)
+{
+	s_val = hashtable_delete(table_arg(argv[0]), argv[1]) ?
+		SEXPR_TRUE : SEXPR_FALSE;
+}
+
+void hashtable_contains(int argc, SEXPR *argv)
+{
+	struct hashtable *pt;
+
+	pt = get_table(table_arg(argv[0]));
+	s_val = (lookup(pt, argv[1], hash_equiv(pt->equiv, argv[1])) != NULL) ?
+		SEXPR_TRUE : SEXPR_FALSE;
+}
+
+/*
+ * (hash-table-update! table key proc [thunk]): sets key to (proc value),
+ * value being the one of key, or (thunk) if there is none.
+ */
+void hashtable_update(int argc, SEXPR *argv)
+{
+	struct hashtable *pt;
+	struct slot *ps;
+
+	pt = get_table(table_arg(argv[0]));
+	ps = lookup(pt, argv[1], hash_equiv(pt->equiv, argv[1]));
+	if (ps != NULL) {
+		s_val = ps->val;
+	} else if (argc > 3) {
+		call_thunk(argv[3]);
+	} else {
+		throw_err("hash-table-update!: key not found");
+	}
+
+	push(s_val);
+	s_proc = argv[2];
+	p_call(1);
+	pop();
+	/* proc may have changed the table: look the key up again */
+	hashtable_set(argv[0], argv[1], s_val);
+}
+
+/* (hash-table-update!/default table key proc default) */
+void hashtable_update_default(int argc, SEXPR *argv)
+{
+	push(hashtable_ref(table_arg(argv[0]), argv[1], argv[3]));
+	s_proc = argv[2];
+	p_call(1);
+	pop();
+	hashtable_set(argv[0], argv[1], s_val);
+}
+
+void hashtable_count_fn(int argc, SEXPR *argv)
+{
+	struct number n;
+
+	build_real_number(&n, hashtable_count(table_arg(argv[0])));
+	s_val = make_number(&n);
+}
+
+/* (hash-table-walk table proc): calls (proc key value) for each entry. */
+void hashtable_walk(int argc, SEXPR *argv)
+{
+	SEXPR key, val;
+	int i, r;
+
+	table_arg(argv[0]);
+	for (i = 0; (r = hashtable_slot(argv[0], i, &key, &val)) >= 0; i++) {
+		if (r > 0) {
+			push2(key, val);
+			s_proc = argv[1];
+			p_call(2);
+			popn(2);
+		}
+	}
+	s_val = SEXPR_FALSE;
+}
+
+/* Returns the list of what part(key, val) gives for each entry of t. */
+static void collect(SEXPR t, SEXPR (*part)(SEXPR key, SEXPR val))
+{
+	SEXPR key, val;
+	int i, r;
+
+	s_val = SEXPR_NIL;
+	for (i = 0; (r = hashtable_slot(t, i, &key, &val)) >= 0; i++) {
+		if (r > 0) {
+			push(s_val);
+			s_val = part(key, val);
+			s_val = p_cons(s_val, pop());
+		}
+	}
+}
+
+static SEXPR key_part(SEXPR key, SEXPR val)
+{
+	return key;
+}
+
+static SEXPR value_part(SEXPR key, SEXPR val)
+{
+	return val;
+}
+
+static SEXPR entry_part(SEXPR key, SEXPR val)
+{
+	return p_cons(key, val);
+}
+
+void hashtable_keys(int argc, SEXPR *argv)
+{
+	collect(table_arg(argv[0]), key_part);
+}
+
+void hashtable_values(int argc, SEXPR *argv)
+{
+	collect(table_arg(argv[0]), value_part);
+}
+
+void hashtable_to_alist(int argc, SEXPR *argv)
+{
+	collect(table_arg(argv[0]), entry_part);
+}
@@ -0,0 +1,239 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#include "cells.h"
+#include "cellmark.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+
+/*
+ * Hash-consing.
+ *
+ * (hcons a b) returns the pair (a . b) from a table of interned pairs: the
+ * same pair each time for an equal car and cdr. (freeze! obj) returns a
+ * copy of obj whose list structure is all interned that way, from the
+ * leaves up; obj itself is left as it is.
+ *
+ * These pairs are frozen: set-car! and set-cdr! refuse them, and two of
+ * them are equal? only if they are eq?, so equal? on them is O(1) (see
+ * p_equalp()) and equal trees are kept once.
+ *
+ * A pair is interned by its car and cdr: pairs, interned already, by
+ * identity, and anything else by equal?. So vectors in frozen structure
+ * must not be changed.
+ *
+ * The table does not keep anything alive: it is an open addressing set of
+ * cells, and after gc has marked, the cells not marked are dropped from it
+ * (see gc_hcons()).
+ */
+
+struct interned {
+	/* -1 if the entry is empty */
+	int celli;
+	unsigned int hash;
+};
+
+static struct interned *s_interned;
+static unsigned int s_interned_size;
+static unsigned int s_ninterned;
+
+/* the cells that are in s_interned */
+static unsigned char s_frozen[NCELL];
+
+int pair_frozen(SEXPR e)
+{
+	assert(p_pairp(e));
+	return s_frozen[sexpr_index(e)];
+}
+
+static unsigned int part_hash(SEXPR e)
+{
+	return hash_equiv(p_pairp(e) ? HASH_EQ : HASH_EQUAL, e);
+}
+
+static int same_part(SEXPR x, SEXPR y)
+{
+	if (p_pairp(x) || p_pairp(y)) {
+		return p_eqp(x, y);
+	}
+
+	return same_equiv(HASH_EQUAL, x, y);
+}
+
+static struct interned *alloc_interned(unsigned int n)
+{
+	struct interned *p;
+	unsigned int i;
+
+	p = malloc(n * sizeof(*p));
+	if (p == NULL) {
+		throw_err("out of heap space for hcons");
+	}
+	for (i = 0; i < n; i++) {
+		p[i].celli = -1;
+	}
+
+	return p;
+}
+
+/* Puts celli, with hash, on the table, that has room. */
+static void put_interned(int celli, unsigned int hash)
+{
+	unsigned int i;
+
+	i = hash & (s_interned_size - 1);
+	while (s_interned[i].celli >= 0) {
+		i = (i + 1) & (s_interned_size - 1);
+	}
+	s_interned[i].celli = celli;
+	s_interned[i].hash = hash;
+	s_ninterned++;
+}
+
+/* Rehashes the entries of old, of size n, for which keep() is 1. */
+static void rehash(struct interned *old, unsigned int n,
+		   int (*keep)(int celli))
+{
+	unsigned int i;
+
+	s_ninterned = 0;
+	for (i = 0; i < n; i++) {
+		if (old[i].celli < 0) {
+			continue;
+		} else if (keep(old[i].celli)) {
+			put_interned(old[i].celli, old[i].hash);
+		} else {
+			s_frozen[old[i].celli] = 0;
+		}
+	}
+}
+
+static int keep_all(int celli)
+{
+	return 1;
+}
+
+static void grow_interned(void)
+{
+	struct interned *old;
+	unsigned int oldsize;
+
+	old = s_interned;
+	oldsize = s_interned_size;
+	s_interned_size = (oldsize == 0) ? 256 : oldsize * 2;
+	s_interned = alloc_interned(s_interned_size);
+	rehash(old, oldsize, &keep_all);
+	free(old);
+}
+
+/* Returns the interned pair (a . b); a and b must be frozen already. */
+static SEXPR intern_pair(SEXPR a, SEXPR b)
+{
+	SEXPR e;
+	unsigned int hash, i;
+	int celli;
+
+	hash = part_hash(a) * 31 + part_hash(b);
+	if (s_interned_size > 0) {
+		i = hash & (s_interned_size - 1);
+		for (; s_interned[i].celli >= 0;
+		     i = (i + 1) & (s_interned_size - 1))
+		{
+			celli = s_interned[i].celli;
+			if (s_interned[i].hash == hash &&
+			    same_part(cell_car(celli), a) &&
+			    same_part(cell_cdr(celli), b))
+			{
+				return make_cons(celli);
+			}
+		}
+	}
+
+	if (s_in_region) {
+		region_escaped();
+	}
+
+	/* gc can run here, and change the table */
+	e = p_cons(a, b);
+	if ((s_ninterned + 1) * 2 > s_interned_size) {
+		grow_interned();
+	}
+	put_interned(sexpr_index(e), hash);
+	s_frozen[sexpr_index(e)] = 1;
+	return e;
+}
+
+/* Returns e with its list structure interned. */
+static SEXPR freeze(SEXPR e)
+{
+	SEXPR tail;
+	int n;
+
+	/* the cars are frozen first, and kept on the stack */
+	push(e);
+	n = 0;
+	for (tail = e; p_pairp(tail) && !pair_frozen(tail);
+	     tail = p_cdr(tail))
+	{
+		push(freeze(p_car(tail)));
+		n++;
+	}
+	while (n-- > 0) {
+		tail = intern_pair(pop(), tail);
+	}
+	pop();
+
+	return tail;
+}
+
+/* Called by gc after marking: drops the cells not marked. */
+void gc_hcons(void)
+{
+	struct interned *old;
+
+	if (s_ninterned == 0) {
+		return;
+	}
+
+	old = s_interned;
+	s_interned = alloc_interned(s_interned_size);
+	rehash(old, s_interned_size, &cell_marked);
+	free(old);
+}
+
+/************************************************************/
+/* builtin functions                                        */
+/************************************************************/
+
+void hcons(int argc, SEXPR *argv)
+{
+	SEXPR a;
+
+	a = push(freeze(argv[0]));
+	s_val = intern_pair(a, freeze(argv[1]));
+	pop();
+}
+
+void freeze_fn(int argc, SEXPR *argv)
+{
+	s_val = freeze(argv[0]);
+}
+
+void frozenp(int argc, SEXPR *argv)
+{
+	s_val = (p_pairp(argv[0]) && pair_frozen(argv[0])) ?
+		SEXPR_TRUE : SEXPR_FALSE;
+}
@@ -174,6 +174,11 @@ again:
 		 */
 		if (p[0] == '.' && p[1] == '\0' && separator(c)) {
 			t->tok.type = '.';
+		} else if (p[0] == '#' && c == '(' && (p[1] == '\0' ||
+			   strcmp(p, "#f64") == 0 || strcmp(p, "#s64") == 0))
+		{
+			t->tok.type = T_VECTOR;
+			t->peekc = EOF;
 		} else if (p[0] == '#' && p[1] == 't' && p[2] == '\0') {
 			t->tok.type = T_TRUE;
 		} else if (p[0] == '#' && p[1] == 'f' && p[2] == '\0') {
@@ -29,7 +29,9 @@ enum {
 	T_REAL,
 	T_COMPLEX,
 	T_TRUE,
-	T_FALSE
+	T_FALSE,
+	/* #(, #f64( or #s64(, the name is in value.atom */
+	T_VECTOR
 };
 
 enum {
@@ -26,97 +26,265 @@
 
 static void delay(void);
 static void cons_stream(void);
-static void pairp(void);
-static void numberp(void);
-static void complexp(void);
-static void realp(void);
-static void integerp(void);
-static void exactp(void);
-static void symbolp(void);
-static void eqp(void);
-static void eqvp(void);
-static void equalp(void);
-static void cons(void);
-static void car(void);
-static void cdr(void);
-static void setcar(void);
-static void setcdr(void);
+static void pairp(int argc, SEXPR *argv);
+static void numberp(int argc, SEXPR *argv);
+static void complexp(int argc, SEXPR *argv);
+static void realp(int argc, SEXPR *argv);
+static void integerp(int argc, SEXPR *argv);
+static void exactp(int argc, SEXPR *argv);
+static void symbolp(int argc, SEXPR *argv);
+static void eqp(int argc, SEXPR *argv);
+static void eqvp(int argc, SEXPR *argv);
+static void equalp(int argc, SEXPR *argv);
+static void cons(int argc, SEXPR *argv);
+static void weak_cons(int argc, SEXPR *argv);
+static void weak_pairp(int argc, SEXPR *argv);
+static void weak_car(int argc, SEXPR *argv);
+static void weak_cdr(int argc, SEXPR *argv);
+static void car(int argc, SEXPR *argv);
+static void cdr(int argc, SEXPR *argv);
+static void setcar(int argc, SEXPR *argv);
+static void seal(int argc, SEXPR *argv);
+static void setcdr(int argc, SEXPR *argv);
+static void force(int argc, SEXPR *argv);
+static void make_promise_fn(int argc, SEXPR *argv);
+static void promisep(int argc, SEXPR *argv);
+static void stream_car(int argc, SEXPR *argv);
+static void stream_cdr(int argc, SEXPR *argv);
 static void quote(void);
 static void cond(void);
+static void declare(void);
+static void case_special(void);
 static void iff(void);
 static void or(void);
 static void and(void);
 static void lambda(void);
+static void begin(void);
+static void let(void);
+static void let_star(void);
+static void letrec(void);
+static void do_loop(void);
 static void special(void);
+static void load_extension_special(void);
+static void foreign_procedure_special(void);
 static void body(void);
 static void define(void);
 static void set(void);
-static void plus(void);
-static void difference(void);
-static void times(void);
-static void divide(void);
-static void lessp(void);
-static void greaterp(void);
-static void greater_eqp(void);
-static void less_eqp(void);
-static void equal_numbersp(void);
-static void eval(void);
-static void apply(void);
-static void gc(void);
-static void quit(void);
+static void plus(int argc, SEXPR *argv);
+static void difference(int argc, SEXPR *argv);
+static void times(int argc, SEXPR *argv);
+static void divide(int argc, SEXPR *argv);
+static void lessp(int argc, SEXPR *argv);
+static void greaterp(int argc, SEXPR *argv);
+static void greater_eqp(int argc, SEXPR *argv);
+static void less_eqp(int argc, SEXPR *argv);
+static void equal_numbersp(int argc, SEXPR *argv);
+static void eval(int argc, SEXPR *argv);
+static void apply(int argc, SEXPR *argv);
+static void gc(int argc, SEXPR *argv);
+static void syntax_expand_fn(int argc, SEXPR *argv);
+static void syntax_rules(void);
+static void quit(int argc, SEXPR *argv);
 
 /*********************************************************/
 
+/*
+ * Builtin functions receive their evaluated arguments in argv, which points
+ * into the stack. The number of arguments is checked against minargs and
+ * maxargs before calling them; maxargs is ANYARGS if there is no maximum.
+ */
 struct builtin {
 	const char* id;
-	void (*fun)(void);
+	void (*fun)(int argc, SEXPR *argv);
+	int minargs;
+	int maxargs;
 };
 
- struct builtin builtin_functions[] = {
-	{ "apply", &apply },
-	{ "car",  &car },
-	{ "cdr", &cdr },
-	{ "complex?", &complexp },
-	{ "cons", &cons },
-	{ "-", &difference },
-	{ "=", &equal_numbersp },
-	{ "eq?", &eqp },
-	{ "eqv?", &eqvp },
-	{ "equal?", &equalp },
-	{ "eval", &eval },
-	{ "exact?", &exactp },
-	{ ">", &greaterp },
-	{ ">=", &greater_eqp },
-	{ "gc", &gc },
-	{ "integer?", &integerp },
-	{ "<", &lessp },
-	{ "<=", &less_eqp },
-	{ "number?", &numberp },
-	{ "pair?", &pairp },
-	{ "+", &plus },
-	{ "real?", &realp },
-	{ "set-car!", &setcar },
-	{ "set-cdr!", &setcdr },
-	{ "symbol?", &symbolp },
-	{ "*", &times },
-	{ "quit", &quit },
-	{ "/", &divide },
+enum { ANYARGS = -1 };
+
+struct builtin builtin_functions[] = {
+	{ "append", &append, 0, ANYARGS },
+	{ "apply", &apply, 2, 2 },
+	{ "assoc", &assoc, 2, 3 },
+	{ "assq", &assq, 2, 2 },
+	{ "assv", &assv, 2, 2 },
+	{ "car",  &car, 1, 1 },
+	{ "cdr", &cdr, 1, 1 },
+	{ "complex?", &complexp, 1, 1 },
+	{ "cons", &cons, 2, 2 },
+	{ "-", &difference, 1, ANYARGS },
+	{ "=", &equal_numbersp, 2, ANYARGS },
+	{ "eq?", &eqp, 2, 2 },
+	{ "eqv?", &eqvp, 2, 2 },
+	{ "equal?", &equalp, 2, 2 },
+	{ "eval", &eval, 1, 1 },
+	{ "exact?", &exactp, 1, 1 },
+	{ "f64vector", &f64vector, 0, ANYARGS },
+	{ "f64vector?", &f64vectorp, 1, 1 },
+	{ "f64vector-add!", &f64vector_add, 2, 2 },
+	{ "f64vector-dot", &f64vector_dot, 2, 2 },
+	{ "f64vector-length", &f64vector_length, 1, 1 },
+	{ "f64vector-map!", &f64vector_map, 2, 3 },
+	{ "f64vector-max", &f64vector_max, 1, 1 },
+	{ "f64vector-min", &f64vector_min, 1, 1 },
+	{ "f64vector-ref", &f64vector_ref, 2, 2 },
+	{ "f64vector-scale!", &f64vector_scale, 2, 2 },
+	{ "f64vector-set!", &f64vector_set, 3, 3 },
+	{ "f64vector-sum", &f64vector_sum, 1, 1 },
+	{ "f64vector->list", &f64vector_to_list, 1, 1 },
+	{ "filter", &filter, 2, 2 },
+	{ "fold-left", &fold_left, 3, ANYARGS },
+	{ "fold-right", &fold_right, 3, ANYARGS },
+	{ "for-each", &for_each, 2, ANYARGS },
+	{ "force", &force, 1, 1 },
+	{ "freeze!", &freeze_fn, 1, 1 },
+	{ "frozen?", &frozenp, 1, 1 },
+	{ ">", &greaterp, 2, ANYARGS },
+	{ ">=", &greater_eqp, 2, ANYARGS },
+	{ "gc", &gc, 0, 0 },
+	{ "hash-table?", &hashtablep, 1, 1 },
+	{ "hash-table-contains?", &hashtable_contains, 2, 2 },
+	{ "hash-table-count", &hashtable_count_fn, 1, 1 },
+	{ "hash-table-delete!", &hashtable_delete_fn, 2, 2 },
+	{ "hash-table-keys", &hashtable_keys, 1, 1 },
+	{ "hash-table-ref", &hashtable_ref_fn, 2, 3 },
+	{ "hash-table-ref/default", &hashtable_ref_default, 3, 3 },
+	{ "hash-table-set!", &hashtable_set_fn, 3, 3 },
+	{ "hash-table-update!", &hashtable_update, 3, 4 },
+	{ "hash-table-update!/default", &hashtable_update_default, 4, 4 },
+	{ "hash-table-values", &hashtable_values, 1, 1 },
+	{ "hash-table-walk", &hashtable_walk, 2, 2 },
+	{ "hash-table->alist", &hashtable_to_alist, 1, 1 },
+	{ "hcons", &hcons, 2, 2 },
+	{ "integer?", &integerp, 1, 1 },
+	{ "length", &length, 1, 1 },
+	{ "list?", &listp, 1, 1 },
+	{ "list-copy", &list_copy, 1, 1 },
+	{ "list-ref", &list_ref, 2, 2 },
+	{ "list-sort", &list_sort, 2, 2 },
+	{ "list-tail", &list_tail, 2, 2 },
+	{ "list->f64vector", &list_to_f64vector, 1, 1 },
+	{ "list->pvector", &list_to_pvector, 1, 1 },
+	{ "list->s64vector", &list_to_s64vector, 1, 1 },
+	{ "list->vector", &list_to_vector, 1, 1 },
+	{ "<", &lessp, 2, ANYARGS },
+	{ "<=", &less_eqp, 2, ANYARGS },
+	{ "make-f64vector", &make_f64vector, 1, 2 },
+	{ "make-hash-table", &make_hashtable_fn, 0, 1 },
+	{ "make-pmap", &make_pmap, 0, 1 },
+	{ "make-promise", &make_promise_fn, 1, 1 },
+	{ "make-s64vector", &make_s64vector, 1, 2 },
+	{ "make-vector", &make_vector_fn, 1, 2 },
+	{ "make-weak-hash-table", &make_weak_hashtable_fn, 0, 1 },
+	{ "map", &map, 2, ANYARGS },
+	{ "max", &maximum, 1, ANYARGS },
+	{ "merge", &merge, 3, 3 },
+	{ "member", &member, 2, 3 },
+	{ "memq", &memq, 2, 2 },
+	{ "memv", &memv, 2, 2 },
+	{ "min", &minimum, 1, ANYARGS },
+	{ "number?", &numberp, 1, 1 },
+	{ "pair?", &pairp, 1, 1 },
+	{ "pmap?", &pmapp, 1, 1 },
+	{ "pmap-contains?", &pmap_contains, 2, 2 },
+	{ "pmap-count", &pmap_count, 1, 1 },
+	{ "pmap-delete", &pmap_delete, 2, 2 },
+	{ "pmap-delete!", &pmap_delete_in_place, 2, 2 },
+	{ "pmap-persistent!", &pmap_persistent, 1, 1 },
+	{ "pmap-ref", &pmap_ref, 2, 3 },
+	{ "pmap-set", &pmap_set, 3, 3 },
+	{ "pmap-set!", &pmap_set_in_place, 3, 3 },
+	{ "pmap-transient", &pmap_transient, 1, 1 },
+	{ "pmap->alist", &pmap_to_alist, 1, 1 },
+	{ "promise?", &promisep, 1, 1 },
+	{ "pvector", &pvector, 0, ANYARGS },
+	{ "pvector?", &pvectorp, 1, 1 },
+	{ "pvector-length", &pvector_length, 1, 1 },
+	{ "pvector-persistent!", &pvector_persistent, 1, 1 },
+	{ "pvector-pop", &pvector_pop, 1, 1 },
+	{ "pvector-pop!", &pvector_pop_in_place, 1, 1 },
+	{ "pvector-push", &pvector_push, 2, 2 },
+	{ "pvector-push!", &pvector_push_in_place, 2, 2 },
+	{ "pvector-ref", &pvector_ref, 2, 2 },
+	{ "pvector-set", &pvector_set, 3, 3 },
+	{ "pvector-set!", &pvector_set_in_place, 3, 3 },
+	{ "pvector-transient", &pvector_transient, 1, 1 },
+	{ "pvector->list", &pvector_to_list, 1, 1 },
+	{ "+", &plus, 1, ANYARGS },
+	{ "real?", &realp, 1, 1 },
+	{ "reverse", &reverse, 1, 1 },
+	{ "s64vector", &s64vector, 0, ANYARGS },
+	{ "s64vector?", &s64vectorp, 1, 1 },
+	{ "s64vector-add!", &s64vector_add, 2, 2 },
+	{ "s64vector-dot", &s64vector_dot, 2, 2 },
+	{ "s64vector-length", &s64vector_length, 1, 1 },
+	{ "s64vector-map!", &s64vector_map, 2, 3 },
+	{ "s64vector-max", &s64vector_max, 1, 1 },
+	{ "s64vector-min", &s64vector_min, 1, 1 },
+	{ "s64vector-ref", &s64vector_ref, 2, 2 },
+	{ "s64vector-scale!", &s64vector_scale, 2, 2 },
+	{ "s64vector-set!", &s64vector_set, 3, 3 },
+	{ "s64vector-sum", &s64vector_sum, 1, 1 },
+	{ "s64vector->list", &s64vector_to_list, 1, 1 },
+	{ "seal!", &seal, 0, 0 },
+	{ "set-car!", &setcar, 2, 2 },
+	{ "set-cdr!", &setcdr, 2, 2 },
+	{ "sort", &sort, 2, 2 },
+	{ "sort!", &sort_in_place, 2, 2 },
+	{ "stream-car", &stream_car, 1, 1 },
+	{ "stream-cdr", &stream_cdr, 1, 1 },
+	{ "symbol?", &symbolp, 1, 1 },
+	{ "*", &times, 1, ANYARGS },
+	{ "quit", &quit, 0, 0 },
+	{ "vector", &vector_fn, 0, ANYARGS },
+	{ "vector?", &vectorp, 1, 1 },
+	{ "vector-fill!", &vector_fill, 2, 4 },
+	{ "vector-length", &vector_length, 1, 1 },
+	{ "vector-ref", &vector_ref, 2, 2 },
+	{ "vector-set!", &vector_set, 3, 3 },
+	{ "vector->list", &vector_to_list, 1, 3 },
+	{ "weak-car", &weak_car, 1, 1 },
+	{ "weak-cdr", &weak_cdr, 1, 1 },
+	{ "weak-cons", &weak_cons, 2, 2 },
+	{ "weak-pair?", &weak_pairp, 1, 1 },
+	{ "/", &divide, 1, ANYARGS },
+	{ "%syntax-expand", &syntax_expand_fn, 2, 2 },
 	/* modulo and remainder */
 };
 
-static struct builtin builtin_specials[] = {
+/* Builtin specials receive their unevaluated arguments in s_args. */
+struct builtin_special {
+	const char* id;
+	void (*fun)(void);
+};
+
+static struct builtin_special builtin_specials[] = {
 	{ "and", &and },
+	{ "begin", &begin },
 	{ "body", &body },
+	{ "case", &case_special },
 	{ "cond", &cond },
+	{ "cons-stream", &cons_stream },
+	{ "declare", &declare },
 	{ "define", &define },
+	{ "define-record-type", &define_record_type },
+	{ "define-syntax", &define },
+	{ "delay", &delay },
+	{ "do", &do_loop },
+	{ "foreign-procedure", &foreign_procedure_special },
 	{ "if", &iff },
 	{ "lambda", &lambda },
+	{ "let", &let },
+	{ "let*", &let_star },
+	{ "letrec", &letrec },
+	{ "letrec*", &letrec },
+	{ "load-extension", &load_extension_special },
 	{ "or", &or },
 	{ "quote", &quote },
 	{ "set!", &set },
 	{ "special", &special },
-	// { "delay", &delay },
-	// { "cons-stream", &cons_stream },
+	{ "syntax-rules", &syntax_rules },
+	{ "with-region", &with_region },
 };
 
 static void install_builtin(const char *name, SEXPR val)
@@ -147,38 +315,171 @@ static void install_builtin_specials(void)
 	}
 }
 
-static void apply_builtin(struct builtin *pbin)
+static void apply_builtin(struct builtin *pbin, int argc, SEXPR *argv)
+{
+	if (argc < pbin->minargs) {
+		throw_err("too few arguments for builtin procedure");
+	}
+	if (pbin->maxargs != ANYARGS && argc > pbin->maxargs) {
+		throw_err("too many arguments for builtin procedure");
+	}
+	pbin->fun(argc, argv);
+}
+
+/* The functions added by extensions (see ext.c) follow the builtin ones. */
+SEXPR make_ext_function(int i)
 {
-	pbin->fun();
+	return make_builtin_function(NELEMS(builtin_functions) + i);
 }
 
-void apply_builtin_function(int i)
+void apply_builtin_function(int i, int argc, SEXPR *argv)
 {
-	chkrange(i, NELEMS(builtin_functions));
-	apply_builtin(&builtin_functions[i]);
+	if (i >= NELEMS(builtin_functions)) {
+		apply_ext_function(i - NELEMS(builtin_functions), argc, argv);
+		return;
+	}
+	apply_builtin(&builtin_functions[i], argc, argv);
 }
 
 void apply_builtin_special(int i)
 {
 	chkrange(i, NELEMS(builtin_specials));
-	apply_builtin(&builtin_specials[i]);
+	builtin_specials[i].fun();
 }
 
-static const char *builtin_name(struct builtin *pbin)
+const char *builtin_function_name(int i)
 {
-	return pbin->id;
+	assert(i >= 0);
+	if (i >= NELEMS(builtin_functions)) {
+		return ext_function_name(i - NELEMS(builtin_functions));
+	}
+	return builtin_functions[i].id;
 }
 
-const char *builtin_function_name(int i)
+/*
+ * Returns the OP_LOGIC_ operation of the builtin function i if it is one of
+ * the number comparisons, or -1.
+ */
+int builtin_compare_op(int i)
+{
+	void (*fun)(int argc, SEXPR *argv);
+
+	if (i < 0 || i >= NELEMS(builtin_functions)) {
+		return -1;
+	}
+
+	fun = builtin_functions[i].fun;
+	if (fun == &lessp) {
+		return OP_LOGIC_LT;
+	} else if (fun == &greaterp) {
+		return OP_LOGIC_GT;
+	} else if (fun == &less_eqp) {
+		return OP_LOGIC_LE;
+	} else if (fun == &greater_eqp) {
+		return OP_LOGIC_GE;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the HASH_ equivalence of the builtin function i if it is eq?, eqv?
+ * or equal?, or -1.
+ */
+int builtin_equivalence(int i)
+{
+	void (*fun)(int argc, SEXPR *argv);
+
+	if (i < 0 || i >= NELEMS(builtin_functions)) {
+		return -1;
+	}
+
+	fun = builtin_functions[i].fun;
+	if (fun == &eqp) {
+		return HASH_EQ;
+	} else if (fun == &eqvp) {
+		return HASH_EQV;
+	} else if (fun == &equalp) {
+		return HASH_EQUAL;
+	}
+
+	return -1;
+}
+
+/*
+ * The builtin functions whose value depends only on their arguments, and
+ * that make no new objects, so a call with constant arguments can be
+ * computed once (see fold.c).
+ */
+static void (*pure_functions[])(int argc, SEXPR *argv) = {
+	&assoc, &assq, &assv, &car, &cdr, &complexp, &difference,
+	&equal_numbersp, &eqp, &eqvp, &equalp, &exactp, &greaterp,
+	&greater_eqp, &integerp, &length, &listp, &list_ref, &list_tail,
+	&lessp, &less_eqp, &maximum, &member, &memq, &memv, &minimum,
+	&numberp, &pairp, &plus, &realp, &symbolp, &times, &divide,
+};
+
+int builtin_function_pure(int i)
+{
+	int k;
+
+	if (i < 0 || i >= NELEMS(builtin_functions)) {
+		return 0;
+	}
+
+	for (k = 0; k < NELEMS(pure_functions); k++) {
+		if (builtin_functions[i].fun == pure_functions[k]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the SITE_ operation of the builtin function i if its call sites
+ * are profiled (see sites.c), or -1.
+ */
+int builtin_site_op(int i)
 {
-	assert(i >= 0 && i < NELEMS(builtin_functions));
-	return builtin_name(&builtin_functions[i]);
+	void (*fun)(int argc, SEXPR *argv);
+
+	if (i < 0 || i >= NELEMS(builtin_functions)) {
+		return -1;
+	}
+
+	fun = builtin_functions[i].fun;
+	if (fun == &plus) {
+		return SITE_ADD;
+	} else if (fun == &difference) {
+		return SITE_SUB;
+	} else if (fun == &times) {
+		return SITE_MUL;
+	} else if (fun == &divide) {
+		return SITE_DIV;
+	} else if (fun == &equal_numbersp) {
+		return SITE_EQ;
+	} else if (fun == &lessp) {
+		return SITE_LT;
+	} else if (fun == &greaterp) {
+		return SITE_GT;
+	} else if (fun == &less_eqp) {
+		return SITE_LE;
+	} else if (fun == &greater_eqp) {
+		return SITE_GE;
+	} else if (fun == &car) {
+		return SITE_CAR;
+	} else if (fun == &cdr) {
+		return SITE_CDR;
+	}
+
+	return -1;
 }
 
 const char *builtin_special_name(int i)
 {
 	assert(i >= 0 && i < NELEMS(builtin_specials));
-	return builtin_name(&builtin_specials[i]);
+	return builtin_specials[i].id;
 }
 
 /*********************************************************/
@@ -317,6 +618,82 @@ static void cond(void)
 	}
 }
 
+/*
+ * (case key ((datum ...) expr ...) ... (else expr ...))
+ * The clause is found on the table of the form (see casetab.c) instead of
+ * going through the datums. A clause can be ((datum ...) => proc), and
+ * then proc is called with the key.
+ */
+static void case_special(void)
+{
+	SEXPR clause, *pkey;
+
+	push(s_args);
+	push(s_env);
+	s_expr = p_car(s_args);
+	p_eval();
+	s_env = pop();
+	s_args = pop();
+
+	clause = case_clause(s_args, p_cdr(s_args), s_val);
+	if (p_nullp(clause)) {
+		s_val = SEXPR_NIL;
+		return;
+	}
+
+	s_unev = p_cdr(clause);
+	if (p_pairp(s_unev) && p_symbolp(p_car(s_unev)) &&
+	    strcmp(sexpr_name(p_car(s_unev)), "=>") == 0)
+	{
+		push(s_val);
+		pkey = stack_top(1);
+		s_expr = p_car(p_cdr(s_unev));
+		p_eval();
+		s_proc = s_val;
+		push(*pkey);
+		p_apply(1);
+		popn(2);
+		return;
+	}
+
+	p_evseq(0);
+	s_tailrec = 1;
+}
+
+/*
+ * (declare (flonum var ...) (pair var ...) ...)
+ * Checks that the variables have the types given. At the start of a
+ * procedure body, the calls on the body use the declarations to skip their
+ * own checks (see fold.c).
+ */
+static void declare(void)
+{
+#ifndef PP_UNSAFE
+	SEXPR d, v, bind;
+	int kind;
+
+	for (d = s_args; p_pairp(d); d = p_cdr(d)) {
+		if (!p_pairp(p_car(d))) {
+			throw_err("declare: bad declaration");
+		}
+		kind = declared_kind(p_car(p_car(d)));
+		if (kind == 0) {
+			throw_err("declare: unknown type");
+		}
+		for (v = p_cdr(p_car(d)); p_pairp(v); v = p_cdr(v)) {
+			bind = lookup_variable(p_car(v), s_env);
+			if (p_nullp(bind)) {
+				throw_err("variable not bound");
+			} else if (site_kind(p_cdr(bind)) != kind) {
+				throw_err("declare: variable of another type");
+			}
+		}
+	}
+#endif
+
+	s_val = SEXPR_NIL;
+}
+
 static void iff(void)
 {
 	s_expr = p_car(s_args);
@@ -334,7 +711,7 @@ static void iff(void)
 	s_tailrec = 1;
 }
 
-static void quit(void)
+static void quit(int argc, SEXPR *argv)
 {
 	exit(EXIT_SUCCESS);
 }
@@ -392,64 +769,83 @@ static void define(void)
 	define_variable();
 }
 
-static void cons(void)
+static void cons(int argc, SEXPR *argv)
 {
-	s_val = p_cons(p_car(s_args), p_car(p_cdr(s_args)));
+	s_val = p_cons(argv[0], argv[1]);
 }
 
-/* Checks that there are at least n elements on the list p. */
-static int at_leastn(SEXPR p, int n)
+/* (weak-cons obj1 obj2): a pair whose car gc does not keep alive */
+static void weak_cons(int argc, SEXPR *argv)
 {
-	while (n > 0 && p_pairp(p)) {
-		n--;
-		p = p_cdr(p);
+	s_val = make_weak_pair(sexpr_index(p_cons(argv[0], argv[1])));
+}
+
+static void weak_pairp(int argc, SEXPR *argv)
+{
+	s_val = p_weak_pairp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+static SEXPR weak_pair_arg(SEXPR e)
+{
+	if (!p_weak_pairp(e)) {
+		throw_err("weak pair procedure used on something not a weak "
+			  "pair");
 	}
 
-	return n == 0;
+	return e;
+}
+
+/* The car of a weak pair, or #f if gc has collected it. */
+static void weak_car(int argc, SEXPR *argv)
+{
+	s_val = cell_car(sexpr_index(weak_pair_arg(argv[0])));
+}
+
+static void weak_cdr(int argc, SEXPR *argv)
+{
+	s_val = cell_cdr(sexpr_index(weak_pair_arg(argv[0])));
 }
 
-/* Check that all the elements of p are numbers.  */
-static int all_numbers(SEXPR p)
+#ifndef PP_UNSAFE
+
+/* Check that all the argc elements of argv are numbers.  */
+static int all_numbers(int argc, SEXPR *argv)
 {
-	while (p_pairp(p)) {
-		if (!p_numberp(p_car(p))) {
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (!p_numberp(argv[i])) {
 			return 0;
-		} else {
-			p = p_cdr(p);
 		}
 	}
 
 	return 1;
 }
 
-static void arith(int n0, int op)
+#endif
+
+static void arith(int n0, int op, int argc, SEXPR *argv)
 {
 	struct number m, n;
-	struct number *pn;
+	int i;
 
 	build_real_number(&m, n0);	
 
-	/* count arguments */
-	if (!at_leastn(s_args, 1)) {
-		throw_err("too few arguments for arithmetic procedure");
-	}
-
+#ifndef PP_UNSAFE
 	/* check that they are numbers */
-	if (!all_numbers(s_args)) {
+	if (!all_numbers(argc, argv)) {
 		throw_err("bad argument for arithmetic procedure:"
 			  "not a number");
 	}
+#endif
 
 	/* calculate */
-	copy_number(sexpr_number(p_car(s_args)), &n);
-	s_args = p_cdr(s_args);
-	if (!p_pairp(s_args)) {
+	copy_number(sexpr_number(argv[0]), &n);
+	if (argc == 1) {
 		apply_arith_op(op, &m, &n, &n);
 	} else {
-		while (p_pairp(s_args)) {
-			pn = sexpr_number(p_car(s_args));
-			apply_arith_op(op, &n, pn, &n);
-			s_args = p_cdr(s_args);
+		for (i = 1; i < argc; i++) {
+			apply_arith_op(op, &n, sexpr_number(argv[i]), &n);
 		}
 	}
 
@@ -457,161 +853,161 @@ static void arith(int n0, int op)
 }
 
 /* used for =, <, >, <=, >= */
-static void logic(int op)
+static void logic(int op, int argc, SEXPR *argv)
 {
-	struct number n;
-	struct number *pn;
-
-	/* count arguments */
-	if (!at_leastn(s_args, 2)) {
-		throw_err("too few arguments for logic procedure");
-	}
+	int i;
 
+#ifndef PP_UNSAFE
 	/* check that they are numbers */
-	if (!all_numbers(s_args)) {
+	if (!all_numbers(argc, argv)) {
 		throw_err("bad argument for logic procedure: not a number");
 	}
+#endif
 
 	/* calculate */
-	copy_number(sexpr_number(p_car(s_args)), &n);
-	s_args = p_cdr(s_args);
-	while (!p_nullp(s_args)) {
-		pn = sexpr_number(p_car(s_args));
-		if (!apply_logic_op(op, &n, pn)) {
+	for (i = 1; i < argc; i++) {
+		if (!apply_logic_op(op, sexpr_number(argv[i - 1]),
+				    sexpr_number(argv[i])))
+		{
 			s_val = SEXPR_FALSE;
 			return;
 		}
-		copy_number(pn, &n);
-		s_args = p_cdr(s_args);
 	}
 
 	s_val = SEXPR_TRUE;
 }
 
-static void lessp(void)
+static void lessp(int argc, SEXPR *argv)
 {
-	logic(OP_LOGIC_LT);
+	logic(OP_LOGIC_LT, argc, argv);
 }
 
-static void greaterp(void)
+static void greaterp(int argc, SEXPR *argv)
 {
-	logic(OP_LOGIC_GT);
+	logic(OP_LOGIC_GT, argc, argv);
 }
 
-static void greater_eqp(void)
+static void greater_eqp(int argc, SEXPR *argv)
 {
-	logic(OP_LOGIC_GE);
+	logic(OP_LOGIC_GE, argc, argv);
 }
 
-static void less_eqp(void)
+static void less_eqp(int argc, SEXPR *argv)
 {
-	logic(OP_LOGIC_LE);
+	logic(OP_LOGIC_LE, argc, argv);
 }
 
-static void equal_numbersp(void)
+static void equal_numbersp(int argc, SEXPR *argv)
 {
-	logic(OP_LOGIC_EQUAL);
+	logic(OP_LOGIC_EQUAL, argc, argv);
 }
 
-static void plus(void)
+static void plus(int argc, SEXPR *argv)
 {
-	arith(0, OP_ARITH_ADD);
+	arith(0, OP_ARITH_ADD, argc, argv);
 }
 
-static void difference(void) 
+static void difference(int argc, SEXPR *argv) 
 {
-	arith(0, OP_ARITH_SUB);
+	arith(0, OP_ARITH_SUB, argc, argv);
 }
 
-static void times(void)
+static void times(int argc, SEXPR *argv)
 {
-	arith(1, OP_ARITH_MUL);
+	arith(1, OP_ARITH_MUL, argc, argv);
 }
 
-static void divide(void)
+static void divide(int argc, SEXPR *argv)
 {
-	arith(1, OP_ARITH_DIV);
+	arith(1, OP_ARITH_DIV, argc, argv);
 }
 
-static void car(void)
+static void car(int argc, SEXPR *argv)
 {
-	s_val = p_car(p_car(s_args));
+	s_val = p_car(argv[0]);
 }
 
-static void cdr(void)
+static void cdr(int argc, SEXPR *argv)
 {
-	s_val = p_cdr(p_car(s_args));
+	s_val = p_cdr(argv[0]);
 }
 
-static void setcar(void)
+/*
+ * (seal!): makes static what the global environment leads to, so gc does
+ * not go through it again. Returns the number of static cells.
+ */
+static void seal(int argc, SEXPR *argv)
 {
-	SEXPR p, q;
+	struct number n;
 
-	p = p_car(s_args);
-	q = p_car(p_cdr(s_args));
-	s_val = p_setcar(p, q); 
+	build_real_number(&n, seal_static());
+	s_val = make_number(&n);
 }
 
-static void setcdr(void)
+static void setcar(int argc, SEXPR *argv)
 {
-	SEXPR p, q;
+	if (p_pairp(argv[0]) && pair_frozen(argv[0])) {
+		throw_err("set-car! used on a frozen pair");
+	}
+	s_val = p_setcar(argv[0], argv[1]); 
+}
 
-	p = p_car(s_args);
-	q = p_car(p_cdr(s_args));
-	s_val = p_setcdr(p, q); 
+static void setcdr(int argc, SEXPR *argv)
+{
+	if (p_pairp(argv[0]) && pair_frozen(argv[0])) {
+		throw_err("set-cdr! used on a frozen pair");
+	}
+	s_val = p_setcdr(argv[0], argv[1]); 
 }
 
-static void symbolp(void)
+static void symbolp(int argc, SEXPR *argv)
 {
-	s_val = p_symbolp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_symbolp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void pairp(void)
+static void pairp(int argc, SEXPR *argv)
 {
-	s_val = p_pairp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_pairp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void numberp(void)
+static void numberp(int argc, SEXPR *argv)
 {
-	s_val = p_numberp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_numberp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void complexp(void)
+static void complexp(int argc, SEXPR *argv)
 {
-	s_val = p_complexp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_complexp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void realp(void)
+static void realp(int argc, SEXPR *argv)
 {
-	s_val = p_realp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_realp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void integerp(void)
+static void integerp(int argc, SEXPR *argv)
 {
-	s_val = p_integerp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_integerp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void exactp(void)
+static void exactp(int argc, SEXPR *argv)
 {
-	s_val = p_exactp(p_car(s_args)) ? SEXPR_TRUE : SEXPR_FALSE;
+	s_val = p_exactp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void eqp(void)
+static void eqp(int argc, SEXPR *argv)
 {
-	s_val = p_eqp(p_car(s_args), p_car(p_cdr(s_args))) ? SEXPR_TRUE
-							   : SEXPR_FALSE;
+	s_val = p_eqp(argv[0], argv[1]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void eqvp(void)
+static void eqvp(int argc, SEXPR *argv)
 {
-	s_val = p_eqvp(p_car(s_args), p_car(p_cdr(s_args))) ? SEXPR_TRUE
-							    : SEXPR_FALSE;
+	s_val = p_eqvp(argv[0], argv[1]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
-static void equalp(void)
+static void equalp(int argc, SEXPR *argv)
 {
-	s_val = p_equalp(p_car(s_args), p_car(p_cdr(s_args))) ? SEXPR_TRUE
-	                                                      : SEXPR_FALSE;
+	s_val = p_equalp(argv[0], argv[1]) ? SEXPR_TRUE : SEXPR_FALSE;
 }
 
 static void check_params(SEXPR params)
@@ -653,13 +1049,332 @@ static void check_params(SEXPR params)
 static void special(void)
 {
 	check_params(p_car(s_args));
+	if (!p_eqp(s_env, s_topenv)) {
+		s_captures++;
+	}
 	s_val = make_special(sexpr_index(p_cons(s_args, s_env)));
 }
 
 static void lambda(void)
 {
+	SEXPR env;
+
 	check_params(p_car(s_args));
-	s_val = make_function(sexpr_index(p_cons(s_args, s_env)));
+	if (p_eqp(s_env, s_topenv)) {
+		fold_procedure(p_car(s_args), p_cdr(s_args));
+	}
+	env = closure_environment(p_car(s_args), p_cdr(s_args));
+	s_val = make_function(sexpr_index(p_cons(s_args, env)));
+}
+
+/* Evaluates the body in s_unev: the last expression is left in s_val to be
+ * evaluated with tail recursion.
+ */
+static void tail_body(void)
+{
+	if (p_nullp(s_unev)) {
+		throw_err("empty body");
+	}
+	hoist_defines(s_unev);
+	p_evseq(0);
+	s_tailrec = 1;
+}
+
+static void begin(void)
+{
+	if (p_nullp(s_args)) {
+		s_val = SEXPR_NIL;
+		return;
+	}
+	s_unev = s_args;
+	p_evseq(0);
+	s_tailrec = 1;
+}
+
+static SEXPR binding_var(SEXPR b)
+{
+	SEXPR var;
+
+	var = p_pairp(b) ? p_car(b) : SEXPR_NIL;
+	if (!p_symbolp(var)) {
+		throw_err("bad syntax on binding");
+	}
+
+	return var;
+}
+
+/*
+ * Evaluates in *penv the init of each binding ((var init ...) ...) and
+ * pushes the values. Returns the number of values pushed.
+ */
+static int eval_inits(SEXPR bindings, SEXPR *penv)
+{
+	int n;
+
+	for (n = 0; p_pairp(bindings); n++) {
+		binding_var(p_car(bindings));
+		s_expr = p_car(p_cdr(p_car(bindings)));
+		s_env = *penv;
+		p_eval();
+		push(s_val);
+		bindings = p_cdr(bindings);
+	}
+	s_env = *penv;
+
+	return n;
+}
+
+/* Defines in s_env the var of each binding ((var ...) ...) with the values
+ * in argv.
+ */
+static void bind_vars(SEXPR bindings, SEXPR *argv)
+{
+	while (p_pairp(bindings)) {
+		s_expr = p_car(p_car(bindings));
+		s_val = *argv++;
+		define_variable();
+		bindings = p_cdr(bindings);
+	}
+}
+
+/*
+ * (let name ((var init) ...) body ...)
+ * The procedure name is defined on a new environment and applied to the
+ * values.
+ */
+static void named_let(void)
+{
+	SEXPR b, node, last, *pargs, *penv, *pvars;
+	int n;
+
+	push(s_args);
+	pargs = stack_top(1);
+	push(s_env);
+	penv = stack_top(1);
+	push(SEXPR_NIL);
+	pvars = stack_top(1);
+	last = SEXPR_NIL;
+	for (b = p_car(p_cdr(s_args)); p_pairp(b); b = p_cdr(b)) {
+		node = p_cons(binding_var(p_car(b)), SEXPR_NIL);
+		if (p_nullp(last)) {
+			*pvars = node;
+		} else {
+			p_setcdr(last, node);
+		}
+		last = node;
+	}
+
+	n = eval_inits(p_car(p_cdr(*pargs)), penv);
+
+	/* name is defined first so the procedure can refer to itself */
+	s_env = make_environment(*penv);
+	s_expr = p_car(*pargs);
+	s_val = SEXPR_NIL;
+	define_variable();
+	s_args = p_cons(*pvars, p_cdr(p_cdr(*pargs)));
+	lambda();
+	s_expr = p_car(*pargs);
+	define_variable();
+	s_proc = s_val;
+	p_apply(n);
+	popn(n + 3);
+}
+
+/* (let ((var init) ...) body ...) */
+static void let(void)
+{
+	SEXPR *pargs, *penv;
+	int n;
+
+	if (p_symbolp(p_car(s_args))) {
+		named_let();
+		return;
+	}
+
+	push(s_args);
+	pargs = stack_top(1);
+	push(s_env);
+	penv = stack_top(1);
+	n = eval_inits(p_car(s_args), penv);
+	s_env = make_environment(*penv);
+	bind_vars(p_car(*pargs), stack_top(n));
+	s_unev = p_cdr(*pargs);
+	popn(n + 2);
+	tail_body();
+}
+
+/*
+ * (let* ((var init) ...) body ...)
+ * The variables are defined one after the other on the same environment;
+ * a new one is made only if a variable is repeated.
+ */
+static void let_star(void)
+{
+	SEXPR b, var, *pargs, *penv;
+
+	push(s_args);
+	pargs = stack_top(1);
+	push(s_env);
+	penv = stack_top(1);
+	*penv = make_environment(*penv);
+	for (b = p_car(s_args); p_pairp(b); b = p_cdr(b)) {
+		var = binding_var(p_car(b));
+		if (!p_nullp(lookup_local_variable(var, *penv))) {
+			*penv = make_environment(*penv);
+		}
+		s_env = *penv;
+		s_expr = p_car(p_cdr(p_car(b)));
+		p_eval();
+		s_env = *penv;
+		s_expr = p_car(p_car(b));
+		define_variable();
+	}
+	s_env = *penv;
+	s_unev = p_cdr(*pargs);
+	popn(2);
+	tail_body();
+}
+
+/*
+ * (letrec ((var init) ...) body ...)
+ * The variables are defined first, so the inits can refer to them, and
+ * then set, in order, to the value of their init. This is also letrec*.
+ */
+static void letrec(void)
+{
+	SEXPR b, *pargs, *penv;
+
+	push(s_args);
+	pargs = stack_top(1);
+	push(s_env);
+	penv = stack_top(1);
+	*penv = s_env = make_environment(*penv);
+	for (b = p_car(s_args); p_pairp(b); b = p_cdr(b)) {
+		s_expr = binding_var(p_car(b));
+		s_val = SEXPR_NIL;
+		define_variable();
+	}
+	for (b = p_car(*pargs); p_pairp(b); b = p_cdr(b)) {
+		s_expr = p_car(p_cdr(p_car(b)));
+		p_eval();
+		s_env = *penv;
+		set_variable(p_car(p_car(b)), s_val, s_env);
+	}
+	s_unev = p_cdr(*pargs);
+	popn(2);
+	tail_body();
+}
+
+/*
+ * (do ((var init step) ...) (test expr ...) command ...)
+ * Each iteration binds the variables on a new environment, unless nothing
+ * can refer to the previous one: then it is used again.
+ */
+static void do_loop(void)
+{
+	SEXPR b, *pargs, *penv, *pframe;
+	int n, captures;
+
+	push(s_args);
+	pargs = stack_top(1);
+	push(s_env);
+	penv = stack_top(1);
+	push(SEXPR_NIL);
+	pframe = stack_top(1);
+	n = eval_inits(p_car(s_args), penv);
+	*pframe = s_env = make_environment(*penv);
+	captures = s_captures;
+	bind_vars(p_car(*pargs), stack_top(n));
+	popn(n);
+
+	for (;;) {
+		s_expr = p_car(p_car(p_cdr(*pargs)));
+		p_eval();
+		if (!p_eqp(s_val, SEXPR_FALSE)) {
+			break;
+		}
+
+		s_env = *pframe;
+		s_unev = p_cdr(p_cdr(*pargs));
+		p_evseq(1);
+
+		n = 0;
+		for (b = p_car(*pargs); p_pairp(b); b = p_cdr(b)) {
+			s_env = *pframe;
+			if (p_pairp(p_cdr(p_cdr(p_car(b))))) {
+				s_expr = p_car(p_cdr(p_cdr(p_car(b))));
+				p_eval();
+				push(s_val);
+			} else {
+				push(p_cdr(lookup_local_variable(p_car(p_car(b)),
+								 s_env)));
+			}
+			n++;
+		}
+		if (captures == s_captures) {
+			s_env = *pframe;
+		} else {
+			*pframe = s_env = make_environment(*penv);
+			captures = s_captures;
+		}
+		bind_vars(p_car(*pargs), stack_top(n));
+		popn(n);
+	}
+
+	s_env = *pframe;
+	s_unev = p_cdr(p_car(p_cdr(*pargs)));
+	popn(3);
+	if (p_nullp(s_unev)) {
+		s_val = SEXPR_NIL;
+		return;
+	}
+	tail_body();
+}
+
+/* (load-extension "file.so") */
+static void load_extension_special(void)
+{
+	load_extension(p_car(s_args));
+	s_val = SEXPR_TRUE;
+}
+
+/* (foreign-procedure "lib.so" "name" (double ...) double) */
+static void foreign_procedure_special(void)
+{
+	SEXPR lib, name, argtypes, rettype;
+
+	lib = p_car(s_args);
+	s_args = p_cdr(s_args);
+	name = p_car(s_args);
+	s_args = p_cdr(s_args);
+	argtypes = p_car(s_args);
+	rettype = p_car(p_cdr(s_args));
+	s_val = foreign_procedure(lib, name, argtypes, rettype);
+}
+
+static void syntax_expand_fn(int argc, SEXPR *argv)
+{
+	s_val = syntax_expand(argv[0], argv[1]);
+}
+
+/*
+ * (syntax-rules (literal ...) (pattern template) ...) makes the special
+ * (special %form (%syntax-expand '((literal ...) rule ...) %form)).
+ */
+static void syntax_rules(void)
+{
+	SEXPR e;
+
+	e = push(make_symbol("%form", 5));
+	push(p_cons(e, SEXPR_NIL));
+	e = p_cons(s_args, SEXPR_NIL);
+	e = p_cons(s_quote_atom, e);
+	e = push(p_cons(e, pop()));
+	e = p_cons(make_symbol("%syntax-expand", 14), e);
+	pop();
+	e = p_cons(e, SEXPR_NIL);
+	e = p_cons(pop(), e);
+	s_val = make_special(sexpr_index(p_cons(e, s_topenv)));
 }
 
 static void body(void)
@@ -688,16 +1403,23 @@ static void body(void)
 	}
 }
 
+/* Makes a promise to evaluate expr on s_env. */
+static SEXPR make_delayed(SEXPR expr)
+{
+	SEXPR env;
+
+	env = closure_environment(SEXPR_NIL, expr);
+	return make_promise(sexpr_index(p_cons(expr, env)));
+}
+
 static void delay(void)
 {
-	s_args = p_cons(SEXPR_NIL, s_args);
-	lambda();
+	s_val = make_delayed(p_car(s_args));
 }
 
+/* (cons-stream a b) is (cons a (delay b)). */
 static void cons_stream(void)
 {
-	SEXPR thecdr;
-
 	push(s_args);
 	push(s_env);
 	s_expr = p_car(s_args);
@@ -705,27 +1427,74 @@ static void cons_stream(void)
 	s_env = pop();
 	s_args = pop();
 	push(s_val);
-	s_args = p_cdr(s_args);
-	delay();
-	thecdr = s_val;
-	s_val = pop();
-	s_val = p_cons(s_val, thecdr); 
+	s_val = make_delayed(p_car(p_cdr(s_args)));
+	s_val = p_cons(pop(), s_val);
 }
 
-static void eval(void)
+static void force(int argc, SEXPR *argv)
 {
-	s_val = p_car(s_args);
+	s_val = p_force(argv[0]);
+}
+
+static void make_promise_fn(int argc, SEXPR *argv)
+{
+	if (p_promisep(argv[0])) {
+		s_val = argv[0];
+	} else {
+		s_val = make_promise(sexpr_index(p_cons(argv[0], SEXPR_TRUE)));
+	}
+}
+
+static void promisep(int argc, SEXPR *argv)
+{
+	s_val = p_promisep(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+static void stream_car(int argc, SEXPR *argv)
+{
+	s_val = p_car(argv[0]);
+}
+
+static void stream_cdr(int argc, SEXPR *argv)
+{
+	s_val = p_force(p_cdr(argv[0]));
+}
+
+static void eval(int argc, SEXPR *argv)
+{
+	s_val = argv[0];
 	s_tailrec = 1;
 }
 
-static void apply(void)
+/* The arguments on the list are pushed to be applied as if they had been
+ * evaluated; specials receive the list itself.
+ */
+static void apply(int argc, SEXPR *argv)
 {
-	s_proc = p_car(s_args);
-	s_args = p_car(p_cdr(s_args));
-	p_apply(); 
+	SEXPR p;
+	int t;
+
+	s_proc = argv[0];
+	p = argv[1];
+	t = sexpr_type(s_proc);
+	if (t == SEXPR_BUILTIN_SPECIAL || t == SEXPR_SPECIAL) {
+		s_args = p;
+		p_apply(0);
+		return;
+	}
+
+	for (argc = 0; p_pairp(p); argc++) {
+		push(p_car(p));
+		p = p_cdr(p);
+	}
+	if (!p_nullp(p)) {
+		throw_err("apply needs a list of arguments");
+	}
+	p_apply(argc);
+	popn(argc);
 }
 
-static void gc(void)
+static void gc(int argc, SEXPR *argv)
 {
 	p_gc();
 	s_val = SEXPR_NIL;
@@ -747,6 +1516,7 @@ int main(int argc, char* argv[])
 	install_builtin_specials();
 
 	load_init_file();
+	seal_static();
 
 	/* REPL */
 	for (;;) {
@@ -0,0 +1,77 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+/*
+ * C API for extensions loaded with (load-extension "file.so").
+ *
+ * An extension is a shared object that exports the function
+ *
+ *     int lispe_extension_init(const struct lispe_api *api);
+ *
+ * which is called once when it is loaded. It registers its procedures with
+ * api->define_builtin() and returns 0, or returns any other value to signal
+ * failure. The api pointer is valid while the program runs.
+ *
+ * The procedures of an extension receive their evaluated arguments in argv,
+ * already checked against the number of arguments declared, and return
+ * their value.
+ *
+ * The interpreter can collect garbage when api->cons() or api->make_real()
+ * are called. The arguments in argv are protected, but any other value an
+ * extension wants to keep meanwhile must be protected with api->protect(),
+ * and released in reverse order with api->unprotect().
+ *
+ * api->error() does not return.
+ *
+ * Only this header is needed to compile an extension; the interpreter
+ * functions are reached through the api structure, so no symbol needs to be
+ * exported from the executable.
+ */
+
+#ifndef LISPE_EXT_H
+#define LISPE_EXT_H
+
+enum { LISPE_API_VERSION = 1 };
+
+typedef int lispe_sexpr;
+
+typedef lispe_sexpr (*lispe_fun)(int argc, lispe_sexpr *argv);
+
+enum { LISPE_ANYARGS = -1 };
+
+struct lispe_api {
+	int version;
+
+	lispe_sexpr nil;
+	lispe_sexpr true_value;
+	lispe_sexpr false_value;
+
+	void (*define_builtin)(const char *name, lispe_fun fun,
+			       int minargs, int maxargs);
+
+	int (*nullp)(lispe_sexpr e);
+	int (*pairp)(lispe_sexpr e);
+	int (*symbolp)(lispe_sexpr e);
+	int (*numberp)(lispe_sexpr e);
+	int (*realp)(lispe_sexpr e);
+
+	lispe_sexpr (*cons)(lispe_sexpr first, lispe_sexpr rest);
+	lispe_sexpr (*car)(lispe_sexpr e);
+	lispe_sexpr (*cdr)(lispe_sexpr e);
+	lispe_sexpr (*setcar)(lispe_sexpr e, lispe_sexpr val);
+	lispe_sexpr (*setcdr)(lispe_sexpr e, lispe_sexpr val);
+
+	lispe_sexpr (*make_real)(double d);
+	double (*real_value)(lispe_sexpr e);
+
+	lispe_sexpr (*protect)(lispe_sexpr e);
+	lispe_sexpr (*unprotect)(void);
+
+	void (*error)(const char *msg);
+};
+
+int lispe_extension_init(const struct lispe_api *api);
+
+#endif
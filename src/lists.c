@@ -0,0 +1,628 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+
+/*
+ * The list library: builtin functions that walk lists with C loops.
+ * They are in the builtin_functions table of lispe.c.
+ *
+ * The lists built here are made from the head, which is kept on the stack
+ * while the rest is consed.
+ */
+
+/* Returns the number of pairs of the proper list p, or -1 if p is not a
+ * proper list (it is circular or does not end in ()).
+ */
+static int list_length(SEXPR p)
+{
+	SEXPR slow;
+	int n;
+
+	slow = p;
+	for (n = 0; p_pairp(p); n++) {
+		p = p_cdr(p);
+		if (n & 1) {
+			slow = p_cdr(slow);
+			if (p_eqp(p, slow)) {
+				return -1;
+			}
+		}
+	}
+
+	return p_nullp(p) ? n : -1;
+}
+
+static int index_arg(SEXPR e)
+{
+	struct number *n;
+
+	if (!p_numberp(e)) {
+		throw_err("bad index for list: not a number");
+	}
+	n = sexpr_number(e);
+	if (!number_integer(n) || number_real_value(n) < 0) {
+		throw_err("bad index for list: not a positive integer");
+	}
+
+	return (int) number_real_value(n);
+}
+
+/*
+ * Copies the elements of p to the list being built, whose head is in *phead
+ * and its last pair in *plast, both protected from gc. Returns what
+ * ends p: () if it is a proper list.
+ */
+static SEXPR copy_to_list(SEXPR p, SEXPR *phead, SEXPR *plast)
+{
+	SEXPR node;
+
+	while (p_pairp(p)) {
+		push(p);
+		node = p_cons(p_car(p), SEXPR_NIL);
+		p = pop();
+		if (p_nullp(*phead)) {
+			*phead = node;
+		} else {
+			p_setcdr(*plast, node);
+		}
+		*plast = node;
+		p = p_cdr(p);
+	}
+
+	return p;
+}
+
+void length(int argc, SEXPR *argv)
+{
+	struct number n;
+	int len;
+
+	len = list_length(argv[0]);
+	if (len < 0) {
+		throw_err("length used with something that is not a list");
+	}
+
+	build_real_number(&n, len);
+	s_val = make_number(&n);
+}
+
+void reverse(int argc, SEXPR *argv)
+{
+	SEXPR p;
+
+	push(SEXPR_NIL);
+	for (p = argv[0]; p_pairp(p); p = p_cdr(p)) {
+		*stack_top(1) = p_cons(p_car(p), *stack_top(1));
+	}
+	if (!p_nullp(p)) {
+		throw_err("reverse used with something that is not a list");
+	}
+	s_val = pop();
+}
+
+/* (append list ... obj): the lists are copied and obj is shared. */
+void append(int argc, SEXPR *argv)
+{
+	SEXPR *phead, *plast;
+	int i;
+
+	if (argc == 0) {
+		s_val = SEXPR_NIL;
+		return;
+	}
+
+	push2(SEXPR_NIL, SEXPR_NIL);
+	phead = stack_top(2);
+	plast = phead + 1;
+	for (i = 0; i < argc - 1; i++) {
+		if (!p_nullp(copy_to_list(argv[i], phead, plast))) {
+			throw_err("append used with something that is not a "
+				  "list");
+		}
+	}
+
+	if (p_nullp(*phead)) {
+		s_val = argv[argc - 1];
+	} else {
+		p_setcdr(*plast, argv[argc - 1]);
+		s_val = *phead;
+	}
+	popn(2);
+}
+
+void list_tail(int argc, SEXPR *argv)
+{
+	SEXPR p;
+	int k;
+
+	p = argv[0];
+	for (k = index_arg(argv[1]); k > 0; k--) {
+		p = p_cdr(p);
+	}
+	s_val = p;
+}
+
+void list_ref(int argc, SEXPR *argv)
+{
+	list_tail(argc, argv);
+	s_val = p_car(s_val);
+}
+
+/* The pairs of the list are copied; an improper end is shared. */
+void list_copy(int argc, SEXPR *argv)
+{
+	SEXPR *phead, *plast, end;
+
+	push2(SEXPR_NIL, SEXPR_NIL);
+	phead = stack_top(2);
+	plast = phead + 1;
+	end = copy_to_list(argv[0], phead, plast);
+	if (p_nullp(*phead)) {
+		s_val = end;
+	} else {
+		p_setcdr(*plast, end);
+		s_val = *phead;
+	}
+	popn(2);
+}
+
+void listp(int argc, SEXPR *argv)
+{
+	s_val = (list_length(argv[0]) >= 0) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+/*********************************************************
+ * Searching.
+ *********************************************************/
+
+enum { CMP_EQ, CMP_EQV, CMP_EQUAL, CMP_PROC };
+
+/* Compares x and y as eq?, eqv?, equal? or with the procedure proc. */
+static int compare(int cmp, SEXPR x, SEXPR y, SEXPR proc)
+{
+	switch (cmp) {
+	case CMP_EQ:
+		return p_eqp(x, y);
+	case CMP_EQV:
+		return p_eqvp(x, y);
+	case CMP_EQUAL:
+		return p_equalp(x, y);
+	}
+
+	push2(x, y);
+	s_proc = proc;
+	p_call(2);
+	popn(2);
+	return !p_eqp(s_val, SEXPR_FALSE);
+}
+
+/* Returns the first pair of p whose car is x, or #f. */
+static SEXPR mem(int cmp, SEXPR x, SEXPR p, SEXPR proc)
+{
+	for (; p_pairp(p); p = p_cdr(p)) {
+		if (compare(cmp, x, p_car(p), proc)) {
+			return p;
+		}
+	}
+
+	return SEXPR_FALSE;
+}
+
+/* Returns the first element of p whose car is x, or #f. */
+static SEXPR ass(int cmp, SEXPR x, SEXPR p, SEXPR proc)
+{
+	for (; p_pairp(p); p = p_cdr(p)) {
+		if (!p_pairp(p_car(p))) {
+			throw_err("association list with an element that is "
+				  "not a pair");
+		}
+		if (compare(cmp, x, p_car(p_car(p)), proc)) {
+			return p_car(p);
+		}
+	}
+
+	return SEXPR_FALSE;
+}
+
+void memq(int argc, SEXPR *argv)
+{
+	s_val = mem(CMP_EQ, argv[0], argv[1], SEXPR_NIL);
+}
+
+void memv(int argc, SEXPR *argv)
+{
+	s_val = mem(CMP_EQV, argv[0], argv[1], SEXPR_NIL);
+}
+
+/* (member x list [compare]) */
+void member(int argc, SEXPR *argv)
+{
+	if (argc == 3) {
+		s_val = mem(CMP_PROC, argv[0], argv[1], argv[2]);
+	} else {
+		s_val = mem(CMP_EQUAL, argv[0], argv[1], SEXPR_NIL);
+	}
+}
+
+void assq(int argc, SEXPR *argv)
+{
+	s_val = ass(CMP_EQ, argv[0], argv[1], SEXPR_NIL);
+}
+
+void assv(int argc, SEXPR *argv)
+{
+	s_val = ass(CMP_EQV, argv[0], argv[1], SEXPR_NIL);
+}
+
+/* (assoc x alist [compare]) */
+void assoc(int argc, SEXPR *argv)
+{
+	if (argc == 3) {
+		s_val = ass(CMP_PROC, argv[0], argv[1], argv[2]);
+	} else {
+		s_val = ass(CMP_EQUAL, argv[0], argv[1], SEXPR_NIL);
+	}
+}
+
+/*********************************************************
+ * max and min return the argument chosen, as it is.
+ *********************************************************/
+
+static void extreme(int op, int argc, SEXPR *argv)
+{
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (!p_numberp(argv[i])) {
+			throw_err("bad argument for max or min: not a number");
+		}
+	}
+
+	s_val = argv[0];
+	for (i = 1; i < argc; i++) {
+		if (!apply_logic_op(op, sexpr_number(s_val),
+				    sexpr_number(argv[i])))
+		{
+			s_val = argv[i];
+		}
+	}
+}
+
+void maximum(int argc, SEXPR *argv)
+{
+	extreme(OP_LOGIC_GT, argc, argv);
+}
+
+void minimum(int argc, SEXPR *argv)
+{
+	extreme(OP_LOGIC_LT, argc, argv);
+}
+
+/*********************************************************
+ * Higher order procedures.
+ * The lists given are walked in step, until the shortest ends; argv is
+ * used for the rest of each list. For each step the elements are pushed
+ * and the procedure is called with p_call().
+ *********************************************************/
+
+/* Pushes the cars of the lists in argv and moves argv to their cdrs.
+ * Returns 0, pushing nothing, if one of the lists has ended.
+ */
+static int push_cars(int nlists, SEXPR *argv)
+{
+	int i;
+
+	for (i = 0; i < nlists; i++) {
+		if (!p_pairp(argv[i])) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < nlists; i++) {
+		push(p_car(argv[i]));
+		argv[i] = p_cdr(argv[i]);
+	}
+
+	return 1;
+}
+
+/* Adds e at the end of the list whose head is *phead and last pair *plast. */
+static void add_to_list(SEXPR e, SEXPR *phead, SEXPR *plast)
+{
+	SEXPR node;
+
+	node = p_cons(e, SEXPR_NIL);
+	if (p_nullp(*phead)) {
+		*phead = node;
+	} else {
+		p_setcdr(*plast, node);
+	}
+	*plast = node;
+}
+
+/* (map proc list ...) */
+void map(int argc, SEXPR *argv)
+{
+	SEXPR *phead, *plast;
+	int nlists;
+
+	nlists = argc - 1;
+	push2(SEXPR_NIL, SEXPR_NIL);
+	phead = stack_top(2);
+	plast = phead + 1;
+	while (push_cars(nlists, argv + 1)) {
+		s_proc = argv[0];
+		p_call(nlists);
+		popn(nlists);
+		add_to_list(s_val, phead, plast);
+	}
+
+	s_val = *phead;
+	popn(2);
+}
+
+/* (for-each proc list ...) */
+void for_each(int argc, SEXPR *argv)
+{
+	int nlists;
+
+	nlists = argc - 1;
+	while (push_cars(nlists, argv + 1)) {
+		s_proc = argv[0];
+		p_call(nlists);
+		popn(nlists);
+	}
+
+	s_val = SEXPR_NIL;
+}
+
+/* (filter pred list) */
+void filter(int argc, SEXPR *argv)
+{
+	SEXPR *phead, *plast, e;
+
+	push2(SEXPR_NIL, SEXPR_NIL);
+	phead = stack_top(2);
+	plast = phead + 1;
+	while (push_cars(1, argv + 1)) {
+		s_proc = argv[0];
+		p_call(1);
+		e = pop();
+		if (!p_eqp(s_val, SEXPR_FALSE)) {
+			add_to_list(e, phead, plast);
+		}
+	}
+
+	s_val = *phead;
+	popn(2);
+}
+
+/* (fold-left proc init list ...): (proc (proc init e1 ...) e2 ...) ... */
+void fold_left(int argc, SEXPR *argv)
+{
+	int nlists;
+
+	nlists = argc - 2;
+	for (;;) {
+		push(argv[1]);
+		if (!push_cars(nlists, argv + 2)) {
+			pop();
+			break;
+		}
+		s_proc = argv[0];
+		argv[1] = p_call(nlists + 1);
+		popn(nlists + 1);
+	}
+
+	s_val = argv[1];
+}
+
+/*
+ * (fold-right proc init list ...): (proc e1 ... (proc en ... init)).
+ * The lists are reversed first, up to the length of the shortest one.
+ */
+void fold_right(int argc, SEXPR *argv)
+{
+	SEXPR *prev, p;
+	int nlists, len, n, i;
+
+	nlists = argc - 2;
+	len = -1;
+	for (i = 2; i < argc; i++) {
+		n = 0;
+		for (p = argv[i]; p_pairp(p) && n != len; p = p_cdr(p)) {
+			n++;
+		}
+		len = n;
+	}
+
+	for (i = 0; i < nlists; i++) {
+		push(SEXPR_NIL);
+	}
+	prev = stack_top(nlists);
+	for (i = 0; i < nlists; i++) {
+		p = argv[i + 2];
+		for (n = 0; n < len; n++) {
+			prev[i] = p_cons(p_car(p), prev[i]);
+			p = p_cdr(p);
+		}
+	}
+
+	while (push_cars(nlists, prev)) {
+		push(argv[1]);
+		s_proc = argv[0];
+		argv[1] = p_call(nlists + 1);
+		popn(nlists + 1);
+	}
+	popn(nlists);
+
+	s_val = argv[1];
+}
+
+/*********************************************************
+ * Sorting.
+ * A stable merge sort that relinks the pairs of the list. The comparison
+ * procedure less? is called as (less? x y), true if x goes before y.
+ *********************************************************/
+
+enum {
+	/* A bin k holds a sorted list of 2^k elements; this is enough for
+	 * any list that fits on the cells. */
+	NSORTBINS = 32
+};
+
+static int lessp(SEXPR less, SEXPR x, SEXPR y)
+{
+	int op;
+
+	/* number comparisons are made here, without calling them */
+	if (sexpr_type(less) == SEXPR_BUILTIN_FUNCTION &&
+	    (op = builtin_compare_op(sexpr_index(less))) >= 0 &&
+	    p_numberp(x) && p_numberp(y))
+	{
+		return apply_logic_op(op, sexpr_number(x), sexpr_number(y));
+	}
+
+	push2(x, y);
+	s_proc = less;
+	p_call(2);
+	popn(2);
+	return !p_eqp(s_val, SEXPR_FALSE);
+}
+
+/*
+ * Merges the sorted lists a and b relinking their pairs, and returns the
+ * result. On equal elements those of a go first.
+ */
+static SEXPR merge_lists(SEXPR a, SEXPR b, SEXPR less)
+{
+	SEXPR node, *p;
+
+	push2(a, b);
+	push2(SEXPR_NIL, SEXPR_NIL);
+	/* a, b, head and last pair of the result */
+	p = stack_top(4);
+	while (p_pairp(p[0]) && p_pairp(p[1])) {
+		if (lessp(less, p_car(p[1]), p_car(p[0]))) {
+			node = p[1];
+			p[1] = p_cdr(node);
+		} else {
+			node = p[0];
+			p[0] = p_cdr(node);
+		}
+		if (p_nullp(p[2])) {
+			p[2] = node;
+		} else {
+			p_setcdr(p[3], node);
+		}
+		p[3] = node;
+	}
+
+	node = p_pairp(p[0]) ? p[0] : p[1];
+	if (p_nullp(p[2])) {
+		p[2] = node;
+	} else {
+		p_setcdr(p[3], node);
+	}
+	node = p[2];
+	popn(4);
+
+	return node;
+}
+
+/* Sorts the list p relinking its pairs and returns the result. */
+static SEXPR sort_list(SEXPR p, SEXPR less)
+{
+	SEXPR *bins, *prest, *pcarry, result;
+	int i;
+
+	if (list_length(p) < 0) {
+		throw_err("sort used with something that is not a list");
+	}
+
+	for (i = 0; i < NSORTBINS + 2; i++) {
+		push(SEXPR_NIL);
+	}
+	bins = stack_top(NSORTBINS + 2);
+	prest = bins + NSORTBINS;
+	pcarry = prest + 1;
+
+	*prest = p;
+	while (p_pairp(*prest)) {
+		*pcarry = *prest;
+		*prest = p_cdr(*prest);
+		p_setcdr(*pcarry, SEXPR_NIL);
+		for (i = 0; !p_nullp(bins[i]); i++) {
+			*pcarry = merge_lists(bins[i], *pcarry, less);
+			bins[i] = SEXPR_NIL;
+		}
+		bins[i] = *pcarry;
+	}
+
+	/* the higher bins have the elements that came first */
+	*pcarry = SEXPR_NIL;
+	for (i = 0; i < NSORTBINS; i++) {
+		if (!p_nullp(bins[i])) {
+			*pcarry = merge_lists(bins[i], *pcarry, less);
+		}
+	}
+	result = *pcarry;
+	popn(NSORTBINS + 2);
+
+	return result;
+}
+
+/* Returns a copy of the list p. */
+static SEXPR copy_list(SEXPR p)
+{
+	SEXPR *phead, *plast;
+
+	push2(SEXPR_NIL, SEXPR_NIL);
+	phead = stack_top(2);
+	plast = phead + 1;
+	if (!p_nullp(copy_to_list(p, phead, plast))) {
+		throw_err("sort used with something that is not a list");
+	}
+	p = *phead;
+	popn(2);
+
+	return p;
+}
+
+/* (sort list less?) */
+void sort(int argc, SEXPR *argv)
+{
+	argv[0] = copy_list(argv[0]);
+	s_val = sort_list(argv[0], argv[1]);
+}
+
+/* (sort! list less?) */
+void sort_in_place(int argc, SEXPR *argv)
+{
+	s_val = sort_list(argv[0], argv[1]);
+}
+
+/* (list-sort less? list) */
+void list_sort(int argc, SEXPR *argv)
+{
+	argv[1] = copy_list(argv[1]);
+	s_val = sort_list(argv[1], argv[0]);
+}
+
+/* (merge list1 list2 less?) */
+void merge(int argc, SEXPR *argv)
+{
+	argv[0] = copy_list(argv[0]);
+	argv[1] = copy_list(argv[1]);
+	s_val = merge_lists(argv[0], argv[1], argv[2]);
+}
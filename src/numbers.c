@@ -30,6 +30,9 @@ enum { N_NUM_MARKS = (N_NUMBERS / 32) + ((N_NUMBERS % 32) ? 1 : 0) };
 
 static unsigned int s_num_marks[N_NUM_MARKS];
 
+/* the numbers made static: their marks are never cleared */
+static unsigned int s_num_static[N_NUM_MARKS];
+
 #ifdef DEBUG_NUMBERS
 #define dprintf(...) printf(__VA_ARGS__) 
 #else
@@ -65,6 +68,9 @@ int install_number(struct number *n)
 	i = pop_free_slot();
 	// dprintf("installed %f in %d\n", n, i);
 	copy_number(n, &s_numbers[i].n);
+	if (s_in_region) {
+		region_alloc_number(i);
+	}
 	return i;
 }
 
@@ -80,7 +86,27 @@ void mark_number(int i)
 	s_num_marks[w] |= (1 << i);
 }
 
-static int number_marked(int i)
+void make_number_static(int i)
+{
+	int w;
+
+	chkrange(i, N_NUMBERS);
+	w = i >> 5;
+	chkrange(w, N_NUM_MARKS);
+	i &= 31;
+	s_num_static[w] |= (1 << i);
+	s_num_marks[w] |= (1 << i);
+}
+
+/* Puts number i back on the free list: nothing must refer to it. */
+void free_number(int i)
+{
+	chkrange(i, N_NUMBERS);
+	s_numbers[i].next = s_free_nodes.next;
+	s_free_nodes.next = i;
+}
+
+int number_marked(int i)
 {
 	int w;
 
@@ -108,7 +134,7 @@ void gc_numbers(void)
 		}
 	}
 
-	memset(s_num_marks, 0, sizeof(s_num_marks));
+	memcpy(s_num_marks, s_num_static, sizeof(s_num_marks));
 	printf("[gc: %d/%d numbers]\n", nmarked, N_NUMBERS);
 }
 
@@ -425,7 +451,23 @@ int number_real(struct number *n)
 	return 1;
 }
 
+/* True if n is kept as a real, not as a complex with no imaginary part. */
+int number_flonum(struct number *n)
+{
+	return number_type(n) == NUM_REAL;
+}
+
 int number_complex(struct number *n)
 {
 	return 1;
 }
+
+/* Returns the real part of a number. */
+real_t number_real_value(struct number *n)
+{
+	if (number_type(n) == NUM_COMPLEX) {
+		return creal(n->val.vcomplex);
+	}
+
+	return n->val.vreal;
+}
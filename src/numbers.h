@@ -50,11 +50,16 @@ void copy_number(struct number *src, struct number *dst);
 int exact_number(struct number *n);
 int number_integer(struct number *n);
 int number_real(struct number *n);
+int number_flonum(struct number *n);
 int number_complex(struct number *n);
+real_t number_real_value(struct number *n);
 
 int install_number(struct number *n);
 struct number *get_number(int i);
 void mark_number(int i);
+int number_marked(int i);
+void free_number(int i);
+void make_number_static(int i);
 void gc_numbers(void);
 void init_numbers(void);
 
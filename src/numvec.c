@@ -0,0 +1,914 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Numeric vectors, as in SRFI-4: f64vectors hold doubles and s64vectors
+ * 64 bit integers, unboxed, in the blocks of vectors.c.
+ *
+ * The bulk operations (add!, scale!, dot, sum, min, max and map! with +,
+ * -, * or /) run a kernel on the whole block. The f64 kernels are chosen
+ * the first time they are needed: AVX or SSE2 ones if the cpu has them,
+ * else plain C loops. s64 elements are read back as reals, so they are
+ * exact up to 2^53; their arithmetic wraps around.
+ */
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define NUMVEC_SIMD
+#include <immintrin.h>
+#define TARGET_AVX __attribute__((target("avx")))
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#endif
+
+struct f64_kernels {
+	/* x[i] = x[i] op y[i], op being SITE_ADD to SITE_DIV */
+	void (*op_vector)(int op, double *x, const double *y, int n);
+	/* x[i] = x[i] op k */
+	void (*op_scalar)(int op, double *x, double k, int n);
+	double (*dot)(const double *x, const double *y, int n);
+	double (*sum)(const double *x, int n);
+	/* n > 0 */
+	double (*min)(const double *x, int n);
+	double (*max)(const double *x, int n);
+};
+
+/************************************************************/
+/* scalar kernels                                           */
+/************************************************************/
+
+static void c_op_vector(int op, double *x, const double *y, int n)
+{
+	int i;
+
+	switch (op) {
+	case SITE_ADD: for (i = 0; i < n; i++) x[i] += y[i]; break;
+	case SITE_SUB: for (i = 0; i < n; i++) x[i] -= y[i]; break;
+	case SITE_MUL: for (i = 0; i < n; i++) x[i] *= y[i]; break;
+	default: for (i = 0; i < n; i++) x[i] /= y[i]; break;
+	}
+}
+
+static void c_op_scalar(int op, double *x, double k, int n)
+{
+	int i;
+
+	switch (op) {
+	case SITE_ADD: for (i = 0; i < n; i++) x[i] += k; break;
+	case SITE_SUB: for (i = 0; i < n; i++) x[i] -= k; break;
+	case SITE_MUL: for (i = 0; i < n; i++) x[i] *= k; break;
+	default: for (i = 0; i < n; i++) x[i] /= k; break;
+	}
+}
+
+static double c_dot(const double *x, const double *y, int n)
+{
+	double r;
+	int i;
+
+	r = 0;
+	for (i = 0; i < n; i++) {
+		r += x[i] * y[i];
+	}
+
+	return r;
+}
+
+static double c_sum(const double *x, int n)
+{
+	double r;
+	int i;
+
+	r = 0;
+	for (i = 0; i < n; i++) {
+		r += x[i];
+	}
+
+	return r;
+}
+
+static double c_min(const double *x, int n)
+{
+	double r;
+	int i;
+
+	r = x[0];
+	for (i = 1; i < n; i++) {
+		if (x[i] < r) {
+			r = x[i];
+		}
+	}
+
+	return r;
+}
+
+static double c_max(const double *x, int n)
+{
+	double r;
+	int i;
+
+	r = x[0];
+	for (i = 1; i < n; i++) {
+		if (x[i] > r) {
+			r = x[i];
+		}
+	}
+
+	return r;
+}
+
+static const struct f64_kernels s_c_kernels = {
+	c_op_vector, c_op_scalar, c_dot, c_sum, c_min, c_max
+};
+
+#ifdef NUMVEC_SIMD
+
+/************************************************************/
+/* SSE2 kernels: 2 doubles at a time                        */
+/************************************************************/
+
+static TARGET_SSE2 __m128d sse2_op(int op, __m128d a, __m128d b)
+{
+	switch (op) {
+	case SITE_ADD: return _mm_add_pd(a, b);
+	case SITE_SUB: return _mm_sub_pd(a, b);
+	case SITE_MUL: return _mm_mul_pd(a, b);
+	default: return _mm_div_pd(a, b);
+	}
+}
+
+static TARGET_SSE2 double sse2_hsum(__m128d a)
+{
+	double d[2];
+
+	_mm_storeu_pd(d, a);
+	return d[0] + d[1];
+}
+
+static TARGET_SSE2 void sse2_op_vector(int op, double *x, const double *y,
+				       int n)
+{
+	int i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		_mm_storeu_pd(x + i, sse2_op(op, _mm_loadu_pd(x + i),
+					     _mm_loadu_pd(y + i)));
+	}
+	c_op_vector(op, x + i, y + i, n - i);
+}
+
+static TARGET_SSE2 void sse2_op_scalar(int op, double *x, double k, int n)
+{
+	__m128d vk;
+	int i;
+
+	vk = _mm_set1_pd(k);
+	for (i = 0; i + 2 <= n; i += 2) {
+		_mm_storeu_pd(x + i, sse2_op(op, _mm_loadu_pd(x + i), vk));
+	}
+	c_op_scalar(op, x + i, k, n - i);
+}
+
+static TARGET_SSE2 double sse2_dot(const double *x, const double *y, int n)
+{
+	__m128d acc;
+	int i;
+
+	acc = _mm_setzero_pd();
+	for (i = 0; i + 2 <= n; i += 2) {
+		acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(x + i),
+						 _mm_loadu_pd(y + i)));
+	}
+
+	return sse2_hsum(acc) + c_dot(x + i, y + i, n - i);
+}
+
+static TARGET_SSE2 double sse2_sum(const double *x, int n)
+{
+	__m128d acc;
+	int i;
+
+	acc = _mm_setzero_pd();
+	for (i = 0; i + 2 <= n; i += 2) {
+		acc = _mm_add_pd(acc, _mm_loadu_pd(x + i));
+	}
+
+	return sse2_hsum(acc) + c_sum(x + i, n - i);
+}
+
+static TARGET_SSE2 double sse2_min(const double *x, int n)
+{
+	__m128d acc;
+	double d[2];
+	int i;
+
+	if (n < 4) {
+		return c_min(x, n);
+	}
+	acc = _mm_loadu_pd(x);
+	for (i = 2; i + 2 <= n; i += 2) {
+		acc = _mm_min_pd(acc, _mm_loadu_pd(x + i));
+	}
+	_mm_storeu_pd(d, acc);
+	d[0] = (d[1] < d[0]) ? d[1] : d[0];
+
+	return (i < n && x[i] < d[0]) ? x[i] : d[0];
+}
+
+static TARGET_SSE2 double sse2_max(const double *x, int n)
+{
+	__m128d acc;
+	double d[2];
+	int i;
+
+	if (n < 4) {
+		return c_max(x, n);
+	}
+	acc = _mm_loadu_pd(x);
+	for (i = 2; i + 2 <= n; i += 2) {
+		acc = _mm_max_pd(acc, _mm_loadu_pd(x + i));
+	}
+	_mm_storeu_pd(d, acc);
+	d[0] = (d[1] > d[0]) ? d[1] : d[0];
+
+	return (i < n && x[i] > d[0]) ? x[i] : d[0];
+}
+
+static const struct f64_kernels s_sse2_kernels = {
+	sse2_op_vector, sse2_op_scalar, sse2_dot, sse2_sum, sse2_min, sse2_max
+};
+
+/************************************************************/
+/* AVX kernels: 4 doubles at a time                         */
+/************************************************************/
+
+static TARGET_AVX __m256d avx_op(int op, __m256d a, __m256d b)
+{
+	switch (op) {
+	case SITE_ADD: return _mm256_add_pd(a, b);
+	case SITE_SUB: return _mm256_sub_pd(a, b);
+	case SITE_MUL: return _mm256_mul_pd(a, b);
+	default: return _mm256_div_pd(a, b);
+	}
+}
+
+static TARGET_AVX double avx_hsum(__m256d a)
+{
+	double d[4];
+
+	_mm256_storeu_pd(d, a);
+	return (d[0] + d[1]) + (d[2] + d[3]);
+}
+
+static TARGET_AVX void avx_op_vector(int op, double *x, const double *y,
+				     int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(x + i, avx_op(op, _mm256_loadu_pd(x + i),
+					       _mm256_loadu_pd(y + i)));
+	}
+	c_op_vector(op, x + i, y + i, n - i);
+}
+
+static TARGET_AVX void avx_op_scalar(int op, double *x, double k, int n)
+{
+	__m256d vk;
+	int i;
+
+	vk = _mm256_set1_pd(k);
+	for (i = 0; i + 4 <= n; i += 4) {
+		_mm256_storeu_pd(x + i, avx_op(op, _mm256_loadu_pd(x + i), vk));
+	}
+	c_op_scalar(op, x + i, k, n - i);
+}
+
+static TARGET_AVX double avx_dot(const double *x, const double *y, int n)
+{
+	__m256d acc0, acc1;
+	int i;
+
+	/* two accumulators to hide the latency of the adds */
+	acc0 = _mm256_setzero_pd();
+	acc1 = _mm256_setzero_pd();
+	for (i = 0; i + 8 <= n; i += 8) {
+		acc0 = _mm256_add_pd(acc0,
+				     _mm256_mul_pd(_mm256_loadu_pd(x + i),
+						   _mm256_loadu_pd(y + i)));
+		acc1 = _mm256_add_pd(acc1,
+				     _mm256_mul_pd(_mm256_loadu_pd(x + i + 4),
+						   _mm256_loadu_pd(y + i + 4)));
+	}
+
+	return avx_hsum(_mm256_add_pd(acc0, acc1)) +
+		c_dot(x + i, y + i, n - i);
+}
+
+static TARGET_AVX double avx_sum(const double *x, int n)
+{
+	__m256d acc0, acc1;
+	int i;
+
+	acc0 = _mm256_setzero_pd();
+	acc1 = _mm256_setzero_pd();
+	for (i = 0; i + 8 <= n; i += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+		acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+	}
+
+	return avx_hsum(_mm256_add_pd(acc0, acc1)) + c_sum(x + i, n - i);
+}
+
+static TARGET_AVX double avx_min(const double *x, int n)
+{
+	__m256d acc;
+	double d[4], r;
+	int i;
+
+	if (n < 8) {
+		return c_min(x, n);
+	}
+	acc = _mm256_loadu_pd(x);
+	for (i = 4; i + 4 <= n; i += 4) {
+		acc = _mm256_min_pd(acc, _mm256_loadu_pd(x + i));
+	}
+	_mm256_storeu_pd(d, acc);
+	r = c_min(d, 4);
+	for (; i < n; i++) {
+		if (x[i] < r) {
+			r = x[i];
+		}
+	}
+
+	return r;
+}
+
+static TARGET_AVX double avx_max(const double *x, int n)
+{
+	__m256d acc;
+	double d[4], r;
+	int i;
+
+	if (n < 8) {
+		return c_max(x, n);
+	}
+	acc = _mm256_loadu_pd(x);
+	for (i = 4; i + 4 <= n; i += 4) {
+		acc = _mm256_max_pd(acc, _mm256_loadu_pd(x + i));
+	}
+	_mm256_storeu_pd(d, acc);
+	r = c_max(d, 4);
+	for (; i < n; i++) {
+		if (x[i] > r) {
+			r = x[i];
+		}
+	}
+
+	return r;
+}
+
+static const struct f64_kernels s_avx_kernels = {
+	avx_op_vector, avx_op_scalar, avx_dot, avx_sum, avx_min, avx_max
+};
+
+#endif
+
+static const struct f64_kernels *s_f64;
+
+/* Returns the best f64 kernels for this cpu. */
+static const struct f64_kernels *f64_kernels(void)
+{
+	if (s_f64 != NULL) {
+		return s_f64;
+	}
+
+	s_f64 = &s_c_kernels;
+#ifdef NUMVEC_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) {
+		s_f64 = &s_avx_kernels;
+	} else if (__builtin_cpu_supports("sse2")) {
+		s_f64 = &s_sse2_kernels;
+	}
+#endif
+
+	return s_f64;
+}
+
+/* The s64 kernels are plain loops, that wrap around on overflow. */
+
+static void s64_op_vector(int op, int64_t *x, const int64_t *y, int n)
+{
+	uint64_t *ux;
+	const uint64_t *uy;
+	int i;
+
+	ux = (uint64_t *) x;
+	uy = (const uint64_t *) y;
+	switch (op) {
+	case SITE_ADD: for (i = 0; i < n; i++) ux[i] += uy[i]; break;
+	case SITE_SUB: for (i = 0; i < n; i++) ux[i] -= uy[i]; break;
+	default: for (i = 0; i < n; i++) ux[i] *= uy[i]; break;
+	}
+}
+
+static void s64_op_scalar(int op, int64_t *x, int64_t k, int n)
+{
+	uint64_t *ux;
+	uint64_t uk;
+	int i;
+
+	ux = (uint64_t *) x;
+	uk = (uint64_t) k;
+	switch (op) {
+	case SITE_ADD: for (i = 0; i < n; i++) ux[i] += uk; break;
+	case SITE_SUB: for (i = 0; i < n; i++) ux[i] -= uk; break;
+	default: for (i = 0; i < n; i++) ux[i] *= uk; break;
+	}
+}
+
+static int64_t s64_dot(const int64_t *x, const int64_t *y, int n)
+{
+	uint64_t r;
+	int i;
+
+	r = 0;
+	for (i = 0; i < n; i++) {
+		r += (uint64_t) x[i] * (uint64_t) y[i];
+	}
+
+	return (int64_t) r;
+}
+
+/************************************************************/
+/* elements                                                 */
+/************************************************************/
+
+static int elem_size(int kind)
+{
+	return (kind == VECTOR_F64) ? sizeof(double) : sizeof(int64_t);
+}
+
+static const char *kind_name(int kind)
+{
+	return (kind == VECTOR_F64) ? "f64" : "s64";
+}
+
+static int is_kind(int kind, SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_VECTOR && vector_kind(e) == kind;
+}
+
+static SEXPR kind_arg(int kind, SEXPR e)
+{
+	if (!is_kind(kind, e)) {
+		throw_err((kind == VECTOR_F64) ?
+			  "f64vector procedure used on something not a f64vector" :
+			  "s64vector procedure used on something not a s64vector");
+	}
+
+	return e;
+}
+
+/* Returns e as an element of a vector of kind. */
+static double f64_value(SEXPR e)
+{
+	if (!p_realp(e)) {
+		throw_err("f64vector element is not a real");
+	}
+
+	return number_real_value(sexpr_number(e));
+}
+
+static int64_t s64_value(SEXPR e)
+{
+	if (!p_numberp(e) || !exact_number(sexpr_number(e))) {
+		throw_err("s64vector element is not an exact integer");
+	}
+
+	return (int64_t) number_real_value(sexpr_number(e));
+}
+
+static SEXPR get_elem(SEXPR v, int i)
+{
+	struct number n;
+
+	if (vector_kind(v) == VECTOR_F64) {
+		build_real_number(&n, ((double *) vector_data(v))[i]);
+	} else {
+		build_real_number(&n, (real_t) ((int64_t *) vector_data(v))[i]);
+	}
+
+	return make_number(&n);
+}
+
+static void set_elem(SEXPR v, int i, SEXPR e)
+{
+	if (vector_kind(v) == VECTOR_F64) {
+		((double *) vector_data(v))[i] = f64_value(e);
+	} else {
+		((int64_t *) vector_data(v))[i] = s64_value(e);
+	}
+}
+
+/* Returns a new vector of kind with the numbers of the proper list p. */
+SEXPR make_number_vector_from_list(int kind, SEXPR p)
+{
+	SEXPR q, v;
+	int n, i;
+
+	n = 0;
+	for (q = p; p_pairp(q); q = p_cdr(q)) {
+		n++;
+	}
+	if (!p_nullp(q)) {
+		throw_err("vector made from something that is not a list");
+	}
+
+	push(p);
+	v = make_vector_of_kind(kind, n, elem_size(kind));
+	p = pop();
+
+	for (i = 0; i < n; i++) {
+		set_elem(v, i, p_car(p));
+		p = p_cdr(p);
+	}
+
+	return v;
+}
+
+/* Prints the numeric vector v as #f64(...) or #s64(...). */
+void print_number_vector(SEXPR v)
+{
+	struct number n;
+	int i;
+
+	printf("#%s(", kind_name(vector_kind(v)));
+	for (i = 0; i < vector_size(v); i++) {
+		if (i > 0) {
+			printf(" ");
+		}
+		if (vector_kind(v) == VECTOR_F64) {
+			build_real_number(&n, ((double *) vector_data(v))[i]);
+		} else {
+			build_real_number(&n,
+				(real_t) ((int64_t *) vector_data(v))[i]);
+		}
+		print_number(&n);
+	}
+	printf(")");
+}
+
+/* Returns 1 if the numeric vectors x and y, of the same kind and length,
+ * have = elements.
+ */
+int number_vectors_equalp(SEXPR x, SEXPR y)
+{
+	double *fx, *fy;
+	int64_t *sx, *sy;
+	int i;
+
+	if (vector_kind(x) == VECTOR_F64) {
+		fx = vector_data(x);
+		fy = vector_data(y);
+		for (i = 0; i < vector_size(x); i++) {
+			if (fx[i] != fy[i]) {
+				return 0;
+			}
+		}
+	} else {
+		sx = vector_data(x);
+		sy = vector_data(y);
+		for (i = 0; i < vector_size(x); i++) {
+			if (sx[i] != sy[i]) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/************************************************************/
+/* builtin functions, for each kind                         */
+/************************************************************/
+
+static void nv_make(int kind, int argc, SEXPR *argv)
+{
+	struct number *pn;
+	SEXPR v;
+	int i, n;
+
+	if (!p_numberp(argv[0])) {
+		throw_err("bad length for vector: not a number");
+	}
+	pn = sexpr_number(argv[0]);
+	if (!number_integer(pn) || number_real_value(pn) < 0 ||
+	    number_real_value(pn) > INDEX_MASK_SEXPR)
+	{
+		throw_err("bad length for vector");
+	}
+
+	n = (int) number_real_value(pn);
+	v = make_vector_of_kind(kind, n, elem_size(kind));
+	if (kind == VECTOR_F64) {
+		for (i = 0; i < n; i++) {
+			((double *) vector_data(v))[i] =
+				(argc > 1) ? f64_value(argv[1]) : 0;
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			((int64_t *) vector_data(v))[i] =
+				(argc > 1) ? s64_value(argv[1]) : 0;
+		}
+	}
+	s_val = v;
+}
+
+static void nv_vector(int kind, int argc, SEXPR *argv)
+{
+	SEXPR v;
+	int i;
+
+	v = make_vector_of_kind(kind, argc, elem_size(kind));
+	for (i = 0; i < argc; i++) {
+		set_elem(v, i, argv[i]);
+	}
+	s_val = v;
+}
+
+static void nv_pred(int kind, int argc, SEXPR *argv)
+{
+	s_val = is_kind(kind, argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+static void nv_length(int kind, int argc, SEXPR *argv)
+{
+	struct number n;
+
+	build_real_number(&n, vector_size(kind_arg(kind, argv[0])));
+	s_val = make_number(&n);
+}
+
+static void nv_ref(int kind, int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	v = kind_arg(kind, argv[0]);
+	s_val = get_elem(v, vector_index_arg(argv[1], vector_size(v), 0));
+}
+
+static void nv_set(int kind, int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	v = kind_arg(kind, argv[0]);
+	set_elem(v, vector_index_arg(argv[1], vector_size(v), 0), argv[2]);
+	s_val = argv[2];
+}
+
+static void nv_to_list(int kind, int argc, SEXPR *argv)
+{
+	SEXPR v;
+	int i;
+
+	v = kind_arg(kind, argv[0]);
+	s_val = SEXPR_NIL;
+	for (i = vector_size(v) - 1; i >= 0; i--) {
+		push(s_val);
+		s_val = get_elem(v, i);
+		s_val = p_cons(s_val, pop());
+	}
+}
+
+static void nv_from_list(int kind, int argc, SEXPR *argv)
+{
+	s_val = make_number_vector_from_list(kind, argv[0]);
+}
+
+/* Returns the length of x, checking that y has the same. */
+static int same_length(SEXPR x, SEXPR y)
+{
+	if (vector_size(x) != vector_size(y)) {
+		throw_err("vectors of different length");
+	}
+
+	return vector_size(x);
+}
+
+/* x[i] = x[i] op y, y being a vector of kind or a number. */
+static void nv_op(int kind, int op, SEXPR x, SEXPR y)
+{
+	int n;
+
+	if (kind == VECTOR_F64) {
+		if (is_kind(kind, y)) {
+			n = same_length(x, y);
+			f64_kernels()->op_vector(op, vector_data(x),
+						 vector_data(y), n);
+		} else {
+			f64_kernels()->op_scalar(op, vector_data(x),
+						 f64_value(y), vector_size(x));
+		}
+	} else {
+		if (is_kind(kind, y)) {
+			n = same_length(x, y);
+			s64_op_vector(op, vector_data(x), vector_data(y), n);
+		} else {
+			s64_op_scalar(op, vector_data(x), s64_value(y),
+				      vector_size(x));
+		}
+	}
+}
+
+/* (add! x y): x[i] += y[i] */
+static void nv_add(int kind, int argc, SEXPR *argv)
+{
+	kind_arg(kind, argv[0]);
+	nv_op(kind, SITE_ADD, argv[0], kind_arg(kind, argv[1]));
+	s_val = argv[0];
+}
+
+/* (scale! x k): x[i] *= k */
+static void nv_scale(int kind, int argc, SEXPR *argv)
+{
+	if (!p_numberp(argv[1])) {
+		throw_err("scale!: the factor is not a number");
+	}
+	nv_op(kind, SITE_MUL, kind_arg(kind, argv[0]), argv[1]);
+	s_val = argv[0];
+}
+
+static void return_real(real_t r)
+{
+	struct number n;
+
+	build_real_number(&n, r);
+	s_val = make_number(&n);
+}
+
+static void nv_dot(int kind, int argc, SEXPR *argv)
+{
+	int n;
+
+	n = same_length(kind_arg(kind, argv[0]), kind_arg(kind, argv[1]));
+	if (kind == VECTOR_F64) {
+		return_real(f64_kernels()->dot(vector_data(argv[0]),
+					       vector_data(argv[1]), n));
+	} else {
+		return_real((real_t) s64_dot(vector_data(argv[0]),
+					     vector_data(argv[1]), n));
+	}
+}
+
+static void nv_sum(int kind, int argc, SEXPR *argv)
+{
+	int64_t *s;
+	uint64_t r;
+	int i, n;
+
+	n = vector_size(kind_arg(kind, argv[0]));
+	if (kind == VECTOR_F64) {
+		return_real(f64_kernels()->sum(vector_data(argv[0]), n));
+	} else {
+		s = vector_data(argv[0]);
+		r = 0;
+		for (i = 0; i < n; i++) {
+			r += (uint64_t) s[i];
+		}
+		return_real((real_t) (int64_t) r);
+	}
+}
+
+/* The min (op SITE_LT) or max (SITE_GT) of the elements. */
+static void nv_extreme(int kind, int op, int argc, SEXPR *argv)
+{
+	int64_t *s, r;
+	int i, n;
+
+	n = vector_size(kind_arg(kind, argv[0]));
+	if (n == 0) {
+		throw_err("min or max of an empty vector");
+	}
+
+	if (kind == VECTOR_F64) {
+		return_real((op == SITE_LT) ?
+			f64_kernels()->min(vector_data(argv[0]), n) :
+			f64_kernels()->max(vector_data(argv[0]), n));
+		return;
+	}
+
+	s = vector_data(argv[0]);
+	r = s[0];
+	for (i = 1; i < n; i++) {
+		if ((op == SITE_LT) ? s[i] < r : s[i] > r) {
+			r = s[i];
+		}
+	}
+	return_real((real_t) r);
+}
+
+static void nv_min(int kind, int argc, SEXPR *argv)
+{
+	nv_extreme(kind, SITE_LT, argc, argv);
+}
+
+static void nv_max(int kind, int argc, SEXPR *argv)
+{
+	nv_extreme(kind, SITE_GT, argc, argv);
+}
+
+/*
+ * (map! proc x [y]): x[i] = (proc x[i] y[i]), y being a vector of the
+ * same kind or a number used for every i. If proc is the builtin +, -, *
+ * or / a kernel does it; any other procedure is called for each element.
+ */
+static void nv_map(int kind, int argc, SEXPR *argv)
+{
+	SEXPR proc, x, y;
+	int i, n, op;
+
+	proc = argv[0];
+	x = kind_arg(kind, argv[1]);
+	y = (argc > 2) ? argv[2] : SEXPR_NIL;
+	n = vector_size(x);
+	if (is_kind(kind, y)) {
+		same_length(x, y);
+	} else if (argc > 2 && !p_numberp(y)) {
+		throw_err("map!: the operand is not a number or a vector");
+	}
+
+	op = (sexpr_type(proc) == SEXPR_BUILTIN_FUNCTION) ?
+		builtin_site_op(sexpr_index(proc)) : -1;
+	if (argc > 2 && op >= SITE_ADD &&
+	    op <= ((kind == VECTOR_F64) ? SITE_DIV : SITE_MUL))
+	{
+		nv_op(kind, op, x, y);
+		s_val = x;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		push(get_elem(x, i));
+		if (argc > 2) {
+			push(is_kind(kind, y) ? get_elem(y, i) : y);
+		}
+		s_proc = proc;
+		p_call(argc - 1);
+		popn(argc - 1);
+		set_elem(x, i, s_val);
+	}
+	s_val = x;
+}
+
+#define NUMVEC_BUILTIN(name, fun, kind) \
+	void name(int argc, SEXPR *argv) { fun(kind, argc, argv); }
+
+NUMVEC_BUILTIN(make_f64vector, nv_make, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector, nv_vector, VECTOR_F64)
+NUMVEC_BUILTIN(f64vectorp, nv_pred, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_length, nv_length, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_ref, nv_ref, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_set, nv_set, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_to_list, nv_to_list, VECTOR_F64)
+NUMVEC_BUILTIN(list_to_f64vector, nv_from_list, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_add, nv_add, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_scale, nv_scale, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_dot, nv_dot, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_sum, nv_sum, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_min, nv_min, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_max, nv_max, VECTOR_F64)
+NUMVEC_BUILTIN(f64vector_map, nv_map, VECTOR_F64)
+
+NUMVEC_BUILTIN(make_s64vector, nv_make, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector, nv_vector, VECTOR_S64)
+NUMVEC_BUILTIN(s64vectorp, nv_pred, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_length, nv_length, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_ref, nv_ref, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_set, nv_set, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_to_list, nv_to_list, VECTOR_S64)
+NUMVEC_BUILTIN(list_to_s64vector, nv_from_list, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_add, nv_add, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_scale, nv_scale, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_dot, nv_dot, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_sum, nv_sum, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_min, nv_min, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_max, nv_max, VECTOR_S64)
+NUMVEC_BUILTIN(s64vector_map, nv_map, VECTOR_S64)
@@ -175,7 +175,7 @@ static SEXPR parse_sexpr(struct parser *p, int *errorc)
 {
 	struct number n;
 	struct token *tok;
-	int closetok;
+	int closetok, vector_tok_kind;
 	SEXPR sexpr;
 
 	tok = peek_token(p->tokenizer);
@@ -201,6 +201,34 @@ static SEXPR parse_sexpr(struct parser *p, int *errorc)
 	} else if (tok->type == '\'') {
 		pop_token(p->tokenizer);
 		return parse_quote(p, errorc);
+	} else if (tok->type == T_VECTOR) {
+		if (tok->value.atom.name[1] == '\0') {
+			vector_tok_kind = VECTOR_GENERAL;
+		} else if (tok->value.atom.name[1] == 'f') {
+			vector_tok_kind = VECTOR_F64;
+		} else {
+			vector_tok_kind = VECTOR_S64;
+		}
+		p->sp++;
+		pop_token(p->tokenizer);
+		sexpr = parse_list(p, ')', errorc);
+		if (*errorc != ERRORC_OK) {
+			goto error;
+		}
+		tok = peek_token(p->tokenizer);
+		if (tok->type != ')') {
+			goto error;
+		}
+		p->sp--;
+		push(sexpr);
+		if (vector_tok_kind == VECTOR_GENERAL) {
+			sexpr = make_vector_from_list(sexpr);
+		} else {
+			sexpr = make_number_vector_from_list(vector_tok_kind,
+							     sexpr);
+		}
+		pop();
+		return pop_n_ret(p, sexpr);
 	} else if (tok->type == '(' || tok->type == '[') {
 		closetok = (tok->type == '(') ? ')' : ']';
 		p->sp++;
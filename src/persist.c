@@ -0,0 +1,1133 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Persistent maps and vectors.
+ *
+ * They are immutable: an update returns a new map or vector that shares
+ * with the old one all but the path to what changed, so lookups and
+ * updates are O(log32 n).
+ *
+ * A map is a hash array mapped trie (in the CHAMP layout): each node has
+ * a bitmap of the 32 slots of its level that hold an entry and another of
+ * those that hold a child node; entries and children are kept packed.
+ * Keys whose 32 bits of hash are all the same end in a collision node,
+ * searched linearly.
+ *
+ * A vector is a radix balanced trie of nodes of 32 elements plus a tail
+ * node, where the elements are pushed until it is full and put in the
+ * trie.
+ *
+ * Maps, vectors and their nodes are vectors of vectors.c, of kinds of
+ * their own. Their first slots hold raw integers (bitmaps, counts) that
+ * gc does not mark (see persistent_raw_slots()).
+ *
+ * A transient is a map or vector that can be updated in place, to build
+ * one fast: it has an edit number, and the nodes it makes carry it, so
+ * they can be changed again without copying them. persistent! makes it
+ * persistent again, and those nodes are not changed anymore.
+ *
+ * The nodes are made with alloc_vector_of_kind(), that never runs gc, so
+ * the nodes being built need no protection; each builtin checks if gc is
+ * needed when it starts, with its arguments safe on the stack.
+ */
+
+enum { BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1 };
+
+/* the slots of a map */
+enum { MAP_COUNT, MAP_EQUIV, MAP_EDIT, MAP_ROOT, MAP_SIZE };
+/* the slots of a map node, followed by the entries and the children */
+enum { NODE_DATAMAP, NODE_NODEMAP, NODE_EDIT, NODE_ENTRIES };
+/* the slots of a collision node, followed by the entries */
+enum { COLL_EDIT, COLL_ENTRIES };
+/* the slots of a vector */
+enum { VEC_COUNT, VEC_SHIFT, VEC_EDIT, VEC_ROOT, VEC_TAIL, VEC_SIZE };
+/* the slots of a vector node, followed by WIDTH elements or children */
+enum { LEAF_EDIT, LEAF_ENTRIES, LEAF_SIZE = LEAF_ENTRIES + WIDTH };
+
+/* the edit number of the last transient made; 0 is for persistent */
+static int s_last_edit;
+
+/* what the procedures taking a map or vector accept */
+enum { PERSISTENT, TRANSIENT, EITHER };
+
+/*
+ * Returns the number of slots at the start of a vector of kind that are
+ * not SEXPRs.
+ */
+int persistent_raw_slots(int kind)
+{
+	switch (kind) {
+	case VECTOR_PMAP:
+		return MAP_ROOT;
+	case VECTOR_PMAP_NODE:
+		return NODE_ENTRIES;
+	case VECTOR_PMAP_COLLISION:
+		return COLL_ENTRIES;
+	case VECTOR_PVEC:
+		return VEC_ROOT;
+	default:
+		return LEAF_ENTRIES;
+	}
+}
+
+static SEXPR *slots(SEXPR v)
+{
+	return vector_data(v);
+}
+
+static int edit_slot(int kind)
+{
+	switch (kind) {
+	case VECTOR_PMAP: return MAP_EDIT;
+	case VECTOR_PMAP_NODE: return NODE_EDIT;
+	case VECTOR_PMAP_COLLISION: return COLL_EDIT;
+	case VECTOR_PVEC: return VEC_EDIT;
+	default: return LEAF_EDIT;
+	}
+}
+
+/* Returns a new node of kind with n slots, all () or 0, for edit. */
+static SEXPR new_node(int kind, int n, int edit)
+{
+	SEXPR v;
+
+	v = alloc_vector_of_kind(kind, n, sizeof(SEXPR));
+	memset(slots(v), 0, n * sizeof(SEXPR));
+	slots(v)[edit_slot(kind)] = edit;
+	return v;
+}
+
+/* Returns node, if it was made for edit, or a copy of it for edit. */
+static SEXPR editable(SEXPR node, int edit)
+{
+	SEXPR v;
+	int kind, n;
+
+	kind = vector_kind(node);
+	if (edit != 0 && slots(node)[edit_slot(kind)] == edit) {
+		return node;
+	}
+
+	n = vector_size(node);
+	v = alloc_vector_of_kind(kind, n, sizeof(SEXPR));
+	memcpy(slots(v), slots(node), n * sizeof(SEXPR));
+	slots(v)[edit_slot(kind)] = edit;
+	return v;
+}
+
+static int popcount(unsigned int x)
+{
+	x = x - ((x >> 1) & 0x55555555u);
+	x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+	x = (x + (x >> 4)) & 0x0f0f0f0fu;
+	return (int) ((x * 0x01010101u) >> 24);
+}
+
+static SEXPR number_sexpr(int i)
+{
+	struct number n;
+
+	build_real_number(&n, i);
+	return make_number(&n);
+}
+
+static int is_kind(int kind, SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_VECTOR && vector_kind(e) == kind;
+}
+
+/************************************************************/
+/* maps                                                     */
+/************************************************************/
+
+static unsigned int bitpos(unsigned int hash, int shift)
+{
+	return 1u << ((hash >> shift) & MASK);
+}
+
+static unsigned int datamap(SEXPR node)
+{
+	return (unsigned int) slots(node)[NODE_DATAMAP];
+}
+
+static unsigned int nodemap(SEXPR node)
+{
+	return (unsigned int) slots(node)[NODE_NODEMAP];
+}
+
+/* The index of the slot of the entry at bit, and of the child at bit. */
+static int data_slot(SEXPR node, unsigned int bit)
+{
+	return NODE_ENTRIES + 2 * popcount(datamap(node) & (bit - 1));
+}
+
+static int child_slot(SEXPR node, unsigned int bit)
+{
+	return NODE_ENTRIES + 2 * popcount(datamap(node)) +
+		popcount(nodemap(node) & (bit - 1));
+}
+
+/* Returns a new map node with room for what the bitmaps say. */
+static SEXPR new_map_node(unsigned int dmap, unsigned int nmap, int edit)
+{
+	SEXPR node;
+
+	node = new_node(VECTOR_PMAP_NODE,
+			NODE_ENTRIES + 2 * popcount(dmap) + popcount(nmap),
+			edit);
+	slots(node)[NODE_DATAMAP] = (SEXPR) dmap;
+	slots(node)[NODE_NODEMAP] = (SEXPR) nmap;
+	return node;
+}
+
+/*
+ * Returns a copy of node with the bitmaps dmap and nmap, and the nins
+ * slots of ins in place of its ndel slots at from.
+ */
+static SEXPR splice(SEXPR node, unsigned int dmap, unsigned int nmap,
+		    int from, int ndel, const SEXPR *ins, int nins, int edit)
+{
+	SEXPR r, *s, *rs;
+	int n;
+
+	r = new_map_node(dmap, nmap, edit);
+	s = slots(node);
+	rs = slots(r);
+	n = vector_size(node);
+	memcpy(rs + NODE_ENTRIES, s + NODE_ENTRIES,
+	       (from - NODE_ENTRIES) * sizeof(SEXPR));
+	memcpy(rs + from, ins, nins * sizeof(SEXPR));
+	memcpy(rs + from + nins, s + from + ndel,
+	       (n - from - ndel) * sizeof(SEXPR));
+	return r;
+}
+
+/* Returns the slot of the value of key in the map node, or NULL. */
+static SEXPR *map_find(int equiv, SEXPR node, SEXPR key)
+{
+	SEXPR *s;
+	unsigned int hash, bit;
+	int shift, i, n;
+
+	hash = hash_equiv(equiv, key);
+	for (shift = 0; ; shift += BITS) {
+		s = slots(node);
+		if (vector_kind(node) == VECTOR_PMAP_COLLISION) {
+			n = vector_size(node);
+			for (i = COLL_ENTRIES; i < n; i += 2) {
+				if (same_equiv(equiv, s[i], key)) {
+					return &s[i + 1];
+				}
+			}
+			return NULL;
+		}
+
+		bit = bitpos(hash, shift);
+		if (datamap(node) & bit) {
+			i = data_slot(node, bit);
+			return same_equiv(equiv, s[i], key) ? &s[i + 1] : NULL;
+		} else if (nodemap(node) & bit) {
+			node = s[child_slot(node, bit)];
+		} else {
+			return NULL;
+		}
+	}
+}
+
+/* Returns a node with the two entries, whose keys differ, from shift. */
+static SEXPR merge_entries(SEXPR k1, SEXPR v1, unsigned int h1,
+			   SEXPR k2, SEXPR v2, unsigned int h2,
+			   int shift, int edit)
+{
+	SEXPR node, *s;
+	unsigned int b1, b2;
+
+	if (shift >= 32) {
+		node = new_node(VECTOR_PMAP_COLLISION, COLL_ENTRIES + 4, edit);
+		s = slots(node);
+		s[COLL_ENTRIES] = k1;
+		s[COLL_ENTRIES + 1] = v1;
+		s[COLL_ENTRIES + 2] = k2;
+		s[COLL_ENTRIES + 3] = v2;
+		return node;
+	}
+
+	b1 = bitpos(h1, shift);
+	b2 = bitpos(h2, shift);
+	if (b1 == b2) {
+		node = new_map_node(0, b1, edit);
+		slots(node)[NODE_ENTRIES] = merge_entries(k1, v1, h1,
+							  k2, v2, h2,
+							  shift + BITS, edit);
+		return node;
+	}
+
+	node = new_map_node(b1 | b2, 0, edit);
+	s = slots(node);
+	if (b1 > b2) {
+		s[NODE_ENTRIES] = k2;
+		s[NODE_ENTRIES + 1] = v2;
+		s[NODE_ENTRIES + 2] = k1;
+		s[NODE_ENTRIES + 3] = v1;
+	} else {
+		s[NODE_ENTRIES] = k1;
+		s[NODE_ENTRIES + 1] = v1;
+		s[NODE_ENTRIES + 2] = k2;
+		s[NODE_ENTRIES + 3] = v2;
+	}
+	return node;
+}
+
+/*
+ * Returns node with key set to val. Sets *padded if key was not there.
+ * Returns node itself if nothing changed.
+ */
+static SEXPR map_assoc(int equiv, SEXPR node, int shift, unsigned int hash,
+		       SEXPR key, SEXPR val, int edit, int *padded)
+{
+	SEXPR r, sub, *s, ins[2];
+	unsigned int bit;
+	int i, n;
+
+	s = slots(node);
+	if (vector_kind(node) == VECTOR_PMAP_COLLISION) {
+		n = vector_size(node);
+		for (i = COLL_ENTRIES; i < n; i += 2) {
+			if (same_equiv(equiv, s[i], key)) {
+				if (p_eqp(s[i + 1], val)) {
+					return node;
+				}
+				r = editable(node, edit);
+				slots(r)[i + 1] = val;
+				return r;
+			}
+		}
+		*padded = 1;
+		r = new_node(VECTOR_PMAP_COLLISION, n + 2, edit);
+		memcpy(slots(r) + COLL_ENTRIES, s + COLL_ENTRIES,
+		       (n - COLL_ENTRIES) * sizeof(SEXPR));
+		slots(r)[n] = key;
+		slots(r)[n + 1] = val;
+		return r;
+	}
+
+	bit = bitpos(hash, shift);
+	if (datamap(node) & bit) {
+		i = data_slot(node, bit);
+		if (same_equiv(equiv, s[i], key)) {
+			if (p_eqp(s[i + 1], val)) {
+				return node;
+			}
+			r = editable(node, edit);
+			slots(r)[i + 1] = val;
+			return r;
+		}
+		/* the entry goes down with the new one in a child */
+		*padded = 1;
+		sub = merge_entries(s[i], s[i + 1], hash_equiv(equiv, s[i]),
+				    key, val, hash, shift + BITS, edit);
+		r = new_map_node(datamap(node) & ~bit, nodemap(node) | bit,
+				 edit);
+		n = vector_size(node);
+		memcpy(slots(r) + NODE_ENTRIES, s + NODE_ENTRIES,
+		       (i - NODE_ENTRIES) * sizeof(SEXPR));
+		memcpy(slots(r) + i, s + i + 2,
+		       (child_slot(node, bit) - i - 2) * sizeof(SEXPR));
+		slots(r)[child_slot(r, bit)] = sub;
+		memcpy(slots(r) + child_slot(r, bit) + 1,
+		       s + child_slot(node, bit),
+		       (n - child_slot(node, bit)) * sizeof(SEXPR));
+		return r;
+	} else if (nodemap(node) & bit) {
+		i = child_slot(node, bit);
+		sub = map_assoc(equiv, s[i], shift + BITS, hash, key, val,
+				edit, padded);
+		if (p_eqp(sub, s[i])) {
+			return node;
+		}
+		r = editable(node, edit);
+		slots(r)[i] = sub;
+		return r;
+	}
+
+	*padded = 1;
+	ins[0] = key;
+	ins[1] = val;
+	return splice(node, datamap(node) | bit, nodemap(node),
+		      data_slot(node, bit), 0, ins, 2, edit);
+}
+
+/* Returns 1 if node holds a single entry, and no children. */
+static int single_entry(SEXPR node)
+{
+	if (vector_kind(node) == VECTOR_PMAP_COLLISION) {
+		return vector_size(node) == COLL_ENTRIES + 2;
+	}
+
+	return nodemap(node) == 0 && popcount(datamap(node)) == 1;
+}
+
+/* The key and value of a node that holds a single entry. */
+static SEXPR *single_entry_slots(SEXPR node)
+{
+	return slots(node) + ((vector_kind(node) == VECTOR_PMAP_COLLISION) ?
+			      COLL_ENTRIES : NODE_ENTRIES);
+}
+
+/*
+ * Returns node without key. Sets *premoved if it was there. Returns node
+ * itself if nothing changed.
+ */
+static SEXPR map_dissoc(int equiv, SEXPR node, int shift, unsigned int hash,
+			SEXPR key, int edit, int *premoved)
+{
+	SEXPR r, sub, *s;
+	unsigned int bit;
+	int i, n, k;
+
+	s = slots(node);
+	if (vector_kind(node) == VECTOR_PMAP_COLLISION) {
+		n = vector_size(node);
+		for (i = COLL_ENTRIES; i < n; i += 2) {
+			if (same_equiv(equiv, s[i], key)) {
+				*premoved = 1;
+				r = new_node(VECTOR_PMAP_COLLISION, n - 2, edit);
+				memcpy(slots(r) + COLL_ENTRIES, s + COLL_ENTRIES,
+				       (i - COLL_ENTRIES) * sizeof(SEXPR));
+				memcpy(slots(r) + i, s + i + 2,
+				       (n - i - 2) * sizeof(SEXPR));
+				return r;
+			}
+		}
+		return node;
+	}
+
+	bit = bitpos(hash, shift);
+	if (datamap(node) & bit) {
+		i = data_slot(node, bit);
+		if (!same_equiv(equiv, s[i], key)) {
+			return node;
+		}
+		*premoved = 1;
+		return splice(node, datamap(node) & ~bit, nodemap(node),
+			      i, 2, NULL, 0, edit);
+	} else if (!(nodemap(node) & bit)) {
+		return node;
+	}
+
+	i = child_slot(node, bit);
+	sub = map_dissoc(equiv, s[i], shift + BITS, hash, key, edit,
+			 premoved);
+	if (p_eqp(sub, s[i])) {
+		return node;
+	}
+	if (!single_entry(sub)) {
+		r = editable(node, edit);
+		slots(r)[i] = sub;
+		return r;
+	}
+
+	/* the child left has one entry: it comes up to this node */
+	r = new_map_node(datamap(node) | bit, nodemap(node) & ~bit, edit);
+	k = data_slot(r, bit);
+	memcpy(slots(r) + NODE_ENTRIES, s + NODE_ENTRIES,
+	       (k - NODE_ENTRIES) * sizeof(SEXPR));
+	slots(r)[k] = single_entry_slots(sub)[0];
+	slots(r)[k + 1] = single_entry_slots(sub)[1];
+	memcpy(slots(r) + k + 2, s + k, (i - k) * sizeof(SEXPR));
+	n = vector_size(node);
+	memcpy(slots(r) + i + 2, s + i + 1, (n - i - 1) * sizeof(SEXPR));
+	return r;
+}
+
+/* Calls fn(key, val) for each entry under node. */
+static void map_walk(SEXPR node, void (*fn)(SEXPR key, SEXPR val))
+{
+	SEXPR *s;
+	int i, n, nd;
+
+	s = slots(node);
+	n = vector_size(node);
+	if (vector_kind(node) == VECTOR_PMAP_COLLISION) {
+		for (i = COLL_ENTRIES; i < n; i += 2) {
+			fn(s[i], s[i + 1]);
+		}
+		return;
+	}
+
+	nd = NODE_ENTRIES + 2 * popcount(datamap(node));
+	for (i = NODE_ENTRIES; i < nd; i += 2) {
+		fn(s[i], s[i + 1]);
+	}
+	for (i = nd; i < n; i++) {
+		map_walk(s[i], fn);
+	}
+}
+
+static SEXPR new_map(int equiv, int count, SEXPR root, int edit)
+{
+	SEXPR m, *s;
+
+	m = new_node(VECTOR_PMAP, MAP_SIZE, edit);
+	s = slots(m);
+	s[MAP_COUNT] = count;
+	s[MAP_EQUIV] = equiv;
+	s[MAP_ROOT] = root;
+	return m;
+}
+
+/* Checks that e is a map, and a transient one or not as accept says. */
+static SEXPR map_arg(SEXPR e, int accept)
+{
+	if (!is_kind(VECTOR_PMAP, e)) {
+		throw_err("persistent map procedure used on something not a "
+			  "persistent map");
+	}
+	if (accept == TRANSIENT && slots(e)[MAP_EDIT] == 0) {
+		throw_err("persistent map used as a transient");
+	} else if (accept == PERSISTENT && slots(e)[MAP_EDIT] != 0) {
+		throw_err("transient map used as a persistent one");
+	}
+
+	return e;
+}
+
+/* Returns the map m with key set to val, changing m itself if edit is
+ * its edit number.
+ */
+static SEXPR map_set(SEXPR m, SEXPR key, SEXPR val, int edit)
+{
+	SEXPR root, *s;
+	int added, equiv;
+
+	s = slots(m);
+	equiv = s[MAP_EQUIV];
+	added = 0;
+	root = p_nullp(s[MAP_ROOT]) ? new_map_node(0, 0, edit) : s[MAP_ROOT];
+	root = map_assoc(equiv, root, 0, hash_equiv(equiv, key), key, val,
+			 edit, &added);
+	if (edit != 0) {
+		/* an editable root can be the same node with one more entry */
+		s[MAP_ROOT] = root;
+		s[MAP_COUNT] += added;
+		return m;
+	} else if (p_eqp(root, s[MAP_ROOT])) {
+		return m;
+	}
+
+	return new_map(equiv, s[MAP_COUNT] + added, root, 0);
+}
+
+static SEXPR map_delete(SEXPR m, SEXPR key, int edit)
+{
+	SEXPR root, *s;
+	int removed, equiv;
+
+	s = slots(m);
+	if (p_nullp(s[MAP_ROOT])) {
+		return m;
+	}
+	equiv = s[MAP_EQUIV];
+	removed = 0;
+	root = map_dissoc(equiv, s[MAP_ROOT], 0, hash_equiv(equiv, key), key,
+			  edit, &removed);
+	if (!removed) {
+		return m;
+	}
+	if (s[MAP_COUNT] == 1) {
+		root = SEXPR_NIL;
+	}
+	if (edit != 0) {
+		s[MAP_ROOT] = root;
+		s[MAP_COUNT]--;
+		return m;
+	}
+
+	return new_map(equiv, s[MAP_COUNT] - 1, root, 0);
+}
+
+/* (make-pmap [equiv]), equiv being eq?, eqv? or equal? */
+void make_pmap(int argc, SEXPR *argv)
+{
+	int equiv;
+
+	equiv = HASH_EQUAL;
+	if (argc > 0) {
+		equiv = (sexpr_type(argv[0]) == SEXPR_BUILTIN_FUNCTION) ?
+			builtin_equivalence(sexpr_index(argv[0])) : -1;
+		if (equiv < 0) {
+			throw_err("make-pmap: the equivalence must be "
+				  "eq?, eqv? or equal?");
+		}
+	}
+
+	vectors_gc_check();
+	s_val = new_map(equiv, 0, SEXPR_NIL, 0);
+}
+
+void pmapp(int argc, SEXPR *argv)
+{
+	s_val = is_kind(VECTOR_PMAP, argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+void pmap_count(int argc, SEXPR *argv)
+{
+	s_val = number_sexpr(slots(map_arg(argv[0], EITHER))[MAP_COUNT]);
+}
+
+/* Returns the slot of the value of key in the map m, or NULL. */
+static SEXPR *pmap_find(SEXPR m, SEXPR key)
+{
+	if (p_nullp(slots(map_arg(m, EITHER))[MAP_ROOT])) {
+		return NULL;
+	}
+
+	return map_find(slots(m)[MAP_EQUIV], slots(m)[MAP_ROOT], key);
+}
+
+/* (pmap-ref map key [default]) */
+void pmap_ref(int argc, SEXPR *argv)
+{
+	SEXPR *pval;
+
+	pval = pmap_find(argv[0], argv[1]);
+	if (pval != NULL) {
+		s_val = *pval;
+	} else if (argc > 2) {
+		s_val = argv[2];
+	} else {
+		throw_err("pmap-ref: key not found");
+	}
+}
+
+void pmap_contains(int argc, SEXPR *argv)
+{
+	s_val = (pmap_find(argv[0], argv[1]) != NULL) ?
+		SEXPR_TRUE : SEXPR_FALSE;
+}
+
+/* (pmap-set map key val): a new map */
+void pmap_set(int argc, SEXPR *argv)
+{
+	vectors_gc_check();
+	s_val = map_set(map_arg(argv[0], PERSISTENT), argv[1], argv[2], 0);
+}
+
+void pmap_delete(int argc, SEXPR *argv)
+{
+	vectors_gc_check();
+	s_val = map_delete(map_arg(argv[0], PERSISTENT), argv[1], 0);
+}
+
+void pmap_set_in_place(int argc, SEXPR *argv)
+{
+	SEXPR m;
+
+	region_store(argv[0], argv[1]);
+	region_store(argv[0], argv[2]);
+	vectors_gc_check();
+	m = map_arg(argv[0], TRANSIENT);
+	s_val = map_set(m, argv[1], argv[2], slots(m)[MAP_EDIT]);
+}
+
+void pmap_delete_in_place(int argc, SEXPR *argv)
+{
+	SEXPR m;
+
+	vectors_gc_check();
+	m = map_arg(argv[0], TRANSIENT);
+	s_val = map_delete(m, argv[1], slots(m)[MAP_EDIT]);
+}
+
+/* (pmap-transient map): a transient with the entries of map */
+void pmap_transient(int argc, SEXPR *argv)
+{
+	SEXPR *s;
+
+	vectors_gc_check();
+	s = slots(map_arg(argv[0], PERSISTENT));
+	s_val = new_map(s[MAP_EQUIV], s[MAP_COUNT], s[MAP_ROOT],
+			++s_last_edit);
+}
+
+void pmap_persistent(int argc, SEXPR *argv)
+{
+	slots(map_arg(argv[0], TRANSIENT))[MAP_EDIT] = 0;
+	s_val = argv[0];
+}
+
+static void cons_entry(SEXPR key, SEXPR val)
+{
+	push(s_val);
+	s_val = p_cons(key, val);
+	s_val = p_cons(s_val, pop());
+}
+
+void pmap_to_alist(int argc, SEXPR *argv)
+{
+	map_arg(argv[0], EITHER);
+	s_val = SEXPR_NIL;
+	if (!p_nullp(slots(argv[0])[MAP_ROOT])) {
+		map_walk(slots(argv[0])[MAP_ROOT], cons_entry);
+	}
+}
+
+/************************************************************/
+/* vectors                                                  */
+/************************************************************/
+
+static int vec_count(SEXPR v)
+{
+	return slots(v)[VEC_COUNT];
+}
+
+/* The index of the first element in the tail. */
+static int tail_offset(int count)
+{
+	return (count < WIDTH) ? 0 : ((count - 1) >> BITS) << BITS;
+}
+
+static SEXPR new_vec(int count, int shift, SEXPR root, SEXPR tail, int edit)
+{
+	SEXPR v, *s;
+
+	v = new_node(VECTOR_PVEC, VEC_SIZE, edit);
+	s = slots(v);
+	s[VEC_COUNT] = count;
+	s[VEC_SHIFT] = shift;
+	s[VEC_ROOT] = root;
+	s[VEC_TAIL] = tail;
+	return v;
+}
+
+static SEXPR empty_vec(int edit)
+{
+	return new_vec(0, BITS, new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit),
+		       new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit), edit);
+}
+
+/* As map_arg(), for vectors. */
+static SEXPR vec_arg(SEXPR e, int accept)
+{
+	if (!is_kind(VECTOR_PVEC, e)) {
+		throw_err("persistent vector procedure used on something not "
+			  "a persistent vector");
+	}
+	if (accept == TRANSIENT && slots(e)[VEC_EDIT] == 0) {
+		throw_err("persistent vector used as a transient");
+	} else if (accept == PERSISTENT && slots(e)[VEC_EDIT] != 0) {
+		throw_err("transient vector used as a persistent one");
+	}
+
+	return e;
+}
+
+/* Returns the leaf node of v that holds element i. */
+static SEXPR leaf_for(SEXPR v, int i)
+{
+	SEXPR node;
+	int level;
+
+	if (i >= tail_offset(vec_count(v))) {
+		return slots(v)[VEC_TAIL];
+	}
+
+	node = slots(v)[VEC_ROOT];
+	for (level = slots(v)[VEC_SHIFT]; level > 0; level -= BITS) {
+		node = slots(node)[LEAF_ENTRIES + ((i >> level) & MASK)];
+	}
+	return node;
+}
+
+/* Returns the slot of element i of v. */
+static SEXPR *vec_slot(SEXPR v, int i)
+{
+	return &slots(leaf_for(v, i))[LEAF_ENTRIES + (i & MASK)];
+}
+
+static SEXPR vec_assoc(SEXPR node, int level, int i, SEXPR x, int edit)
+{
+	SEXPR r;
+	int k;
+
+	r = editable(node, edit);
+	if (level == 0) {
+		slots(r)[LEAF_ENTRIES + (i & MASK)] = x;
+	} else {
+		k = LEAF_ENTRIES + ((i >> level) & MASK);
+		slots(r)[k] = vec_assoc(slots(node)[k], level - BITS, i, x,
+					edit);
+	}
+	return r;
+}
+
+/* Returns v with element i set to x, changing v if edit is its number. */
+static SEXPR vec_set(SEXPR v, int i, SEXPR x, int edit)
+{
+	SEXPR *s, root, tail;
+
+	s = slots(v);
+	root = s[VEC_ROOT];
+	tail = s[VEC_TAIL];
+	if (i >= tail_offset(s[VEC_COUNT])) {
+		tail = editable(tail, edit);
+		slots(tail)[LEAF_ENTRIES + (i & MASK)] = x;
+	} else {
+		root = vec_assoc(root, s[VEC_SHIFT], i, x, edit);
+	}
+
+	if (edit != 0) {
+		s[VEC_ROOT] = root;
+		s[VEC_TAIL] = tail;
+		return v;
+	}
+	return new_vec(s[VEC_COUNT], s[VEC_SHIFT], root, tail, 0);
+}
+
+/* A path of nodes down to node, from level. */
+static SEXPR new_path(int level, SEXPR node, int edit)
+{
+	SEXPR r;
+
+	if (level == 0) {
+		return node;
+	}
+	r = new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit);
+	slots(r)[LEAF_ENTRIES] = new_path(level - BITS, node, edit);
+	return r;
+}
+
+/* Puts the full tail node in the trie of a vector of count elements. */
+static SEXPR push_tail(int count, int level, SEXPR parent, SEXPR tail,
+		       int edit)
+{
+	SEXPR r, child;
+	int k;
+
+	r = editable(parent, edit);
+	k = LEAF_ENTRIES + (((count - 1) >> level) & MASK);
+	if (level == BITS) {
+		slots(r)[k] = tail;
+	} else {
+		child = slots(parent)[k];
+		slots(r)[k] = p_nullp(child) ?
+			new_path(level - BITS, tail, edit) :
+			push_tail(count, level - BITS, child, tail, edit);
+	}
+	return r;
+}
+
+static SEXPR vec_push(SEXPR v, SEXPR x, int edit)
+{
+	SEXPR *s, root, tail;
+	int count, shift;
+
+	s = slots(v);
+	count = s[VEC_COUNT];
+	shift = s[VEC_SHIFT];
+	root = s[VEC_ROOT];
+	if (count - tail_offset(count) < WIDTH) {
+		tail = editable(s[VEC_TAIL], edit);
+	} else {
+		/* the tail is full: it goes into the trie */
+		if ((count >> BITS) > (1 << shift)) {
+			root = new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit);
+			slots(root)[LEAF_ENTRIES] = s[VEC_ROOT];
+			slots(root)[LEAF_ENTRIES + 1] =
+				new_path(shift, s[VEC_TAIL], edit);
+			shift += BITS;
+		} else {
+			root = push_tail(count, shift, root, s[VEC_TAIL], edit);
+		}
+		tail = new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit);
+	}
+	slots(tail)[LEAF_ENTRIES + (count & MASK)] = x;
+
+	if (edit != 0) {
+		s[VEC_COUNT] = count + 1;
+		s[VEC_SHIFT] = shift;
+		s[VEC_ROOT] = root;
+		s[VEC_TAIL] = tail;
+		return v;
+	}
+	return new_vec(count + 1, shift, root, tail, 0);
+}
+
+/* Takes the last leaf out of the trie of a vector of count elements. */
+static SEXPR pop_tail(int count, int level, SEXPR node, int edit)
+{
+	SEXPR r, child;
+	int k;
+
+	k = ((count - 2) >> level) & MASK;
+	if (level > BITS) {
+		child = pop_tail(count, level - BITS,
+				 slots(node)[LEAF_ENTRIES + k], edit);
+		if (p_nullp(child) && k == 0) {
+			return SEXPR_NIL;
+		}
+		r = editable(node, edit);
+		slots(r)[LEAF_ENTRIES + k] = child;
+		return r;
+	} else if (k == 0) {
+		return SEXPR_NIL;
+	}
+
+	r = editable(node, edit);
+	slots(r)[LEAF_ENTRIES + k] = SEXPR_NIL;
+	return r;
+}
+
+static SEXPR vec_pop(SEXPR v, int edit)
+{
+	SEXPR *s, root, tail;
+	int count, shift;
+
+	s = slots(v);
+	count = s[VEC_COUNT];
+	shift = s[VEC_SHIFT];
+	root = s[VEC_ROOT];
+	tail = s[VEC_TAIL];
+	if (count == 0) {
+		throw_err("pvector-pop: empty vector");
+	} else if (count - tail_offset(count) > 1) {
+		tail = editable(s[VEC_TAIL], edit);
+		slots(tail)[LEAF_ENTRIES + ((count - 1) & MASK)] = SEXPR_NIL;
+	} else if (count == 1) {
+		tail = editable(s[VEC_TAIL], edit);
+		slots(tail)[LEAF_ENTRIES] = SEXPR_NIL;
+	} else {
+		/* the last leaf of the trie becomes the tail */
+		tail = leaf_for(v, count - 2);
+		root = pop_tail(count, shift, root, edit);
+		if (p_nullp(root)) {
+			root = new_node(VECTOR_PVEC_NODE, LEAF_SIZE, edit);
+		}
+		if (shift > BITS && p_nullp(slots(root)[LEAF_ENTRIES + 1])) {
+			root = slots(root)[LEAF_ENTRIES];
+			shift -= BITS;
+		}
+	}
+
+	if (edit != 0) {
+		s[VEC_COUNT] = count - 1;
+		s[VEC_SHIFT] = shift;
+		s[VEC_ROOT] = root;
+		s[VEC_TAIL] = tail;
+		return v;
+	}
+	return new_vec(count - 1, shift, root, tail, 0);
+}
+
+/* (pvector obj ...) */
+void pvector(int argc, SEXPR *argv)
+{
+	SEXPR v;
+	int i, edit;
+
+	vectors_gc_check();
+	edit = ++s_last_edit;
+	v = empty_vec(edit);
+	for (i = 0; i < argc; i++) {
+		vec_push(v, argv[i], edit);
+	}
+	slots(v)[VEC_EDIT] = 0;
+	s_val = v;
+}
+
+void list_to_pvector(int argc, SEXPR *argv)
+{
+	SEXPR v, p;
+	int edit;
+
+	vectors_gc_check();
+	edit = ++s_last_edit;
+	v = empty_vec(edit);
+	for (p = argv[0]; p_pairp(p); p = p_cdr(p)) {
+		vec_push(v, p_car(p), edit);
+	}
+	if (!p_nullp(p)) {
+		throw_err("list->pvector: not a proper list");
+	}
+	slots(v)[VEC_EDIT] = 0;
+	s_val = v;
+}
+
+void pvectorp(int argc, SEXPR *argv)
+{
+	s_val = is_kind(VECTOR_PVEC, argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+void pvector_length(int argc, SEXPR *argv)
+{
+	s_val = number_sexpr(vec_count(vec_arg(argv[0], EITHER)));
+}
+
+void pvector_ref(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	v = vec_arg(argv[0], EITHER);
+	s_val = *vec_slot(v, vector_index_arg(argv[1], vec_count(v), 0));
+}
+
+/* (pvector-set vector k obj): a new vector */
+void pvector_set(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	vectors_gc_check();
+	v = vec_arg(argv[0], PERSISTENT);
+	s_val = vec_set(v, vector_index_arg(argv[1], vec_count(v), 0),
+			argv[2], 0);
+}
+
+/* (pvector-push vector obj): a new vector with obj at the end */
+void pvector_push(int argc, SEXPR *argv)
+{
+	vectors_gc_check();
+	s_val = vec_push(vec_arg(argv[0], PERSISTENT), argv[1], 0);
+}
+
+/* (pvector-pop vector): a new vector without the last element */
+void pvector_pop(int argc, SEXPR *argv)
+{
+	vectors_gc_check();
+	s_val = vec_pop(vec_arg(argv[0], PERSISTENT), 0);
+}
+
+void pvector_set_in_place(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	region_store(argv[0], argv[2]);
+	vectors_gc_check();
+	v = vec_arg(argv[0], TRANSIENT);
+	s_val = vec_set(v, vector_index_arg(argv[1], vec_count(v), 0),
+			argv[2], slots(v)[VEC_EDIT]);
+}
+
+void pvector_push_in_place(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	region_store(argv[0], argv[1]);
+	vectors_gc_check();
+	v = vec_arg(argv[0], TRANSIENT);
+	s_val = vec_push(v, argv[1], slots(v)[VEC_EDIT]);
+}
+
+void pvector_pop_in_place(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	vectors_gc_check();
+	v = vec_arg(argv[0], TRANSIENT);
+	s_val = vec_pop(v, slots(v)[VEC_EDIT]);
+}
+
+/* (pvector-transient vector): a transient with the elements of vector */
+void pvector_transient(int argc, SEXPR *argv)
+{
+	SEXPR *s;
+
+	vectors_gc_check();
+	s = slots(vec_arg(argv[0], PERSISTENT));
+	s_val = new_vec(s[VEC_COUNT], s[VEC_SHIFT], s[VEC_ROOT], s[VEC_TAIL],
+			++s_last_edit);
+}
+
+void pvector_persistent(int argc, SEXPR *argv)
+{
+	slots(vec_arg(argv[0], TRANSIENT))[VEC_EDIT] = 0;
+	s_val = argv[0];
+}
+
+void pvector_to_list(int argc, SEXPR *argv)
+{
+	SEXPR v;
+	int i;
+
+	v = vec_arg(argv[0], EITHER);
+	s_val = SEXPR_NIL;
+	for (i = vec_count(v) - 1; i >= 0; i--) {
+		s_val = p_cons(*vec_slot(v, i), s_val);
+	}
+}
+
+/************************************************************/
+/* printing and equal?                                      */
+/************************************************************/
+
+void print_persistent(SEXPR e)
+{
+	printf((vector_kind(e) == VECTOR_PMAP) ? "{pmap}" : "{pvector}");
+}
+
+/* the map compared by check_entry() and the result */
+static SEXPR s_equal_other;
+static int s_equal_result;
+
+static void check_entry(SEXPR key, SEXPR val)
+{
+	SEXPR *pval;
+
+	if (s_equal_result) {
+		pval = pmap_find(s_equal_other, key);
+		s_equal_result = (pval != NULL && p_equalp(val, *pval));
+	}
+}
+
+/*
+ * Returns 1 if the persistent maps or vectors x and y, of the same kind,
+ * have equal? entries.
+ */
+int persistent_equalp(SEXPR x, SEXPR y)
+{
+	int i;
+
+	if (vector_kind(x) == VECTOR_PVEC) {
+		if (vec_count(x) != vec_count(y)) {
+			return 0;
+		}
+		for (i = 0; i < vec_count(x); i++) {
+			if (!p_equalp(*vec_slot(x, i), *vec_slot(y, i))) {
+				return 0;
+			}
+		}
+		return 1;
+	} else if (vector_kind(x) != VECTOR_PMAP) {
+		/* nodes are not seen by programs */
+		return p_eqp(x, y);
+	}
+
+	if (slots(x)[MAP_COUNT] != slots(y)[MAP_COUNT] ||
+	    slots(x)[MAP_EQUIV] != slots(y)[MAP_EQUIV])
+	{
+		return 0;
+	}
+	s_equal_other = y;
+	s_equal_result = 1;
+	if (!p_nullp(slots(x)[MAP_ROOT])) {
+		map_walk(slots(x)[MAP_ROOT], check_entry);
+	}
+	return s_equal_result;
+}
@@ -4,6 +4,7 @@
  */
 
 #include "cfg.h"
+#include "gc.h"
 #ifndef SEXPR_H
 #include "sexpr.h"
 #endif
@@ -76,20 +77,76 @@ int p_pairp(SEXPR e)
 	return sexpr_type(e) == SEXPR_CONS;
 }
 
+int p_promisep(SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_PROMISE;
+}
+
+int p_hashtablep(SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_HASHTABLE;
+}
+
+int p_weak_pairp(SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_WEAK_PAIR;
+}
+
+int p_vectorp(SEXPR e)
+{
+	return sexpr_type(e) == SEXPR_VECTOR &&
+		vector_kind(e) == VECTOR_GENERAL;
+}
+
+/*
+ * Returns the value of the promise e, evaluating its expression the first
+ * time. Anything else is its own value.
+ */
+SEXPR p_force(SEXPR e)
+{
+	int celli;
+
+	if (!p_promisep(e)) {
+		return e;
+	}
+
+	celli = sexpr_index(e);
+	if (!p_eqp(cell_cdr(celli), SEXPR_TRUE)) {
+		push(e);
+		s_expr = cell_car(celli);
+		s_env = cell_cdr(celli);
+		p_eval();
+		pop();
+		/* the expression may have forced the promise itself */
+		if (!p_eqp(cell_cdr(celli), SEXPR_TRUE)) {
+			region_store(e, s_val);
+			static_store(celli);
+			set_cell_car(celli, s_val);
+			set_cell_cdr(celli, SEXPR_TRUE);
+		}
+	}
+
+	return cell_car(celli);
+}
+
 SEXPR p_car(SEXPR e)
 {
+#ifndef PP_UNSAFE
 	if (!p_pairp(e)) {
 		throw_err("car used with something that is not a pair");
 	}
+#endif
 
 	return cell_car(sexpr_index(e));
 }
 
 SEXPR p_cdr(SEXPR e)
 {
+#ifndef PP_UNSAFE
 	if (!p_pairp(e)) {
 		throw_err("cdr used with something that is not a pair");
 	}
+#endif
 
 	return cell_cdr(sexpr_index(e));
 }
@@ -107,16 +164,52 @@ int p_eqvp(SEXPR x, SEXPR y)
 		return sexpr_eq(x, y);
 }
 
+/* Returns 1 if the vectors x and y have equal? elements. */
+static int vectors_equalp(SEXPR x, SEXPR y)
+{
+	int i, n;
+
+	n = vector_size(x);
+	if (n != vector_size(y) || vector_kind(x) != vector_kind(y)) {
+		return 0;
+	}
+	switch (vector_kind(x)) {
+	case VECTOR_GENERAL:
+		break;
+	case VECTOR_F64:
+	case VECTOR_S64:
+		return number_vectors_equalp(x, y);
+	case VECTOR_RECORD:
+	case VECTOR_RECORD_TYPE:
+		return sexpr_eq(x, y);
+	default:
+		return persistent_equalp(x, y);
+	}
+	for (i = 0; i < n; i++) {
+		if (!p_equalp(vector_elems(x)[i], vector_elems(y)[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 int p_equalp(SEXPR x, SEXPR y)
 {
 	for (;;) {
 		if (p_pairp(x) && p_pairp(y)) {
-			if (p_equalp(p_car(x), p_car(y))) {
+			if (pair_frozen(x) && pair_frozen(y)) {
+				return sexpr_eq(x, y);
+			} else if (p_equalp(p_car(x), p_car(y))) {
 				x = p_cdr(x);
 				y = p_cdr(y);
 			} else {
 				return 0;
 			}
+		} else if (sexpr_type(x) == SEXPR_VECTOR &&
+			   sexpr_type(y) == SEXPR_VECTOR)
+		{
+			return vectors_equalp(x, y);
 		} else if (!p_pairp(x) && !p_pairp(y)) {
 			return p_eqvp(x, y);
 		} else {
@@ -131,6 +224,10 @@ SEXPR p_setcar(SEXPR e, SEXPR val)
 		throw_err("set-car! used on something that is not a pair");
 	}
 
+	if (s_in_region) {
+		region_store(e, val);
+	}
+	static_store(sexpr_index(e));
 	set_cell_car(sexpr_index(e), val);
 	return val;
 }
@@ -141,6 +238,10 @@ SEXPR p_setcdr(SEXPR e, SEXPR val)
 		throw_err("set-cdr! used on something that is not a pair");
 	}
 
+	if (s_in_region) {
+		region_store(e, val);
+	}
+	static_store(sexpr_index(e));
 	set_cell_cdr(sexpr_index(e), val);
 	return val;
 }
@@ -212,23 +313,95 @@ void p_evseq(int eval_last)
 	}
 }
 
-/* in: proc, args.
+/*
+ * The environment made by the last procedure applied, set when it returns
+ * the expression in tail position, the procedure, and s_captures when it
+ * was made.
+ */
+SEXPR s_newframe = SEXPR_NIL;
+static SEXPR s_newframe_proc;
+static int s_newframe_captures;
+
+/* Frees frame if nothing can have kept it since s_captures was captures. */
+static void release_frame(SEXPR frame, int captures)
+{
+	if (!p_nullp(frame) && captures == s_captures) {
+		free_environment(frame);
+	}
+}
+
+static int listlen(SEXPR e)
+{
+	int n;
+
+	if (!p_pairp(e))
+		return 0;
+
+	n = 0;
+	while (!p_nullp(e)) {
+		n++;
+		e = p_cdr(e);
+	}
+	return n;
+}
+
+/* Evaluates the elements of s_unev and pushes the values to the stack, in
+ * order. Returns the number of values pushed.
+ * in: unev, env.
+ */
+int p_evargs(void)
+{
+	int argc;
+
+	argc = 0;
+	while (!p_nullp(s_unev)) {
+		s_expr = p_car(s_unev);
+		push(s_env);
+		push(s_unev);
+		p_eval();
+		s_unev = pop();
+		s_env = pop();
+		push(s_val);
+		argc++;
+		s_unev = p_cdr(s_unev);
+	}
+
+	return argc;
+}
+
+/*
+ * Replaces the form that called a special with its expansion, which is in
+ * s_val. Specials are thus expanded once on each place where they are used.
+ * Only pairs can be put in the place of the form; other expansions are
+ * not remembered.
+ */
+static void memoize_expansion(SEXPR form)
+{
+	if (p_pairp(s_val)) {
+		p_setcar(form, p_car(s_val));
+		p_setcdr(form, p_cdr(s_val));
+		s_val = form;
+	}
+}
+
+/* in: proc, and the argc evaluated arguments on the top of the stack; for
+ * specials, the unevaluated arguments in args.
  * Exits: val.
  * Will set s_tailrec if tail recursion should be made.
+ * The arguments are left on the stack: the caller pops them.
  *
  * TODO: we don't have s_env now probably, so we cannot implement dynamic
  * binding right now... (?)
  */
-void p_apply(void)
+void p_apply(int argc)
 {
 	SEXPR params, body, params_n_body;
-	int celli;
+	int celli, captures;
 
 	if (s_debug) {
 		printf("apply fn: ");
 		p_println(s_proc);
-		printf("args: ");
-		p_println(s_args);
+		printf("args: %d\n", argc);
 		// printf("a: ");
 		// println(s_env);
 	}
@@ -236,7 +409,8 @@ void p_apply(void)
 	switch (sexpr_type(s_proc)) {
 	case SEXPR_BUILTIN_FUNCTION:
 		s_tailrec = 0;
-		apply_builtin_function(sexpr_index(s_proc));
+		apply_builtin_function(sexpr_index(s_proc), argc,
+				       stack_top(argc));
 		return;
 
 	case SEXPR_BUILTIN_SPECIAL:
@@ -252,6 +426,7 @@ void p_apply(void)
 		celli = sexpr_index(s_proc);
 		params_n_body = cell_car(celli);
 		s_env = make_environment(cell_cdr(celli));
+		captures = s_captures;
 		/* 
 		 * Pair parameters with their arguments and extend the
 		 * environment.
@@ -259,10 +434,14 @@ void p_apply(void)
 		celli = sexpr_index(params_n_body);
 		params = cell_car(celli);
 		s_unev = params;
-		extend_environment();
+		extend_environment(argc, stack_top(argc));
 		body = cell_cdr(celli);
+		hoist_defines(body);
 		s_unev = body;
 		p_evseq(0);
+		s_newframe = s_env;
+		s_newframe_proc = s_proc;
+		s_newframe_captures = captures;
 		s_tailrec = 1;
 		return;
 
@@ -271,7 +450,13 @@ void p_apply(void)
 		 * A special creates a new environment with its saved
 		 * environment as parent but will return the expression to the
 		 * previous environment.
+		 * The unevaluated arguments are pushed, so they are paired with
+		 * the parameters as for a lambda.
 		 */
+		for (argc = 0; p_pairp(s_args); argc++) {
+			push(p_car(s_args));
+			s_args = p_cdr(s_args);
+		}
 		celli = sexpr_index(s_proc);
 		params_n_body = cell_car(celli);
 		push(s_env);
@@ -283,12 +468,13 @@ void p_apply(void)
 		celli = sexpr_index(params_n_body);
 		params = cell_car(celli);
 		s_unev = params;
-		extend_environment();
+		extend_environment(argc, stack_top(argc + 1));
 		body = cell_cdr(celli);
 		s_unev = body;
 		p_evseq(1);
 		/* get the last environment */
 		s_env = pop();
+		popn(argc);
 		s_tailrec = 1;
 		return;
 
@@ -297,86 +483,67 @@ void p_apply(void)
 	}
 }
 
-static int s_evalc = 0;
-
-static int listlen(SEXPR e)
+/*
+ * Calls the procedure s_proc from C with the argc arguments on the top of
+ * the stack, which the caller pops, and returns its value.
+ * s_env is not kept.
+ */
+SEXPR p_call(int argc)
 {
-	int n;
+	int t;
 
-	if (!p_pairp(e))
-		return 0;
+	t = sexpr_type(s_proc);
+	if (t != SEXPR_FUNCTION && t != SEXPR_BUILTIN_FUNCTION) {
+		throw_err("procedure expected");
+	}
 
-	n = 0;
-	while (!p_nullp(e)) {
-		n++;
-		e = p_cdr(e);
+	p_apply(argc);
+	if (s_tailrec) {
+		s_expr = s_val;
+		p_eval();
 	}
-	return n;
+
+	return s_val;
 }
 
-/* Given the list p (possibly empty) and node pointing to the last pair
- * of the list (undefined if p is empty), returns a new list with a new
- * pair added to the end and node will point to that pair.
- */
-static SEXPR p_adjoin(SEXPR p, SEXPR *node, SEXPR e)
-{
-	SEXPR node2;
+static int s_evalc = 0;
 
-	if (p_nullp(p)) {
-		*node = p_cons(e, SEXPR_NIL);
-		return *node;
-	} else {
-		node2 = p_cons(e, SEXPR_NIL);
-		p_setcdr(*node, node2);
-		*node = node2;
-		return p;
-	}
-}
-			
-/* Evaluates the elements of s_unev and builds the list s_args.
- * in: unev, env, args (NIL).
- * out: args.
+/*
+ * Applies the procedure s_proc to the argc arguments on the stack binding
+ * them on frame, an environment it made for a previous call that nothing
+ * refers to, instead of making a new one.
+ * Returns 0 if it cannot be done.
  */
-void p_evargs(void)
+static int apply_on_frame(int argc, SEXPR frame)
 {
-	SEXPR node;
+	SEXPR params_n_body;
 
-	assert(p_nullp(s_args));
-
-	if (p_nullp(s_unev)) {
-		s_args = s_unev;
+	params_n_body = cell_car(sexpr_index(s_proc));
+	s_env = frame;
+	s_unev = p_car(params_n_body);
+	if (!rebind_environment(argc, stack_top(argc))) {
+		return 0;
 	}
 
-	node = s_args;
-	for (;;) {
-		push(s_args);
-		s_expr = p_car(s_unev);
-		if (p_nullp(p_cdr(s_unev))) {
-			/* last operand */
-			p_eval();
-			s_args = pop();
-			s_args = p_adjoin(s_args, &node, s_val);
-			break;
-		} else {
-			push(s_env);
-			push(s_unev);
-			p_eval();
-			s_unev = pop();
-			s_env = pop();
-			s_args = pop();
-			s_args = p_adjoin(s_args, &node, s_val);
-			s_unev = p_cdr(s_unev);
-		}
-	}
+	s_unev = p_cdr(params_n_body);
+	p_evseq(0);
+	s_tailrec = 1;
+	return 1;
 }
 
 /* in: expr, env.
  * out: val
+ *
+ * The environment made for a procedure applied here is owned by this
+ * evaluation, that frees it when it is left, by a call in tail position or
+ * by returning, if nothing can have kept it (see s_captures). It is kept on
+ * the stack meanwhile. An environment made just before the evaluation, by
+ * a p_apply() out of p_eval(), is owned the same way.
  */
 void p_eval(void)
 {
-	int t;
-	SEXPR bind;
+	int t, argc, captures;
+	SEXPR bind, *pframe, *pproc;
 
 	s_evalc++;
 
@@ -385,6 +552,16 @@ void p_eval(void)
 		// p_println(a);
 	}
 
+	if (p_eqp(s_newframe, s_env)) {
+		push2(s_newframe, s_newframe_proc);
+	} else {
+		push2(SEXPR_NIL, SEXPR_NIL);
+	}
+	pframe = stack_top(2);
+	pproc = pframe + 1;
+	s_newframe = SEXPR_NIL;
+	captures = s_newframe_captures;
+
 again:  switch (sexpr_type(s_expr)) {
 	/* () does not evaluate to itself in Scheme
 	 * case SEXPR_NIL:
@@ -392,9 +569,9 @@ again:  switch (sexpr_type(s_expr)) {
 	case SEXPR_TRUE:
 	case SEXPR_FALSE:
 	case SEXPR_NUMBER:
-		s_evalc--;
+	case SEXPR_VECTOR:
 		s_val = s_expr;
-		return;
+		break;
 
 	case SEXPR_SYMBOL:
 		// printf("lookup: ");
@@ -403,11 +580,31 @@ again:  switch (sexpr_type(s_expr)) {
 		if (p_nullp(bind)) {
 			throw_err("variable not bound");
 		}
-		s_evalc--;
 		s_val = p_cdr(bind);
-		return;
+		break;
 
 	case SEXPR_CONS:
+		/* the forms made by fold.c, whose heads are never rebound */
+		if (p_eqp(p_car(s_expr), s_fold_atom) ||
+		    p_eqp(p_car(s_expr), s_inline_atom) ||
+		    p_eqp(p_car(s_expr), s_site_atom))
+		{
+			s_args = p_cdr(s_expr);
+			s_tailrec = 0;
+			if (p_eqp(p_car(s_expr), s_fold_atom)) {
+				fold_special();
+			} else if (p_eqp(p_car(s_expr), s_inline_atom)) {
+				inline_special();
+			} else {
+				site_special();
+			}
+			if (s_tailrec) {
+				s_expr = s_val;
+				goto again;
+			}
+			break;
+		}
+
 		/* application */
 		if (s_debug) {
 			printf("eval: ");
@@ -418,29 +615,59 @@ again:  switch (sexpr_type(s_expr)) {
 
 		/* evaluate the operator */
 		push(s_env);
-		s_unev = p_cdr(s_expr);
-		push(s_unev);
+		push(s_expr);
 		s_expr = p_car(s_expr);
 		p_eval();
 		s_proc = s_val;
 
 		/* evaluate arguments if needed and apply */
-		s_unev = pop();
-		s_env = pop();
-		s_args = SEXPR_NIL;
+		s_unev = p_cdr(*stack_top(1));
 		t = sexpr_type(s_proc);
-		if (t == SEXPR_BUILTIN_SPECIAL || t == SEXPR_SPECIAL) {
+		if (t == SEXPR_SPECIAL) {
+			/*
+			 * The expansion of a special replaces the form, so it
+			 * is expanded only the first time.
+			 */
+			s_env = *stack_top(2);
 			s_args = s_unev;
-		} else if (!p_nullp(s_unev)) {
+			p_apply(0);
+			memoize_expansion(pop());
+			s_env = pop();
+		} else if (t == SEXPR_BUILTIN_SPECIAL) {
+			popn(1);
+			s_env = pop();
+			s_args = s_unev;
+			p_apply(0);
+		} else {
+			popn(1);
+			s_env = pop();
 			/* 
-			 * For non special forms we evaluate the arguments
-			 * only if there is any.
+			 * For non special forms the arguments are evaluated
+			 * to the stack.
 			 */
 			push(s_proc);
-			p_evargs();
-			s_proc = pop();
+			argc = p_evargs();
+			s_proc = *stack_top(argc + 1);
+			/*
+			 * A call to the procedure that made the frame we own
+			 * binds the arguments on it, if it can be freed.
+			 */
+			if (p_nullp(*pframe) || !p_eqp(s_proc, *pproc) ||
+			    captures != s_captures ||
+			    !apply_on_frame(argc, *pframe))
+			{
+				p_apply(argc);
+			}
+			popn(argc + 1);
+		}
+		if (!p_nullp(s_newframe)) {
+			/* a call in tail position leaves the previous frame */
+			release_frame(*pframe, captures);
+			*pframe = s_newframe;
+			*pproc = s_newframe_proc;
+			s_newframe = SEXPR_NIL;
+			captures = s_newframe_captures;
 		}
-		p_apply();
 		if (s_tailrec) {
 			s_expr = s_val;
 			goto again;
@@ -449,12 +676,20 @@ again:  switch (sexpr_type(s_expr)) {
 			printf("r: ");
 			p_println(s_val);
 		}
-		s_evalc--;
-		return;
+		break;
 
 	default:
 		throw_err("unknown object to eval");
 	}
+
+	/* the tail recursion was done here, not for the caller */
+	s_tailrec = 0;
+	s_evalc--;
+	if (!p_nullp(*pframe) && captures == s_captures) {
+		free_environment(*pframe);
+		s_env = SEXPR_NIL;
+	}
+	popn(2);
 }
 
 void p_print(SEXPR sexpr)
@@ -519,6 +754,39 @@ void p_print(SEXPR sexpr)
 	case SEXPR_DYN_FUNCTION:
 		printf("{d-lambda}");
 		break;
+	case SEXPR_PROMISE:
+		printf("{promise}");
+		break;
+	case SEXPR_VECTOR:
+		if (vector_kind(sexpr) == VECTOR_F64 ||
+		    vector_kind(sexpr) == VECTOR_S64)
+		{
+			print_number_vector(sexpr);
+			break;
+		} else if (vector_kind(sexpr) == VECTOR_RECORD ||
+			   vector_kind(sexpr) == VECTOR_RECORD_TYPE)
+		{
+			print_record(sexpr);
+			break;
+		} else if (vector_kind(sexpr) != VECTOR_GENERAL) {
+			print_persistent(sexpr);
+			break;
+		}
+		printf("#(");
+		for (i = 0; i < vector_size(sexpr); i++) {
+			if (i > 0) {
+				printf(" ");
+			}
+			p_print(vector_elems(sexpr)[i]);
+		}
+		printf(")");
+		break;
+	case SEXPR_HASHTABLE:
+		printf("{hash table}");
+		break;
+	case SEXPR_WEAK_PAIR:
+		printf("{weak pair}");
+		break;
 	}
 }
 
@@ -0,0 +1,361 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Records.
+ *
+ * (define-record-type <point> (make-point x y) point?
+ *   (x point-x set-point-x!)
+ *   (y point-y))
+ *
+ * A record is a vector of kind VECTOR_RECORD: its first slot holds the
+ * index of its type in s_record_types, raw, and its fields follow. So
+ * checking the type of a record is a compare, and getting a field one
+ * index more.
+ *
+ * The constructor, predicate, accessors and modifiers are builtin
+ * functions made with make_datum_function(), whose datum is their index
+ * in s_record_procs, that tells the type and field they work on. The name
+ * of the type is bound to a vector of kind VECTOR_RECORD_TYPE holding the
+ * index of the type.
+ *
+ * Types and procedures are never freed: evaluating a define-record-type
+ * again makes a new type.
+ */
+
+enum { RECORD_TYPE_SLOT, RECORD_FIELDS };
+
+struct record_type {
+	char *name;
+	int nfields;
+};
+
+struct record_proc {
+	int type;
+	/* the field of an accessor or modifier */
+	int field;
+	/* the fields given to a constructor, in order */
+	int *args;
+};
+
+static struct record_type *s_record_types;
+static int s_nrecord_types;
+static int s_record_types_capacity;
+
+static struct record_proc *s_record_procs;
+static int s_nrecord_procs;
+static int s_record_procs_capacity;
+
+/* Makes room for one more element on the table *p of *pcap elements. */
+static void *grow_table(void *p, int n, int *pcap, size_t elem_size)
+{
+	int cap;
+
+	if (n < *pcap) {
+		return p;
+	}
+	cap = (*pcap == 0) ? 16 : *pcap * 2;
+	p = realloc(p, cap * elem_size);
+	if (p == NULL) {
+		throw_err("out of heap space for records");
+	}
+	*pcap = cap;
+	return p;
+}
+
+static char *copy_name(const char *s)
+{
+	char *p;
+
+	p = malloc(strlen(s) + 1);
+	if (p == NULL) {
+		throw_err("out of heap space for records");
+	}
+	strcpy(p, s);
+	return p;
+}
+
+static int add_record_type(const char *name, int nfields)
+{
+	struct record_type *pt;
+
+	s_record_types = grow_table(s_record_types, s_nrecord_types,
+				    &s_record_types_capacity,
+				    sizeof(*s_record_types));
+	pt = &s_record_types[s_nrecord_types];
+	pt->name = copy_name(name);
+	pt->nfields = nfields;
+	return s_nrecord_types++;
+}
+
+static int add_record_proc(int type, int field, int *args)
+{
+	struct record_proc *pp;
+
+	s_record_procs = grow_table(s_record_procs, s_nrecord_procs,
+				    &s_record_procs_capacity,
+				    sizeof(*s_record_procs));
+	pp = &s_record_procs[s_nrecord_procs];
+	pp->type = type;
+	pp->field = field;
+	pp->args = args;
+	return s_nrecord_procs++;
+}
+
+static SEXPR *record_slots(SEXPR r)
+{
+	return vector_data(r);
+}
+
+/* Returns 1 if e is a record of type. */
+static int is_record(SEXPR e, int type)
+{
+	return sexpr_type(e) == SEXPR_VECTOR &&
+		vector_kind(e) == VECTOR_RECORD &&
+		record_slots(e)[RECORD_TYPE_SLOT] == type;
+}
+
+/************************************************************/
+/* the procedures of a type                                 */
+/************************************************************/
+
+static void record_constructor(int datum, int argc, SEXPR *argv)
+{
+	struct record_proc *pp;
+	SEXPR *s;
+	int i, n;
+
+	pp = &s_record_procs[datum];
+	n = s_record_types[pp->type].nfields;
+	s_val = make_vector_of_kind(VECTOR_RECORD, RECORD_FIELDS + n,
+				    sizeof(SEXPR));
+	s = record_slots(s_val);
+	s[RECORD_TYPE_SLOT] = pp->type;
+	for (i = 0; i < n; i++) {
+		s[RECORD_FIELDS + i] = SEXPR_FALSE;
+	}
+	for (i = 0; i < argc; i++) {
+		s[RECORD_FIELDS + pp->args[i]] = argv[i];
+	}
+}
+
+static void record_predicate(int datum, int argc, SEXPR *argv)
+{
+	s_val = is_record(argv[0], s_record_procs[datum].type) ?
+		SEXPR_TRUE : SEXPR_FALSE;
+}
+
+static SEXPR record_arg(SEXPR e, int type)
+{
+	if (!is_record(e, type)) {
+		throw_err("record procedure used on something not a record "
+			  "of its type");
+	}
+
+	return e;
+}
+
+static void record_accessor(int datum, int argc, SEXPR *argv)
+{
+	struct record_proc *pp;
+
+	pp = &s_record_procs[datum];
+	s_val = record_slots(record_arg(argv[0], pp->type))[RECORD_FIELDS +
+							   pp->field];
+}
+
+static void record_modifier(int datum, int argc, SEXPR *argv)
+{
+	struct record_proc *pp;
+
+	pp = &s_record_procs[datum];
+	region_store(argv[0], argv[1]);
+	record_slots(record_arg(argv[0], pp->type))[RECORD_FIELDS +
+						    pp->field] = argv[1];
+	s_val = argv[1];
+}
+
+/************************************************************/
+/* define-record-type                                       */
+/************************************************************/
+
+static void bad_syntax(void)
+{
+	throw_err("bad syntax for define-record-type");
+}
+
+/* Returns the index of the field named name on the list of specs, or -1. */
+static int field_index(SEXPR fields, SEXPR name)
+{
+	int i;
+
+	for (i = 0; p_pairp(fields); fields = p_cdr(fields), i++) {
+		if (p_eqp(p_car(p_car(fields)), name)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Binds name on s_env to a new builtin calling fun for type and field. */
+static void define_record_proc(SEXPR name, int minargs, int maxargs,
+			       datum_fun fun, int type, int field, int *args)
+{
+	int i;
+
+	i = add_record_proc(type, field, args);
+	s_val = make_datum_function(sexpr_name(name), minargs, maxargs,
+				    fun, i);
+	s_expr = name;
+	define_variable();
+}
+
+/* Checks the field specs: (field accessor [modifier]) ... */
+static int check_fields(SEXPR fields)
+{
+	SEXPR spec;
+	int n;
+
+	for (n = 0; p_pairp(fields); fields = p_cdr(fields), n++) {
+		spec = p_car(fields);
+		if (!p_pairp(spec) || !p_symbolp(p_car(spec)) ||
+		    !p_pairp(p_cdr(spec)) || !p_symbolp(p_car(p_cdr(spec))) ||
+		    field_index(p_cdr(fields), p_car(spec)) >= 0)
+		{
+			bad_syntax();
+		}
+		spec = p_cdr(p_cdr(spec));
+		if (!p_nullp(spec) &&
+		    (!p_pairp(spec) || !p_symbolp(p_car(spec)) ||
+		     !p_nullp(p_cdr(spec))))
+		{
+			bad_syntax();
+		}
+	}
+	if (!p_nullp(fields)) {
+		bad_syntax();
+	}
+
+	return n;
+}
+
+/*
+ * Defines the constructor given by spec, that is (name field ...), name
+ * to take all the fields in order, or #f for none.
+ */
+static void define_constructor(SEXPR spec, SEXPR fields, int type)
+{
+	SEXPR p;
+	int *args;
+	int n, i;
+
+	if (p_eqp(spec, SEXPR_FALSE)) {
+		return;
+	}
+
+	n = s_record_types[type].nfields;
+	args = malloc((n > 0 ? n : 1) * sizeof(*args));
+	if (args == NULL) {
+		throw_err("out of heap space for records");
+	}
+	if (p_symbolp(spec)) {
+		for (i = 0; i < n; i++) {
+			args[i] = i;
+		}
+		define_record_proc(spec, n, n, &record_constructor, type, 0,
+				   args);
+		return;
+	}
+
+	if (!p_pairp(spec) || !p_symbolp(p_car(spec))) {
+		free(args);
+		bad_syntax();
+	}
+	n = 0;
+	for (p = p_cdr(spec); p_pairp(p); p = p_cdr(p)) {
+		i = field_index(fields, p_car(p));
+		if (i < 0 || n == s_record_types[type].nfields) {
+			free(args);
+			throw_err("define-record-type: constructor argument "
+				  "that is not a field");
+		}
+		args[n++] = i;
+	}
+	define_record_proc(p_car(spec), n, n, &record_constructor, type, 0,
+			   args);
+}
+
+/*
+ * (define-record-type name constructor predicate field-spec ...)
+ *
+ * Builtin special: the arguments, not evaluated, are in s_args.
+ */
+void define_record_type(void)
+{
+	SEXPR name, fields, spec;
+	int type, i;
+
+	if (!p_pairp(s_args) || !p_symbolp(p_car(s_args)) ||
+	    !p_pairp(p_cdr(s_args)) || !p_pairp(p_cdr(p_cdr(s_args))))
+	{
+		bad_syntax();
+	}
+	name = p_car(s_args);
+	fields = p_cdr(p_cdr(p_cdr(s_args)));
+	type = add_record_type(sexpr_name(name), check_fields(fields));
+
+	define_constructor(p_car(p_cdr(s_args)), fields, type);
+
+	spec = p_car(p_cdr(p_cdr(s_args)));
+	if (p_symbolp(spec)) {
+		define_record_proc(spec, 1, 1, &record_predicate, type, 0,
+				   NULL);
+	} else if (!p_eqp(spec, SEXPR_FALSE)) {
+		bad_syntax();
+	}
+
+	for (i = 0; p_pairp(fields); fields = p_cdr(fields), i++) {
+		spec = p_cdr(p_car(fields));
+		define_record_proc(p_car(spec), 1, 1, &record_accessor, type,
+				   i, NULL);
+		if (p_pairp(p_cdr(spec))) {
+			define_record_proc(p_car(p_cdr(spec)), 2, 2,
+					   &record_modifier, type, i, NULL);
+		}
+	}
+
+	s_val = make_vector_of_kind(VECTOR_RECORD_TYPE, 1, sizeof(SEXPR));
+	record_slots(s_val)[RECORD_TYPE_SLOT] = type;
+	s_expr = name;
+	define_variable();
+}
+
+void print_record(SEXPR r)
+{
+	int type;
+
+	type = record_slots(r)[RECORD_TYPE_SLOT];
+	chkrange(type, s_nrecord_types);
+	if (vector_kind(r) == VECTOR_RECORD_TYPE) {
+		printf("{record type %s}", s_record_types[type].name);
+	} else {
+		printf("{record %s}", s_record_types[type].name);
+	}
+}
@@ -0,0 +1,319 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#include "cells.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "cellmark.h"
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+
+/*
+ * Regions.
+ *
+ * (with-region body ...) evaluates body noting each cell and number made
+ * meanwhile. When it ends, the pairs and numbers of the result that were
+ * made in the region are copied out of it, and the rest of the region is
+ * put back on the free lists at once, without waiting for gc to trace
+ * anything.
+ *
+ * That is only safe if nothing made before the region refers to what was
+ * made in it. A write barrier checks each store done while the region is
+ * open (see region_store()): if something of the region is put in a cell
+ * from outside it, or in a vector or hash table, the region has escaped
+ * and is left to gc instead. So is it if it makes vectors, hash tables,
+ * frozen pairs, case tables or sites, that we cannot follow, or if its
+ * result holds procedures or promises made in it.
+ *
+ * Cells given back to the free list in the region by free_environment(),
+ * or by gc, are forgotten (see region_free_cell() and gc_region()). A
+ * nested with-region is part of the outer one.
+ */
+
+/* 1 while the body of a with-region runs */
+int s_in_region;
+
+static int s_region_depth;
+static int s_region_escaped;
+
+/* what was made in the region, and is still there */
+static unsigned char s_region_cells[NCELL];
+static unsigned char s_region_numbers[NCELL];
+
+/* the indices made in the region; some can have been forgotten since */
+struct region_log {
+	int *elems;
+	int n;
+	int capacity;
+};
+
+static struct region_log s_cell_log;
+static struct region_log s_number_log;
+
+/* Removes from pl the entries that are not set on flags anymore. */
+static void compact_log(struct region_log *pl, unsigned char *flags)
+{
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < pl->n; i++) {
+		if (flags[pl->elems[i]] == 1) {
+			/* a later entry for the same index is dropped */
+			flags[pl->elems[i]] = 2;
+			pl->elems[n++] = pl->elems[i];
+		}
+	}
+	for (i = 0; i < n; i++) {
+		flags[pl->elems[i]] = 1;
+	}
+	pl->n = n;
+}
+
+static void log_index(struct region_log *pl, unsigned char *flags, int i)
+{
+	int *p;
+	int n;
+
+	if (pl->n == pl->capacity) {
+		compact_log(pl, flags);
+	}
+	if (pl->n == pl->capacity) {
+		n = (pl->capacity == 0) ? 256 : pl->capacity * 2;
+		p = realloc(pl->elems, n * sizeof(*p));
+		if (p == NULL) {
+			throw_err("out of heap space for regions");
+		}
+		pl->elems = p;
+		pl->capacity = n;
+	}
+	pl->elems[pl->n++] = i;
+	flags[i] = 1;
+}
+
+void region_alloc_cell(int celli)
+{
+	log_index(&s_cell_log, s_region_cells, celli);
+}
+
+void region_alloc_number(int i)
+{
+	log_index(&s_number_log, s_region_numbers, i);
+}
+
+void region_free_cell(int celli)
+{
+	s_region_cells[celli] = 0;
+}
+
+/* Returns 1 if e was made in the open region. */
+static int in_region(SEXPR e)
+{
+	switch (sexpr_type(e)) {
+	case SEXPR_NUMBER:
+		return s_region_numbers[sexpr_index(e)];
+	case SEXPR_CONS:
+	case SEXPR_FUNCTION:
+	case SEXPR_SPECIAL:
+	case SEXPR_DYN_FUNCTION:
+	case SEXPR_PROMISE:
+	case SEXPR_WEAK_PAIR:
+		return s_region_cells[sexpr_index(e)];
+	default:
+		return 0;
+	}
+}
+
+/* The open region cannot be freed when it ends. */
+void region_escaped(void)
+{
+	s_region_escaped = 1;
+}
+
+/*
+ * The write barrier: val is being put in obj, a cell, vector or hash
+ * table.
+ */
+void region_store(SEXPR obj, SEXPR val)
+{
+	if (s_in_region && !s_region_escaped && in_region(val) &&
+	    !in_region(obj))
+	{
+		s_region_escaped = 1;
+	}
+}
+
+/* Called by gc after marking: forgets what gc is going to free. */
+void gc_region(void)
+{
+	int i, k;
+
+	for (i = 0; i < s_cell_log.n; i++) {
+		k = s_cell_log.elems[i];
+		if (s_region_cells[k] && !cell_marked(k)) {
+			s_region_cells[k] = 0;
+		}
+	}
+	for (i = 0; i < s_number_log.n; i++) {
+		k = s_number_log.elems[i];
+		if (s_region_numbers[k] && !number_marked(k)) {
+			s_region_numbers[k] = 0;
+		}
+	}
+	compact_log(&s_cell_log, s_region_cells);
+	compact_log(&s_number_log, s_region_numbers);
+}
+
+/* Forgets the region, leaving what it made to gc. */
+static void forget_region(void)
+{
+	int i;
+
+	for (i = 0; i < s_cell_log.n; i++) {
+		s_region_cells[s_cell_log.elems[i]] = 0;
+	}
+	for (i = 0; i < s_number_log.n; i++) {
+		s_region_numbers[s_number_log.elems[i]] = 0;
+	}
+	s_cell_log.n = 0;
+	s_number_log.n = 0;
+}
+
+/* Called when an error stops the evaluation. */
+void region_abandon(void)
+{
+	forget_region();
+	s_in_region = 0;
+	s_region_depth = 0;
+	s_region_escaped = 0;
+}
+
+/* Puts on the free lists what is left of the region. */
+static void free_region(void)
+{
+	int i, k;
+
+	for (i = 0; i < s_cell_log.n; i++) {
+		k = s_cell_log.elems[i];
+		if (s_region_cells[k]) {
+			s_region_cells[k] = 0;
+			free_cell(k);
+		}
+	}
+	for (i = 0; i < s_number_log.n; i++) {
+		k = s_number_log.elems[i];
+		if (s_region_numbers[k]) {
+			s_region_numbers[k] = 0;
+			free_number(k);
+		}
+	}
+	s_cell_log.n = 0;
+	s_number_log.n = 0;
+}
+
+/* the pairs copy_out() can still copy: more means a cycle */
+static int s_copy_budget;
+
+/*
+ * Returns e with its pairs and numbers made in the region copied out of
+ * it, or sets s_region_escaped if it cannot. The region is not open, so
+ * the copies are not in it.
+ */
+static SEXPR copy_out(SEXPR e)
+{
+	struct number n;
+	SEXPR *ps, pair;
+
+	if (s_region_escaped || !in_region(e)) {
+		return e;
+	} else if (p_numberp(e)) {
+		copy_number(sexpr_number(e), &n);
+		return make_number(&n);
+	} else if (!p_pairp(e)) {
+		s_region_escaped = 1;
+		return e;
+	}
+
+	/* the list, its copy and the last pair of the copy */
+	push(e);
+	push(SEXPR_NIL);
+	push(SEXPR_NIL);
+	ps = stack_top(3);
+	while (p_pairp(e) && in_region(e) && !s_region_escaped) {
+		if (--s_copy_budget < 0) {
+			s_region_escaped = 1;
+			break;
+		}
+		pair = p_cons(copy_out(p_car(e)), SEXPR_NIL);
+		if (p_nullp(ps[1])) {
+			ps[1] = pair;
+		} else {
+			p_setcdr(ps[2], pair);
+		}
+		ps[2] = pair;
+		e = p_cdr(e);
+	}
+	if (!s_region_escaped) {
+		p_setcdr(ps[2], copy_out(e));
+	}
+	e = ps[1];
+	popn(3);
+
+	return e;
+}
+
+/*
+ * (with-region body ...)
+ *
+ * Builtin special: the body, not evaluated, is in s_args.
+ */
+void with_region(void)
+{
+	SEXPR copy;
+
+	if (s_region_depth > 0) {
+		s_region_depth++;
+		s_val = SEXPR_NIL;
+		s_unev = s_args;
+		p_evseq(1);
+		s_region_depth--;
+		return;
+	}
+
+	s_region_depth = 1;
+	s_region_escaped = 0;
+	s_in_region = 1;
+	push(s_env);
+	s_val = SEXPR_NIL;
+	s_unev = s_args;
+	p_evseq(1);
+	s_env = pop();
+	s_in_region = 0;
+	s_region_depth = 0;
+
+	s_copy_budget = s_cell_log.n;
+	copy = copy_out(s_val);
+	if (s_region_escaped) {
+		forget_region();
+		return;
+	}
+
+	/* nothing can refer to the region now but our registers */
+	s_val = copy;
+	s_expr = SEXPR_NIL;
+	s_proc = SEXPR_NIL;
+	s_unev = SEXPR_NIL;
+	s_newframe = SEXPR_NIL;
+	free_region();
+}
@@ -22,6 +22,14 @@
  * SEXPR_NUMBER: bits(28..0) is index of number.
  * SEXPR_SYMBOL: bits(28..0) is index to a cell whose car is the pointer
  *                to the struct literal (the cdr we don't care).
+ * SEXPR_PROMISE: bits(28..0) is index into cells: (expr . env) until it is
+ *                forced, then (value . #t).
+ * SEXPR_VECTOR: bits(28..0) is index into the table of vectors, whose
+ *               elements are kept out of the cells (see vectors.c).
+ * SEXPR_HASHTABLE: bits(28..0) is index into the table of hash tables (see
+ *                  hashtab.c).
+ * SEXPR_WEAK_PAIR: bits(28..0) is index into cells, whose car gc does not
+ *                  keep alive (see gc_weak()).
  *
  * All the code uses SEXPRs through the functions and macros here listed.
  * They don't mess with the bits directly.
@@ -50,6 +58,10 @@ enum {
 	SEXPR_FUNCTION = 8 << SHIFT_SEXPR,
 	SEXPR_SPECIAL = 9 << SHIFT_SEXPR,
 	SEXPR_DYN_FUNCTION = 10 << SHIFT_SEXPR,
+	SEXPR_PROMISE = 11 << SHIFT_SEXPR,
+	SEXPR_VECTOR = 12 << SHIFT_SEXPR,
+	SEXPR_HASHTABLE = 13 << SHIFT_SEXPR,
+	SEXPR_WEAK_PAIR = 14 << SHIFT_SEXPR,
 };
 
 #define sexpr_type(e) ((e) & TYPE_MASK_SEXPR)
@@ -72,6 +84,18 @@ enum {
 #define make_special(args_n_body_celli) \
 	(SEXPR_SPECIAL | (args_n_body_celli))
 
+#define make_promise(expr_n_env_celli) \
+	(SEXPR_PROMISE | (expr_n_env_celli))
+
+#define make_vector_sexpr(vectori) \
+	(SEXPR_VECTOR | (vectori))
+
+#define make_hashtable_sexpr(tablei) \
+	(SEXPR_HASHTABLE | (tablei))
+
+#define make_weak_pair(celli) \
+	(SEXPR_WEAK_PAIR | (celli))
+
 struct number;
 
 struct number *sexpr_number(SEXPR e);
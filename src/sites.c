@@ -0,0 +1,338 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "cells.h"
+#include "cellmark.h"
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Type feedback on the calls to arithmetic, comparisons, car and cdr.
+ *
+ * When a procedure body is folded (see fold.c), each call to one of those
+ * builtins that is left is replaced by
+ *
+ *     (%site index call)
+ *
+ * index being the entry of the site on s_sites. The site evaluates the
+ * arguments itself and records their kinds for its first SITE_WARMUP runs.
+ * If they were all reals (or all pairs for car and cdr), the site is then
+ * specialized: it computes the result directly, after checking the kinds
+ * of the arguments. The first time the check fails the site goes back to
+ * calling the builtin, for good.
+ *
+ * As with %fold, the global binding of the builtin is the guard: if its name
+ * is redefined the site evaluates call.
+ *
+ * The calls whose arguments are known to be of the right kind, because of
+ * a declare at the start of the procedure, are computed directly from the
+ * start, with no checks. If one of those arguments is another such site,
+ * the call is specialized from the start but keeps its checks: that site
+ * evaluates its call as written if its builtin is redefined, and that can
+ * give anything.
+ *
+ * The entries of the sites collected by gc are freed (see gc_sites()).
+ */
+
+enum { SITE_WARMUP = 16 };
+
+enum {
+	SITE_PROFILING,
+	SITE_SPECIALIZED,
+	SITE_GENERIC,
+	/* the kinds of the arguments are declared: no checks */
+	SITE_DECLARED,
+};
+
+struct site {
+	/* the %site form, () if the entry is free */
+	SEXPR form;
+	SEXPR bind;
+	SEXPR builtin;
+	int op;
+	int state;
+	int count;
+	unsigned int kinds;
+};
+
+static struct site *s_sites;
+static int s_nsites;
+static int s_sites_capacity;
+
+static int new_site(void)
+{
+	struct site *ps;
+	int i, n;
+
+	for (i = 0; i < s_nsites; i++) {
+		if (p_nullp(s_sites[i].form)) {
+			return i;
+		}
+	}
+
+	if (s_nsites == s_sites_capacity) {
+		n = (s_sites_capacity == 0) ? 64 : s_sites_capacity * 2;
+		ps = realloc(s_sites, n * sizeof(*ps));
+		if (ps == NULL) {
+			throw_err("out of heap space for call sites");
+		}
+		s_sites = ps;
+		s_sites_capacity = n;
+	}
+	s_sites[s_nsites].form = SEXPR_NIL;
+
+	return s_nsites++;
+}
+
+/* Returns the KIND_ of e. */
+int site_kind(SEXPR e)
+{
+	if (p_pairp(e)) {
+		return KIND_PAIR;
+	} else if (p_numberp(e) && number_flonum(sexpr_number(e))) {
+		return KIND_FLONUM;
+	}
+
+	return KIND_OTHER;
+}
+
+/* Returns the KIND_ named by the symbol type on a declare, or 0. */
+int declared_kind(SEXPR type)
+{
+	if (p_symbolp(type)) {
+		if (strcmp(sexpr_name(type), "flonum") == 0) {
+			return KIND_FLONUM;
+		} else if (strcmp(sexpr_name(type), "pair") == 0) {
+			return KIND_PAIR;
+		}
+	}
+
+	return 0;
+}
+
+/* The KIND_ its arguments must have for op to be computed directly. */
+static int site_arg_kind(int op)
+{
+	return (op == SITE_CAR || op == SITE_CDR) ? KIND_PAIR : KIND_FLONUM;
+}
+
+/*
+ * Returns the %site form for call, a call to the builtin bound on bind, or
+ * () if the calls to the builtin are not profiled. kind is the KIND_ that
+ * all the arguments are known to have, or 0.
+ */
+SEXPR make_site(SEXPR bind, SEXPR call, int kind)
+{
+	struct number n;
+	struct site *ps;
+	SEXPR p;
+	int i, op, argc, nested;
+
+	op = builtin_site_op(sexpr_index(p_cdr(bind)));
+	if (op < 0) {
+		return SEXPR_NIL;
+	}
+	if (s_in_region) {
+		region_escaped();
+	}
+
+	argc = 0;
+	nested = 0;
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		if (p_pairp(p_car(p)) && p_eqp(p_car(p_car(p)), s_site_atom)) {
+			nested = 1;
+		}
+		argc++;
+	}
+	if (!p_nullp(p) ||
+	    argc != ((op == SITE_CAR || op == SITE_CDR) ? 1 : 2))
+	{
+		return SEXPR_NIL;
+	}
+
+	i = new_site();
+	build_real_number(&n, i);
+	push(p_cons(call, SEXPR_NIL));
+	*stack_top(1) = p_cons(make_number(&n), *stack_top(1));
+	p = p_cons(s_site_atom, *stack_top(1));
+	pop();
+
+	ps = &s_sites[i];
+	ps->form = p;
+	ps->bind = bind;
+	ps->builtin = p_cdr(bind);
+	ps->op = op;
+	if (kind != site_arg_kind(op)) {
+		ps->state = SITE_PROFILING;
+	} else {
+		ps->state = nested ? SITE_SPECIALIZED : SITE_DECLARED;
+	}
+	ps->count = 0;
+	ps->kinds = 0;
+
+	return p;
+}
+
+
+/*
+ * Computes op on the arguments on argv, if they are of the kind the site
+ * was specialized for, or without checking it if check is 0. Returns 0 if
+ * they are not.
+ */
+static int run_specialized(int op, SEXPR *argv, int check)
+{
+	struct number n;
+	real_t x, y;
+
+	if (op == SITE_CAR || op == SITE_CDR) {
+		if (check && !p_pairp(argv[0])) {
+			return 0;
+		}
+		s_val = (op == SITE_CAR) ? cell_car(sexpr_index(argv[0])) :
+					   cell_cdr(sexpr_index(argv[0]));
+		return 1;
+	}
+
+	if (check && (site_kind(argv[0]) != KIND_FLONUM ||
+		      site_kind(argv[1]) != KIND_FLONUM))
+	{
+		return 0;
+	}
+	x = number_real_value(sexpr_number(argv[0]));
+	y = number_real_value(sexpr_number(argv[1]));
+
+	switch (op) {
+	case SITE_ADD: build_real_number(&n, x + y); break;
+	case SITE_SUB: build_real_number(&n, x - y); break;
+	case SITE_MUL: build_real_number(&n, x * y); break;
+	case SITE_DIV: build_real_number(&n, x / y); break;
+	case SITE_EQ: s_val = (x == y) ? SEXPR_TRUE : SEXPR_FALSE; return 1;
+	case SITE_LT: s_val = (x < y) ? SEXPR_TRUE : SEXPR_FALSE; return 1;
+	case SITE_GT: s_val = (x > y) ? SEXPR_TRUE : SEXPR_FALSE; return 1;
+	case SITE_LE: s_val = (x <= y) ? SEXPR_TRUE : SEXPR_FALSE; return 1;
+	default: s_val = (x >= y) ? SEXPR_TRUE : SEXPR_FALSE; return 1;
+	}
+
+	s_val = make_number(&n);
+	return 1;
+}
+
+/* Calls the builtin of site i, recording the kinds of the arguments. */
+static void run_generic(int i, int argc, SEXPR *argv)
+{
+	struct site *ps;
+	int k;
+
+	ps = &s_sites[i];
+	if (ps->state == SITE_PROFILING) {
+		for (k = 0; k < argc; k++) {
+			ps->kinds |= site_kind(argv[k]);
+		}
+		if (++ps->count == SITE_WARMUP) {
+			ps->state = (ps->kinds == site_arg_kind(ps->op)) ?
+					SITE_SPECIALIZED : SITE_GENERIC;
+		}
+	} else {
+		ps->state = SITE_GENERIC;
+	}
+
+	apply_builtin_function(sexpr_index(ps->builtin), argc, argv);
+}
+
+/* Evaluates the argument e on *penv. */
+static SEXPR eval_arg(SEXPR e, SEXPR *penv)
+{
+	SEXPR bind;
+
+	if (p_numberp(e) || p_eqp(e, SEXPR_TRUE) || p_eqp(e, SEXPR_FALSE)) {
+		return e;
+	} else if (p_symbolp(e)) {
+		bind = lookup_variable(e, *penv);
+		if (p_nullp(bind)) {
+			throw_err("variable not bound");
+		}
+		return p_cdr(bind);
+	}
+
+	s_expr = e;
+	s_env = *penv;
+	p_eval();
+	return s_val;
+}
+
+/* (%site index call), made by make_site(). */
+void site_special(void)
+{
+	SEXPR call, p, *penv;
+	int i, argc;
+
+	i = (int) number_real_value(sexpr_number(p_car(s_args)));
+	call = p_car(p_cdr(s_args));
+	chkrange(i, s_nsites);
+	if (!p_eqp(p_cdr(s_sites[i].bind), s_sites[i].builtin)) {
+		s_val = call;
+		s_tailrec = 1;
+		return;
+	}
+
+	push(call);
+	push(s_env);
+	penv = stack_top(1);
+	argc = 0;
+	for (p = p_cdr(call); p_pairp(p); p = p_cdr(p)) {
+		push(eval_arg(p_car(p), penv));
+		argc++;
+	}
+	s_env = *penv;
+
+	if (s_sites[i].state == SITE_DECLARED) {
+		run_specialized(s_sites[i].op, stack_top(argc), 0);
+	} else if (s_sites[i].state != SITE_SPECIALIZED ||
+		   !run_specialized(s_sites[i].op, stack_top(argc), 1))
+	{
+		run_generic(i, argc, stack_top(argc));
+	}
+	popn(argc + 2);
+}
+
+/* Returns 1 if e is a %site whose value is known to be a real. */
+int site_flonum(SEXPR e)
+{
+	struct site *ps;
+
+	if (!p_pairp(e) || !p_eqp(p_car(e), s_site_atom)) {
+		return 0;
+	}
+
+	ps = &s_sites[(int) number_real_value(sexpr_number(p_car(p_cdr(e))))];
+	return ps->state == SITE_DECLARED && ps->op <= SITE_DIV;
+}
+
+/* Called by gc after marking: frees the entries of the sites not marked. */
+void gc_sites(void)
+{
+	int i;
+
+	for (i = 0; i < s_nsites; i++) {
+		if (!p_nullp(s_sites[i].form) &&
+		    !cell_marked(sexpr_index(s_sites[i].form)))
+		{
+			s_sites[i].form = SEXPR_NIL;
+		}
+	}
+}
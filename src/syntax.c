@@ -0,0 +1,355 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Pattern matching and template expansion for syntax-rules.
+ *
+ * A macro made by (syntax-rules (literal ...) (pattern template) ...) is a
+ * special that calls syntax_expand() with the literals and rules, and the
+ * list of its arguments. As with any special, its expansion replaces the
+ * form where it is used, so it is expanded once.
+ *
+ * Macros are not hygienic: the symbols on the templates are inserted as
+ * they are.
+ *
+ * The pattern variables are bound on a list of (var . tval). A tval is
+ * (() . form) for a variable that is not followed by an ellipsis, or
+ * (#t tval ...) for one that is, with a tval for each repetition.
+ *
+ * All the lists built here are kept on the stack while we work, so they are
+ * not collected.
+ */
+
+static int symbol_named(SEXPR e, const char *name)
+{
+	return p_symbolp(e) && strcmp(sexpr_name(e), name) == 0;
+}
+
+static int is_ellipsis(SEXPR e)
+{
+	return symbol_named(e, "...");
+}
+
+/* True if pat is (p ... . rest). */
+static int followed_by_ellipsis(SEXPR pat)
+{
+	return p_pairp(p_cdr(pat)) && is_ellipsis(p_car(p_cdr(pat)));
+}
+
+static int is_literal(SEXPR sym, SEXPR lits)
+{
+	while (p_pairp(lits)) {
+		if (p_eqp(sym, p_car(lits))) {
+			return 1;
+		}
+		lits = p_cdr(lits);
+	}
+
+	return 0;
+}
+
+/* Number of pairs on the list p, which can be improper. */
+static int npairs(SEXPR p)
+{
+	int n;
+
+	for (n = 0; p_pairp(p); n++) {
+		p = p_cdr(p);
+	}
+
+	return n;
+}
+
+static SEXPR lookup_binding(SEXPR var, SEXPR b)
+{
+	while (!p_nullp(b)) {
+		if (p_eqp(var, p_car(p_car(b)))) {
+			return p_car(b);
+		}
+		b = p_cdr(b);
+	}
+
+	return SEXPR_NIL;
+}
+
+/* Adds (var . tval) to the bindings on *pb. */
+static void add_binding(SEXPR var, SEXPR tval, SEXPR *pb)
+{
+	*pb = p_cons(p_cons(var, tval), *pb);
+}
+
+/* Adds to *pvars the pattern variables on pat. */
+static void pattern_vars(SEXPR pat, SEXPR lits, SEXPR *pvars)
+{
+	while (p_pairp(pat)) {
+		pattern_vars(p_car(pat), lits, pvars);
+		pat = p_cdr(pat);
+	}
+
+	if (p_symbolp(pat) && !is_ellipsis(pat) && !symbol_named(pat, "_") &&
+	    !is_literal(pat, lits))
+	{
+		*pvars = p_cons(pat, *pvars);
+	}
+}
+
+static SEXPR reverse_list(SEXPR p)
+{
+	SEXPR r, next;
+
+	r = SEXPR_NIL;
+	while (p_pairp(p)) {
+		next = p_cdr(p);
+		p_setcdr(p, r);
+		r = p;
+		p = next;
+	}
+
+	return r;
+}
+
+static int match(SEXPR pat, SEXPR form, SEXPR lits, SEXPR *pb);
+
+/*
+ * Matches (p ... . rest) with form. Each element matched by p gives a set
+ * of bindings; the tvals of each variable in p are collected in accs, a
+ * list of (var #t tval ...).
+ */
+static int match_ellipsis(SEXPR pat, SEXPR form, SEXPR lits, SEXPR *pb)
+{
+	SEXPR p, acc, *pvars, *paccs, *psub;
+	int nrep;
+
+	p = p_car(pat);
+	pat = p_cdr(p_cdr(pat));
+	nrep = npairs(form) - npairs(pat);
+	if (nrep < 0) {
+		return 0;
+	}
+
+	push(SEXPR_NIL);
+	pvars = stack_top(1);
+	pattern_vars(p, lits, pvars);
+	push(SEXPR_NIL);
+	paccs = stack_top(1);
+	for (acc = *pvars; p_pairp(acc); acc = p_cdr(acc)) {
+		*paccs = p_cons(p_cons(p_car(acc), SEXPR_NIL), *paccs);
+	}
+
+	push(form);
+	push(SEXPR_NIL);
+	psub = stack_top(1);
+	while (nrep-- > 0) {
+		*psub = SEXPR_NIL;
+		if (!match(p, p_car(form), lits, psub)) {
+			popn(4);
+			return 0;
+		}
+		for (acc = *paccs; p_pairp(acc); acc = p_cdr(acc)) {
+			p_setcdr(p_car(acc),
+				 p_cons(p_cdr(lookup_binding(p_car(p_car(acc)),
+							     *psub)),
+					p_cdr(p_car(acc))));
+		}
+		form = p_cdr(form);
+	}
+
+	for (acc = *paccs; p_pairp(acc); acc = p_cdr(acc)) {
+		add_binding(p_car(p_car(acc)),
+			    p_cons(SEXPR_TRUE, reverse_list(p_cdr(p_car(acc)))),
+			    pb);
+	}
+	popn(4);
+
+	return match(pat, form, lits, pb);
+}
+
+/* Returns 1 if form matches the pattern pat, adding the pattern variables
+ * to the bindings on *pb, which must be protected from gc.
+ */
+static int match(SEXPR pat, SEXPR form, SEXPR lits, SEXPR *pb)
+{
+	for (;;) {
+		if (p_symbolp(pat)) {
+			if (symbol_named(pat, "_")) {
+				return 1;
+			} else if (is_literal(pat, lits)) {
+				return p_eqp(pat, form);
+			}
+			push(form);
+			add_binding(pat, p_cons(SEXPR_NIL, form), pb);
+			pop();
+			return 1;
+		} else if (p_pairp(pat)) {
+			if (followed_by_ellipsis(pat)) {
+				return match_ellipsis(pat, form, lits, pb);
+			} else if (!p_pairp(form)) {
+				return 0;
+			} else if (!match(p_car(pat), p_car(form), lits, pb)) {
+				return 0;
+			}
+			pat = p_cdr(pat);
+			form = p_cdr(form);
+		} else if (p_nullp(pat)) {
+			return p_nullp(form);
+		} else {
+			return p_equalp(pat, form);
+		}
+	}
+}
+
+/* Adds to *pvars the variables on the template tmpl that have been bound
+ * to a sequence.
+ */
+static void sequence_vars(SEXPR tmpl, SEXPR b, SEXPR *pvars)
+{
+	SEXPR bind;
+
+	while (p_pairp(tmpl)) {
+		sequence_vars(p_car(tmpl), b, pvars);
+		tmpl = p_cdr(tmpl);
+	}
+
+	if (p_symbolp(tmpl)) {
+		bind = lookup_binding(tmpl, b);
+		if (!p_nullp(bind) && !p_nullp(p_car(p_cdr(bind)))) {
+			*pvars = p_cons(tmpl, *pvars);
+		}
+	}
+}
+
+static SEXPR expand(SEXPR tmpl, SEXPR b);
+
+/*
+ * Expands (sub ... . rest): sub is expanded once for each tval of the
+ * sequence variables in it, binding each variable to its next tval.
+ * Returns the list of expansions, followed by the expansion of rest.
+ */
+static SEXPR expand_ellipsis(SEXPR tmpl, SEXPR b)
+{
+	SEXPR sub, p, *pvars, *pseqs, *pb, *phead, *pnode;
+
+	sub = p_car(tmpl);
+	push(SEXPR_NIL);
+	pvars = stack_top(1);
+	sequence_vars(sub, b, pvars);
+	if (p_nullp(*pvars)) {
+		throw_err("syntax-rules: no pattern variable before ...");
+	}
+
+	/* the remaining tvals of each variable, in the same order */
+	push(SEXPR_NIL);
+	pseqs = stack_top(1);
+	for (p = *pvars; p_pairp(p); p = p_cdr(p)) {
+		*pseqs = p_cons(p_cdr(p_cdr(lookup_binding(p_car(p), b))),
+				*pseqs);
+	}
+	*pseqs = reverse_list(*pseqs);
+
+	push(SEXPR_NIL);
+	pb = stack_top(1);
+	push(SEXPR_NIL);
+	phead = stack_top(1);
+	push(SEXPR_NIL);
+	pnode = stack_top(1);
+	while (p_pairp(p_car(*pseqs))) {
+		*pb = b;
+		for (p = *pvars, sub = *pseqs; p_pairp(p);
+		     p = p_cdr(p), sub = p_cdr(sub))
+		{
+			if (!p_pairp(p_car(sub))) {
+				throw_err("syntax-rules: sequences of "
+					  "different length");
+			}
+			add_binding(p_car(p), p_car(p_car(sub)), pb);
+			p_setcar(sub, p_cdr(p_car(sub)));
+		}
+		p = p_cons(expand(p_car(tmpl), *pb), SEXPR_NIL);
+		if (p_nullp(*phead)) {
+			*phead = p;
+		} else {
+			p_setcdr(*pnode, p);
+		}
+		*pnode = p;
+	}
+
+	p = expand(p_cdr(p_cdr(tmpl)), b);
+	if (p_nullp(*phead)) {
+		*phead = p;
+	} else {
+		p_setcdr(*pnode, p);
+	}
+	p = *phead;
+	popn(5);
+	return p;
+}
+
+/* Expands the template tmpl with the bindings b, which must be protected
+ * from gc.
+ */
+static SEXPR expand(SEXPR tmpl, SEXPR b)
+{
+	SEXPR bind, a;
+
+	if (p_symbolp(tmpl)) {
+		bind = lookup_binding(tmpl, b);
+		if (p_nullp(bind)) {
+			return tmpl;
+		} else if (!p_nullp(p_car(p_cdr(bind)))) {
+			throw_err("syntax-rules: pattern variable "
+				  "used without ...");
+		}
+		return p_cdr(p_cdr(bind));
+	} else if (p_pairp(tmpl)) {
+		if (is_ellipsis(p_car(tmpl)) && p_pairp(p_cdr(tmpl))) {
+			/* (... template) escapes the ellipsis */
+			return p_car(p_cdr(tmpl));
+		} else if (followed_by_ellipsis(tmpl)) {
+			return expand_ellipsis(tmpl, b);
+		}
+		a = push(expand(p_car(tmpl), b));
+		a = p_cons(a, expand(p_cdr(tmpl), b));
+		pop();
+		return a;
+	}
+
+	return tmpl;
+}
+
+/*
+ * rules is (literals (pattern template) ...), args the arguments of the
+ * macro. The first element of a pattern, that stands for the keyword, is
+ * ignored.
+ * Returns the expansion of the template of the first pattern that matches.
+ */
+SEXPR syntax_expand(SEXPR rules, SEXPR args)
+{
+	SEXPR lits, rule, e, *pb;
+
+	lits = p_car(rules);
+	push(SEXPR_NIL);
+	pb = stack_top(1);
+	for (rules = p_cdr(rules); p_pairp(rules); rules = p_cdr(rules)) {
+		rule = p_car(rules);
+		*pb = SEXPR_NIL;
+		if (match(p_cdr(p_car(rule)), args, lits, pb)) {
+			e = expand(p_car(p_cdr(rule)), *pb);
+			pop();
+			return e;
+		}
+	}
+
+	throw_err("syntax-rules: no pattern matches");
+	return SEXPR_NIL;
+}
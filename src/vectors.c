@@ -0,0 +1,430 @@
+/* ===========================================================================
+ * lispe, Scheme interpreter.
+ * ===========================================================================
+ */
+
+#include "cfg.h"
+#include "cbase.h"
+#include "gc.h"
+#ifndef SEXPR_H
+#include "sexpr.h"
+#endif
+#include "numbers.h"
+#include "common.h"
+#include "err.h"
+#include <assert.h>
+#ifndef STDIO_H
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+
+/*
+ * Vectors.
+ *
+ * A vector is an entry of s_vectors, whose elements are a block allocated
+ * apart from the cells, so indexing is O(1). The elements of a
+ * VECTOR_GENERAL are SEXPRs; the numeric vectors of numvec.c hold unboxed
+ * values. The entries not marked by gc are put on a free list and their
+ * blocks freed (see gc_vectors()).
+ *
+ * The blocks allocated count for gc as well as the cells: when
+ * VECTOR_GC_BYTES have been allocated since the last gc, the next
+ * allocation runs gc first.
+ */
+
+enum { VECTOR_GC_BYTES = 1 << 18 };
+
+struct vector {
+	/* -1 if the entry is free */
+	int length;
+	int kind;
+	int marked;
+	/* the next free entry, if this one is free */
+	int next;
+	void *data;
+};
+
+static struct vector *s_vectors;
+static int s_nvectors;
+static int s_free_vectors = -1;
+static size_t s_vector_bytes_allocated;
+
+static int pop_free_vector(void)
+{
+	struct vector *pv;
+	int i, n;
+
+	if (s_free_vectors >= 0) {
+		i = s_free_vectors;
+		s_free_vectors = s_vectors[i].next;
+		return i;
+	}
+
+	n = (s_nvectors == 0) ? 256 : s_nvectors * 2;
+	if (n > INDEX_MASK_SEXPR) {
+		throw_err("out of vectors");
+	}
+	pv = realloc(s_vectors, n * sizeof(*pv));
+	if (pv == NULL) {
+		throw_err("out of heap space for vectors");
+	}
+	s_vectors = pv;
+	for (i = n - 1; i >= s_nvectors; i--) {
+		s_vectors[i].length = -1;
+		s_vectors[i].marked = 0;
+		s_vectors[i].data = NULL;
+		s_vectors[i].next = s_free_vectors;
+		s_free_vectors = i;
+	}
+	s_nvectors = n;
+
+	return pop_free_vector();
+}
+
+static struct vector *get_vector(SEXPR v)
+{
+	assert(sexpr_type(v) == SEXPR_VECTOR);
+	chkrange(sexpr_index(v), s_nvectors);
+	return &s_vectors[sexpr_index(v)];
+}
+
+/* Runs gc if VECTOR_GC_BYTES have been allocated since the last one. */
+void vectors_gc_check(void)
+{
+	if (s_vector_bytes_allocated > VECTOR_GC_BYTES) {
+		printf("[gc: need vectors]\n");
+		p_gc();
+	}
+}
+
+/*
+ * Returns a new vector of kind, with n elements of elem_size bytes, not
+ * initialized. Never runs gc: for code that makes many vectors holding
+ * others, that calls vectors_gc_check() when nothing is unprotected.
+ */
+SEXPR alloc_vector_of_kind(int kind, int n, int elem_size)
+{
+	struct vector *pv;
+	void *data;
+	size_t size;
+	int i;
+
+	if (n < 0) {
+		throw_err("negative length for vector");
+	}
+	if (s_in_region) {
+		region_escaped();
+	}
+
+	size = (size_t) n * elem_size;
+	data = malloc(size > 0 ? size : 1);
+	if (data == NULL) {
+		throw_err("out of heap space for vectors");
+	}
+	s_vector_bytes_allocated += size;
+
+	i = pop_free_vector();
+	pv = &s_vectors[i];
+	pv->length = n;
+	pv->kind = kind;
+	pv->marked = 0;
+	pv->data = data;
+
+	return make_vector_sexpr(i);
+}
+
+/* As alloc_vector_of_kind(), but can run gc first. */
+SEXPR make_vector_of_kind(int kind, int n, int elem_size)
+{
+	if (n > 0 && s_vector_bytes_allocated + (size_t) n * elem_size >
+		     VECTOR_GC_BYTES)
+	{
+		printf("[gc: need vectors]\n");
+		p_gc();
+	}
+
+	return alloc_vector_of_kind(kind, n, elem_size);
+}
+
+/*
+ * Returns a new vector of n elements, all fill. Can run gc: fill must be
+ * protected by the caller.
+ */
+SEXPR make_vector(int n, SEXPR fill)
+{
+	SEXPR v, *elems;
+	int i;
+
+	v = make_vector_of_kind(VECTOR_GENERAL, n, sizeof(SEXPR));
+	elems = vector_elems(v);
+	for (i = 0; i < n; i++) {
+		elems[i] = fill;
+	}
+
+	return v;
+}
+
+int vector_size(SEXPR v)
+{
+	return get_vector(v)->length;
+}
+
+int vector_kind(SEXPR v)
+{
+	return get_vector(v)->kind;
+}
+
+/*
+ * Returns the elements of v, of any kind. The pointer is valid as long as
+ * v is not collected.
+ */
+void *vector_data(SEXPR v)
+{
+	return get_vector(v)->data;
+}
+
+/*
+ * Returns the index of the first element of v that gc must mark: the
+ * elements before it, if any, are not SEXPRs.
+ */
+int vector_sexprs_start(SEXPR v)
+{
+	switch (vector_kind(v)) {
+	case VECTOR_GENERAL:
+		return 0;
+	case VECTOR_F64:
+	case VECTOR_S64:
+		return vector_size(v);
+	case VECTOR_RECORD:
+	case VECTOR_RECORD_TYPE:
+		/* the index of the type */
+		return 1;
+	default:
+		return persistent_raw_slots(vector_kind(v));
+	}
+}
+
+/* Returns the elements of the VECTOR_GENERAL v, as vector_data(). */
+SEXPR *vector_elems(SEXPR v)
+{
+	assert(vector_kind(v) == VECTOR_GENERAL);
+	return get_vector(v)->data;
+}
+
+/* Returns a new vector with the elements of the proper list p. */
+SEXPR make_vector_from_list(SEXPR p)
+{
+	SEXPR q, v, *elems;
+	int n, i;
+
+	n = 0;
+	for (q = p; p_pairp(q); q = p_cdr(q)) {
+		n++;
+	}
+	if (!p_nullp(q)) {
+		throw_err("vector made from something that is not a list");
+	}
+
+	push(p);
+	v = make_vector(n, SEXPR_NIL);
+	p = pop();
+
+	elems = vector_elems(v);
+	for (i = 0; i < n; i++) {
+		elems[i] = p_car(p);
+		p = p_cdr(p);
+	}
+
+	return v;
+}
+
+/* Marks vector i. Returns 1 if it was not marked. */
+int if_vector_mark(int i)
+{
+	chkrange(i, s_nvectors);
+	if (s_vectors[i].marked) {
+		return 0;
+	}
+	s_vectors[i].marked = 1;
+	return 1;
+}
+
+int vector_marked(int i)
+{
+	chkrange(i, s_nvectors);
+	return s_vectors[i].marked;
+}
+
+/* Called by gc after marking: frees the vectors not marked. */
+void gc_vectors(void)
+{
+	int i, nmarked;
+
+	nmarked = 0;
+	for (i = 0; i < s_nvectors; i++) {
+		if (s_vectors[i].marked) {
+			s_vectors[i].marked = 0;
+			nmarked++;
+		} else if (s_vectors[i].length >= 0) {
+			free(s_vectors[i].data);
+			s_vectors[i].data = NULL;
+			s_vectors[i].length = -1;
+			s_vectors[i].next = s_free_vectors;
+			s_free_vectors = i;
+		}
+	}
+	s_vector_bytes_allocated = 0;
+
+	if (s_nvectors > 0) {
+		printf("[gc: %d/%d vectors]\n", nmarked, s_nvectors);
+	}
+}
+
+/************************************************************/
+/* builtin functions                                        */
+/************************************************************/
+
+static SEXPR vector_arg(SEXPR e)
+{
+	if (!p_vectorp(e)) {
+		throw_err("vector procedure used on something not a vector");
+	}
+
+	return e;
+}
+
+/*
+ * Returns the index e of a vector of length n, between 0 and n - 1, or n
+ * too if end is set.
+ */
+int vector_index_arg(SEXPR e, int n, int end)
+{
+	struct number *pn;
+	real_t r;
+
+	if (!p_numberp(e)) {
+		throw_err("bad index for vector: not a number");
+	}
+	pn = sexpr_number(e);
+	if (!number_integer(pn)) {
+		throw_err("bad index for vector: not an integer");
+	}
+	r = number_real_value(pn);
+	if (r < 0 || r > n || (r == n && !end)) {
+		throw_err("bad index for vector: out of range");
+	}
+
+	return (int) r;
+}
+
+/* Reads the optional start and end arguments at argv[k] and argv[k + 1]. */
+static void range_args(int argc, SEXPR *argv, int k, int n,
+		       int *pstart, int *pend)
+{
+	*pstart = (argc > k) ? vector_index_arg(argv[k], n, 1) : 0;
+	*pend = (argc > k + 1) ? vector_index_arg(argv[k + 1], n, 1) : n;
+	if (*pstart > *pend) {
+		throw_err("bad range for vector: start after end");
+	}
+}
+
+void vectorp(int argc, SEXPR *argv)
+{
+	s_val = p_vectorp(argv[0]) ? SEXPR_TRUE : SEXPR_FALSE;
+}
+
+/* (make-vector k [fill]) */
+void make_vector_fn(int argc, SEXPR *argv)
+{
+	struct number *pn;
+
+	if (!p_numberp(argv[0])) {
+		throw_err("make-vector: length is not a number");
+	}
+	pn = sexpr_number(argv[0]);
+	if (!number_integer(pn) || number_real_value(pn) < 0 ||
+	    number_real_value(pn) > INDEX_MASK_SEXPR)
+	{
+		throw_err("make-vector: bad length");
+	}
+
+	s_val = make_vector((int) number_real_value(pn),
+			    (argc > 1) ? argv[1] : SEXPR_FALSE);
+}
+
+/* (vector obj ...) */
+void vector_fn(int argc, SEXPR *argv)
+{
+	SEXPR *elems;
+	int i;
+
+	s_val = make_vector(argc, SEXPR_NIL);
+	elems = vector_elems(s_val);
+	for (i = 0; i < argc; i++) {
+		elems[i] = argv[i];
+	}
+}
+
+void vector_length(int argc, SEXPR *argv)
+{
+	struct number n;
+
+	build_real_number(&n, vector_size(vector_arg(argv[0])));
+	s_val = make_number(&n);
+}
+
+void vector_ref(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	v = vector_arg(argv[0]);
+	s_val = vector_elems(v)[vector_index_arg(argv[1], vector_size(v), 0)];
+}
+
+void vector_set(int argc, SEXPR *argv)
+{
+	SEXPR v;
+
+	v = vector_arg(argv[0]);
+	region_store(v, argv[2]);
+	vector_elems(v)[vector_index_arg(argv[1], vector_size(v), 0)] = argv[2];
+	s_val = argv[2];
+}
+
+/* (vector->list vector [start [end]]) */
+void vector_to_list(int argc, SEXPR *argv)
+{
+	SEXPR v;
+	int start, end;
+
+	v = vector_arg(argv[0]);
+	range_args(argc, argv, 1, vector_size(v), &start, &end);
+
+	/* consed from the end: the elements are read again after each gc */
+	s_val = SEXPR_NIL;
+	while (end > start) {
+		s_val = p_cons(vector_elems(v)[--end], s_val);
+	}
+}
+
+void list_to_vector(int argc, SEXPR *argv)
+{
+	s_val = make_vector_from_list(argv[0]);
+}
+
+/* (vector-fill! vector fill [start [end]]) */
+void vector_fill(int argc, SEXPR *argv)
+{
+	SEXPR v, *elems;
+	int start, end;
+
+	v = vector_arg(argv[0]);
+	range_args(argc, argv, 2, vector_size(v), &start, &end);
+	region_store(v, argv[1]);
+
+	elems = vector_elems(v);
+	while (start < end) {
+		elems[start++] = argv[1];
+	}
+	s_val = v;
+}
@@ -0,0 +1,12 @@
+; A special made by the program can name any local variable of its caller,
+; so the procedures using it keep their whole environment.
+(define getx (special () 'x))
+(define x 'global)
+(define (h x) (getx))
+(h 'local)
+(define (f x) (lambda () (getx)))
+((f 'local))
+(define (g x) (delay (getx)))
+(force (g 'local))
+(define (s x) (cons-stream (getx) '()))
+(stream-car (s 'local))
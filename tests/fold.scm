@@ -0,0 +1,11 @@
+; Builtins shadowed by internal defines are not folded.
+(define (h6) (define car cdr) (car '(1 2)))
+(h6)
+(define (h6c) (define + -) (+ 5 3))
+(h6c)
+(define (h7) (let ((a 1)) (define (+ x y) (* x y)) (+ 5 3)))
+(h7)
+(define (h8) (do ((i 0 (+ i 1))) ((= i 1) (define - +) (- 5 3))))
+(h8)
+(define (h9) (+ 5 3))
+(h9)
@@ -0,0 +1,31 @@
+; Calls are not inlined when the procedure or a variable it refers to is
+; shadowed by an internal define of the caller.
+(define (sq x) (* x x))
+(define (c3 y) (sq y))
+(c3 3)
+(define (c4) (define sq car) (sq '(3 4)))
+(c4)
+(define (c5 y) (define (sq z) 0) (sq y))
+(c5 3)
+(define n 100)
+(define (addn x) (+ x n))
+(define (caller1) (addn 1))
+(caller1)
+(define (caller2) (define n 7) (addn 1))
+(caller2)
+; An argument with effects is evaluated before the body of the inlined
+; procedure, as in the call.
+(define cnt 0)
+(define (tick) (set! cnt (+ cnt 1)) cnt)
+(define (g a) (list (tick) a))
+(define (f) (g (tick)))
+(f)
+(define (gc2 a) (cons (tick) a))
+(define (f2) (gc2 (tick)))
+(f2)
+(define (g3 a) (list a (tick)))
+(define (f3) (g3 (tick)))
+(f3)
+(define (g4 a) (if a 1 2))
+(define (f4) (g4 (tick)))
+(f4)
@@ -0,0 +1,26 @@
+; The in-place procedures check their argument before using it.
+(pmap-set! 5 'a 1)
+(pmap-delete! 5 5)
+(pvector-set! 5 0 1)
+(pvector-push! 5 1)
+(pvector-pop! 5)
+(pmap-set! (make-vector 3 0) 'a 1)
+(pvector-push! (pvector 1 2) 3)
+(define m (pmap-transient (make-pmap)))
+(pmap-set! m 'a 1)
+(pmap-count (pmap-delete! m 'a))
+(define v (pvector-transient (pvector 1 2)))
+(pvector-push! v 3)
+(pvector-pop! v)
+(pvector->list (pvector-persistent! v))
+; A transient keeps its count through nodes changed in place.
+(define (fill m i n) (if (= i n) m (fill (pmap-set! m i i) (+ i 1) n)))
+(define (drain m i n) (if (= i n) m (drain (pmap-delete! m i) (+ i 1) n)))
+(define t (fill (pmap-transient (make-pmap)) 0 200))
+(list (pmap-count t) (length (pmap->alist t)))
+(pmap-set! t 5 'five)
+(list (pmap-count t) (length (pmap->alist t)) (pmap-ref t 5))
+(drain t 0 150)
+(list (pmap-count t) (length (pmap->alist t)))
+(define p (pmap-persistent! t))
+(list (pmap-count (pmap-set p 1000 0)) (pmap-count p))
@@ -0,0 +1,22 @@
+#!/bin/sh
+# ===========================================================================
+# lispe, Scheme interpreter.
+# ===========================================================================
+#
+# Runs lispe on each tests/*.scm, from the data directory so that init.scm
+# is loaded, and compares what it prints with tests/*.out. The prompts,
+# the startup and gc messages and the empty lines are left out.
+
+srcdir=${srcdir:-.}
+lispe=`pwd`/src/lispe
+status=0
+
+cd "$srcdir/data" || exit 1
+for t in ../tests/*.scm; do
+	"$lispe" < "$t" 2>&1 |
+	    sed -e 's/\[gc[^]]*\]//g' -e 's/lispe> //g' |
+	    grep -v '^\[' | grep -v '^ *$' | diff -u "${t%.scm}.out" - ||
+	    { echo "FAIL: $t"; status=1; }
+done
+
+exit $status
@@ -0,0 +1,15 @@
+; Calls to builtins shadowed by an internal define do not get a site.
+(define (h6b x) (define car cdr) (car x))
+(h6b '(1 2))
+(define (h6d x y) (define * +) (* x y))
+(h6d 2 5)
+(define (h6e x) (car x))
+(h6e '(1 2))
+; A declared call keeps its checks on the result of a nested site, whose
+; operator can be redefined.
+(define (f x) (declare (flonum x)) (+ (* x x) 1))
+(f 3)
+(define * (lambda (a b) 'sym))
+(f 3)
+(define * (lambda (a b) 7))
+(f 3)